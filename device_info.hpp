@@ -0,0 +1,118 @@
+#pragma once
+
+#include "format_cache.hpp"
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include <vulkan/vulkan.hpp>
+
+namespace device_info
+{
+
+    // Everything about a physical device that cannot change while the
+    // program runs, queried once and handed to every helper instead of the
+    // vk::PhysicalDevice.
+    struct snapshot
+    {
+        vk::PhysicalDevice physical_device = nullptr;
+        vk::PhysicalDeviceProperties properties{};
+        vk::PhysicalDeviceFeatures features{};
+        vk::PhysicalDeviceMemoryProperties memory{};
+        std::vector< vk::QueueFamilyProperties > queue_families{};
+        format::capability_cache formats;
+
+        explicit snapshot( vk::PhysicalDevice _physical_device )
+            : physical_device( _physical_device )
+            , properties( _physical_device.getProperties() )
+            , features( _physical_device.getFeatures() )
+            , memory( _physical_device.getMemoryProperties() )
+            , queue_families( _physical_device.getQueueFamilyProperties() )
+            , formats( _physical_device )
+        {
+        }
+        snapshot( snapshot const & ) = delete;
+        snapshot &operator=( snapshot const & ) = delete;
+    };
+
+    inline std::shared_ptr< snapshot const >
+    take_snapshot( vk::PhysicalDevice physical_device )
+    {
+        return std::make_shared< snapshot const >( physical_device );
+    }
+
+    // Formats, present modes and per-family present support of one surface,
+    // which only change with the surface itself. The capabilities hold the
+    // current extent and transform, so they are the one query left per
+    // swapchain.
+    class surface_cache
+    {
+    private:
+        vk::PhysicalDevice physical_device = nullptr;
+        vk::SurfaceKHR surface = nullptr;
+        std::vector< vk::SurfaceFormatKHR > formats{};
+        std::vector< vk::PresentModeKHR > present_modes{};
+        // Per queue family: 0 unknown, 1 supported, 2 not supported.
+        std::vector< std::uint8_t > present_support{};
+
+    public:
+        // Drops everything cached for the previous surface.
+        void reset(
+            vk::PhysicalDevice _physical_device, vk::SurfaceKHR _surface )
+        {
+            physical_device = _physical_device;
+            surface = _surface;
+            formats.clear();
+            present_modes.clear();
+            present_support.clear();
+        }
+        vk::SurfaceKHR get_surface( void ) const
+        {
+            return surface;
+        }
+        vk::SurfaceCapabilitiesKHR get_capabilities( void ) const
+        {
+            check();
+            return physical_device.getSurfaceCapabilitiesKHR( surface );
+        }
+        std::vector< vk::SurfaceFormatKHR > const &get_formats( void )
+        {
+            check();
+            if( formats.empty() )
+                formats = physical_device.getSurfaceFormatsKHR( surface );
+            return formats;
+        }
+        std::vector< vk::PresentModeKHR > const &get_present_modes( void )
+        {
+            check();
+            if( present_modes.empty() )
+            {
+                present_modes =
+                    physical_device.getSurfacePresentModesKHR( surface );
+            }
+            return present_modes;
+        }
+        bool supports_present( std::uint32_t family )
+        {
+            check();
+            if( family >= present_support.size() )
+                present_support.resize( family + 1u, 0u );
+            if( present_support[ family ] == 0u )
+            {
+                present_support[ family ] =
+                    physical_device.getSurfaceSupportKHR( family, surface )
+                    ? 1u
+                    : 2u;
+            }
+            return present_support[ family ] == 1u;
+        }
+
+    private:
+        void check( void ) const
+        {
+            if( !surface )
+                throw std::runtime_error( "surface_cache: no surface!" );
+        }
+    };
+
+} // namespace device_info
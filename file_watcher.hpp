@@ -0,0 +1,125 @@
+#pragma once
+
+#include <atomic>
+#include <cstdio>
+#include <functional>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined( __linux__ )
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace watch
+{
+
+    using callback =
+        std::function< void( std::vector< std::string > const & ) >;
+
+    // Watches a set of files in one directory and calls back on its own
+    // thread with the names that were rewritten, one call per burst of
+    // events. Editors that save through a rename are covered too. Only
+    // implemented with inotify; elsewhere the watcher never fires, which
+    // is_supported() tells beforehand.
+    class file_watcher
+    {
+    private:
+        std::set< std::string > names;
+        callback changed;
+        std::atomic< bool > stopping{false};
+        int fd = -1;
+        std::thread worker{};
+
+    public:
+        static constexpr bool is_supported( void )
+        {
+#if defined( __linux__ )
+            return true;
+#else
+            return false;
+#endif
+        }
+
+        file_watcher(
+            std::string const &directory,
+            std::vector< std::string > const &files,
+            callback _changed )
+            : names( files.begin(), files.end() )
+            , changed( std::move( _changed ) )
+        {
+            if( !changed )
+            {
+                throw std::runtime_error( "file_watcher: invalid argument" );
+            }
+#if defined( __linux__ )
+            fd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+            if( fd < 0 ||
+                inotify_add_watch(
+                    fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO ) < 0 )
+            {
+                if( fd >= 0 ) close( fd );
+                throw std::runtime_error( "file_watcher: inotify failed!" );
+            }
+            worker = std::thread( [this] { run(); } );
+#else
+            (void)directory;
+#endif
+        }
+        file_watcher( file_watcher const & ) = delete;
+        file_watcher( file_watcher && ) = delete;
+        file_watcher &operator=( file_watcher const & ) = delete;
+        file_watcher &operator=( file_watcher && ) = delete;
+        ~file_watcher( void )
+        {
+            stopping = true;
+            if( worker.joinable() ) worker.join();
+#if defined( __linux__ )
+            if( fd >= 0 ) close( fd );
+#endif
+        }
+
+    private:
+#if defined( __linux__ )
+        void run( void )
+        {
+            alignas( inotify_event ) char buffer[ 4096 ];
+            while( !stopping )
+            {
+                pollfd p{fd, POLLIN, 0};
+                if( poll( &p, 1, 100 ) <= 0 ) continue;
+                std::set< std::string > burst;
+                ssize_t length;
+                while( ( length = read( fd, buffer, sizeof( buffer ) ) ) > 0 )
+                {
+                    for( char *it = buffer; it < buffer + length; )
+                    {
+                        auto const event =
+                            reinterpret_cast< inotify_event * >( it );
+                        if( event->len > 0u && names.count( event->name ) )
+                        {
+                            burst.insert( event->name );
+                        }
+                        it += sizeof( inotify_event ) + event->len;
+                    }
+                }
+                if( burst.empty() ) continue;
+                try
+                {
+                    changed( {burst.begin(), burst.end()} );
+                }
+                catch( std::exception &e )
+                {
+                    // Keep watching: the next save may fix it.
+                    fprintf( stderr, "file_watcher: %s\n", e.what() );
+                }
+            }
+        }
+#endif
+    };
+
+} // namespace watch
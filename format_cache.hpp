@@ -0,0 +1,184 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+#include <vulkan/vulkan.hpp>
+
+namespace format
+{
+
+    // Block-compressed formats textures can be streamed in: BC for
+    // desktop GPUs, ETC2 and ASTC for mobile ones.
+    inline std::vector< vk::Format > const &compressed_formats( void )
+    {
+        static std::vector< vk::Format > const formats = {
+            vk::Format::eBc1RgbUnormBlock,
+            vk::Format::eBc1RgbSrgbBlock,
+            vk::Format::eBc1RgbaUnormBlock,
+            vk::Format::eBc1RgbaSrgbBlock,
+            vk::Format::eBc3UnormBlock,
+            vk::Format::eBc3SrgbBlock,
+            vk::Format::eBc4UnormBlock,
+            vk::Format::eBc5UnormBlock,
+            vk::Format::eBc7UnormBlock,
+            vk::Format::eBc7SrgbBlock,
+            vk::Format::eEtc2R8G8B8UnormBlock,
+            vk::Format::eEtc2R8G8B8SrgbBlock,
+            vk::Format::eEtc2R8G8B8A8UnormBlock,
+            vk::Format::eEtc2R8G8B8A8SrgbBlock,
+            vk::Format::eAstc4x4UnormBlock,
+            vk::Format::eAstc4x4SrgbBlock,
+            vk::Format::eAstc6x6UnormBlock,
+            vk::Format::eAstc6x6SrgbBlock,
+            vk::Format::eAstc8x8UnormBlock,
+            vk::Format::eAstc8x8SrgbBlock};
+        return formats;
+    }
+
+    // Texel block of a format: extent in texels and size in bytes. Only
+    // the formats textures are streamed in are known.
+    struct block_info
+    {
+        std::uint32_t width = 1u, height = 1u, bytes = 0u;
+    };
+    inline block_info get_block_info( vk::Format format )
+    {
+        switch( format )
+        {
+        case vk::Format::eR8G8B8A8Unorm:
+        case vk::Format::eR8G8B8A8Srgb:
+        case vk::Format::eB8G8R8A8Unorm:
+        case vk::Format::eB8G8R8A8Srgb:
+            return {1u, 1u, 4u};
+        case vk::Format::eBc1RgbUnormBlock:
+        case vk::Format::eBc1RgbSrgbBlock:
+        case vk::Format::eBc1RgbaUnormBlock:
+        case vk::Format::eBc1RgbaSrgbBlock:
+        case vk::Format::eBc4UnormBlock:
+        case vk::Format::eEtc2R8G8B8UnormBlock:
+        case vk::Format::eEtc2R8G8B8SrgbBlock:
+            return {4u, 4u, 8u};
+        case vk::Format::eBc3UnormBlock:
+        case vk::Format::eBc3SrgbBlock:
+        case vk::Format::eBc5UnormBlock:
+        case vk::Format::eBc7UnormBlock:
+        case vk::Format::eBc7SrgbBlock:
+        case vk::Format::eEtc2R8G8B8A8UnormBlock:
+        case vk::Format::eEtc2R8G8B8A8SrgbBlock:
+        case vk::Format::eAstc4x4UnormBlock:
+        case vk::Format::eAstc4x4SrgbBlock:
+            return {4u, 4u, 16u};
+        case vk::Format::eAstc6x6UnormBlock:
+        case vk::Format::eAstc6x6SrgbBlock:
+            return {6u, 6u, 16u};
+        case vk::Format::eAstc8x8UnormBlock:
+        case vk::Format::eAstc8x8SrgbBlock:
+            return {8u, 8u, 16u};
+        default:
+            return {};
+        }
+    }
+    inline bool is_compressed( vk::Format format )
+    {
+        auto const block = get_block_info( format );
+        return block.width > 1u || block.height > 1u;
+    }
+    // Bytes of one width x height image in format, or 0 if unknown.
+    inline std::size_t image_size(
+        vk::Format format, std::uint32_t width, std::uint32_t height )
+    {
+        auto const block = get_block_info( format );
+        return std::size_t( ( width + block.width - 1u ) / block.width ) *
+            ( ( height + block.height - 1u ) / block.height ) * block.bytes;
+    }
+
+    // vk::FormatProperties of one physical device. The formats the renderer
+    // asks about (depth, swapchain colors, textures) are queried once at
+    // construction; anything else is queried on first use and kept.
+    // Thread-safe.
+    class capability_cache
+    {
+    private:
+        struct format_hash
+        {
+            std::size_t operator()( vk::Format format ) const
+            {
+                return static_cast< std::size_t >( format );
+            }
+        };
+
+        vk::PhysicalDevice physical_device = nullptr;
+        mutable std::mutex mutex{};
+        mutable std::unordered_map<
+            vk::Format,
+            vk::FormatProperties,
+            format_hash >
+            properties{};
+
+    public:
+        explicit capability_cache( vk::PhysicalDevice _physical_device )
+            : physical_device( _physical_device )
+        {
+            std::vector< vk::Format > formats = {
+                vk::Format::eD32Sfloat,
+                vk::Format::eD32SfloatS8Uint,
+                vk::Format::eD24UnormS8Uint,
+                vk::Format::eR8G8B8A8Unorm,
+                vk::Format::eR8G8B8A8Srgb,
+                vk::Format::eB8G8R8A8Unorm,
+                vk::Format::eB8G8R8A8Srgb};
+            formats.insert(
+                formats.end(),
+                compressed_formats().begin(),
+                compressed_formats().end() );
+            for( auto const f : formats )
+            {
+                properties.emplace(
+                    f, physical_device.getFormatProperties( f ) );
+            }
+        }
+
+        vk::FormatProperties get( vk::Format format ) const
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+            auto it = properties.find( format );
+            if( it == properties.end() )
+            {
+                it = properties
+                         .emplace(
+                             format,
+                             physical_device.getFormatProperties( format ) )
+                         .first;
+            }
+            return it->second;
+        }
+        bool supports(
+            vk::Format format,
+            vk::ImageTiling tiling,
+            vk::FormatFeatureFlags features ) const
+        {
+            auto const p = get( format );
+            auto const available = tiling == vk::ImageTiling::eLinear
+                ? p.linearTilingFeatures
+                : p.optimalTilingFeatures;
+            return ( available & features ) == features;
+        }
+        // The first of candidates supporting features.
+        vk::Format find_supported(
+            std::vector< vk::Format > const &candidates,
+            vk::ImageTiling tiling,
+            vk::FormatFeatureFlags features ) const
+        {
+            for( auto const &f : candidates )
+            {
+                if( supports( f, tiling, features ) ) return f;
+            }
+            throw std::runtime_error(
+                "capability_cache: failed to find format!" );
+        }
+    };
+
+} // namespace format
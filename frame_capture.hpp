@@ -0,0 +1,387 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace capture
+{
+
+    enum class pixel_order
+    {
+        rgba,
+        bgra
+    };
+
+    struct frame
+    {
+        std::uint64_t number = 0u;
+        std::uint32_t width = 0u, height = 0u;
+        std::size_t row_pitch = 0u;
+        pixel_order order = pixel_order::rgba;
+        std::uint8_t const *data = nullptr;
+    };
+
+    using sink = std::function< void( frame const & ) >;
+
+    // Owns the consumer thread of a ring of readback slots. The render thread
+    // takes a slot with acquire_slot(), records the copy into it and hands it
+    // over with submit(); the consumer waits for the GPU, runs the sink and
+    // releases the slot. By default a busy slot drops the frame and counts
+    // it, so capture never stalls rendering; a lossless capture waits for
+    // the consumer instead. A failing sink drops the frame as well and its
+    // first error is rethrown by flush().
+    class frame_capture
+    {
+    public:
+        static constexpr std::size_t npos =
+            std::numeric_limits< std::size_t >::max();
+
+    private:
+        struct pending
+        {
+            std::size_t slot;
+            frame info;
+            std::function< void( void ) > wait;
+        };
+
+        sink output;
+        std::vector< bool > busy;
+        std::size_t cursor = 0u;
+        std::deque< pending > queue{};
+        std::mutex mutex{};
+        std::condition_variable cond{};
+        bool stopping = false;
+        std::uint64_t captured = 0u, dropped = 0u;
+        std::exception_ptr error{};
+        std::thread worker{};
+
+    public:
+        frame_capture( std::size_t slot_count, sink _output )
+            : output( std::move( _output ) )
+            , busy( slot_count, false )
+        {
+            if( slot_count == 0u || !output )
+            {
+                throw std::runtime_error( "frame_capture: invalid argument" );
+            }
+            worker = std::thread( [this] { run(); } );
+        }
+        frame_capture( frame_capture const & ) = delete;
+        frame_capture( frame_capture && ) = delete;
+        frame_capture &operator=( frame_capture const & ) = delete;
+        frame_capture &operator=( frame_capture && ) = delete;
+        ~frame_capture( void )
+        {
+            {
+                std::lock_guard< std::mutex > lock( mutex );
+                stopping = true;
+            }
+            cond.notify_all();
+            if( worker.joinable() ) worker.join();
+        }
+
+        std::size_t slot_count( void ) const
+        {
+            return busy.size();
+        }
+
+        // A busy slot drops the frame (npos) unless wait is set, in which
+        // case the caller blocks until the consumer frees it.
+        std::size_t acquire_slot( bool wait = false )
+        {
+            std::unique_lock< std::mutex > lock( mutex );
+            if( wait ) cond.wait( lock, [this] { return !busy[ cursor ]; } );
+            if( busy[ cursor ] )
+            {
+                ++dropped;
+                return npos;
+            }
+            auto const slot = cursor;
+            busy[ slot ] = true;
+            cursor = ( cursor + 1u ) % busy.size();
+            return slot;
+        }
+
+        void submit(
+            std::size_t slot, frame info, std::function< void( void ) > wait )
+        {
+            {
+                std::lock_guard< std::mutex > lock( mutex );
+                queue.push_back( {slot, info, std::move( wait )} );
+            }
+            cond.notify_all();
+        }
+
+        // Blocks until every submitted frame has reached the sink, then
+        // rethrows the first error the sink has raised since the last call.
+        void flush( void )
+        {
+            std::unique_lock< std::mutex > lock( mutex );
+            cond.wait( lock, [this] {
+                if( !queue.empty() ) return false;
+                for( auto b : busy )
+                    if( b ) return false;
+                return true;
+            } );
+            if( error )
+            {
+                auto const e = error;
+                error = nullptr;
+                std::rethrow_exception( e );
+            }
+        }
+
+        std::uint64_t captured_count( void )
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+            return captured;
+        }
+        std::uint64_t dropped_count( void )
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+            return dropped;
+        }
+
+    private:
+        void run( void )
+        {
+            while( true )
+            {
+                pending item;
+                {
+                    std::unique_lock< std::mutex > lock( mutex );
+                    cond.wait(
+                        lock, [this] { return stopping || !queue.empty(); } );
+                    if( queue.empty() ) return;
+                    item = std::move( queue.front() );
+                    queue.pop_front();
+                }
+                std::exception_ptr failure{};
+                try
+                {
+                    item.wait();
+                    output( item.info );
+                }
+                catch( ... )
+                {
+                    failure = std::current_exception();
+                }
+                {
+                    std::lock_guard< std::mutex > lock( mutex );
+                    busy[ item.slot ] = false;
+                    if( !failure )
+                        ++captured;
+                    else
+                    {
+                        ++dropped;
+                        if( !error ) error = failure;
+                    }
+                }
+                cond.notify_all();
+            }
+        }
+    };
+
+    inline void write_rgb_row(
+        std::vector< char > &row, frame const &f, std::uint32_t y )
+    {
+        auto const src = f.data + f.row_pitch * y;
+        for( std::uint32_t x = 0u; x < f.width; ++x )
+        {
+            auto const p = src + x * 4u;
+            if( f.order == pixel_order::bgra )
+            {
+                row[ x * 3u + 0u ] = static_cast< char >( p[ 2 ] );
+                row[ x * 3u + 1u ] = static_cast< char >( p[ 1 ] );
+                row[ x * 3u + 2u ] = static_cast< char >( p[ 0 ] );
+            }
+            else
+            {
+                row[ x * 3u + 0u ] = static_cast< char >( p[ 0 ] );
+                row[ x * 3u + 1u ] = static_cast< char >( p[ 1 ] );
+                row[ x * 3u + 2u ] = static_cast< char >( p[ 2 ] );
+            }
+        }
+    }
+
+    inline void write_ppm( std::string const &filename, frame const &f )
+    {
+        std::ofstream file( filename, std::ios::binary );
+        if( !file.is_open() )
+        {
+            throw std::runtime_error( "write_ppm: failed to open file!" );
+        }
+        file << "P6\n" << f.width << ' ' << f.height << "\n255\n";
+        std::vector< char > row( f.width * 3u );
+        for( std::uint32_t y = 0u; y < f.height; ++y )
+        {
+            write_rgb_row( row, f, y );
+            file.write( row.data(), row.size() );
+        }
+        if( !file )
+        {
+            throw std::runtime_error( "write_ppm: failed to write file!" );
+        }
+    }
+
+    struct image
+    {
+        std::uint32_t width = 0u, height = 0u;
+        std::vector< std::uint8_t > rgb{};
+    };
+
+    inline image to_image( frame const &f )
+    {
+        image ret;
+        ret.width = f.width;
+        ret.height = f.height;
+        ret.rgb.resize( f.width * f.height * 3u );
+        std::vector< char > row( f.width * 3u );
+        for( std::uint32_t y = 0u; y < f.height; ++y )
+        {
+            write_rgb_row( row, f, y );
+            std::copy(
+                row.begin(), row.end(), ret.rgb.begin() + y * row.size() );
+        }
+        return ret;
+    }
+
+    inline image read_ppm( std::string const &filename )
+    {
+        std::ifstream file( filename, std::ios::binary );
+        if( !file.is_open() )
+        {
+            throw std::runtime_error( "read_ppm: failed to open file!" );
+        }
+        std::string magic;
+        unsigned int max_value = 0u;
+        image ret;
+        file >> magic >> ret.width >> ret.height >> max_value;
+        if( !file || magic != "P6" || max_value != 255u )
+        {
+            throw std::runtime_error( "read_ppm: unsupported format!" );
+        }
+        file.get();
+        ret.rgb.resize( ret.width * ret.height * 3u );
+        file.read(
+            reinterpret_cast< char * >( ret.rgb.data() ), ret.rgb.size() );
+        if( !file )
+        {
+            throw std::runtime_error( "read_ppm: truncated file!" );
+        }
+        return ret;
+    }
+
+    struct image_difference
+    {
+        bool same_size = false;
+        unsigned int max_channel_difference = 0u;
+        std::size_t mismatched_pixels = 0u;
+    };
+
+    // A pixel mismatches when any channel differs by more than tolerance.
+    inline image_difference compare_images(
+        image const &actual, image const &expected, unsigned int tolerance )
+    {
+        image_difference ret;
+        ret.same_size = actual.width == expected.width &&
+            actual.height == expected.height;
+        if( !ret.same_size ) return ret;
+        for( std::size_t i = 0u; i < actual.rgb.size(); i += 3u )
+        {
+            bool mismatch = false;
+            for( std::size_t c = 0u; c < 3u; ++c )
+            {
+                auto const a = actual.rgb[ i + c ], e = expected.rgb[ i + c ];
+                unsigned int const d = a > e ? a - e : e - a;
+                ret.max_channel_difference =
+                    std::max( ret.max_channel_difference, d );
+                mismatch = mismatch || d > tolerance;
+            }
+            if( mismatch ) ++ret.mismatched_pixels;
+        }
+        return ret;
+    }
+
+    // One numbered PPM file per frame: prefix000000.ppm, prefix000001.ppm...
+    inline sink ppm_sink( std::string prefix )
+    {
+        return [prefix]( frame const &f ) {
+            char number[ 32 ];
+            std::snprintf(
+                number,
+                sizeof( number ),
+                "%06llu",
+                static_cast< unsigned long long >( f.number ) );
+            write_ppm( prefix + number + ".ppm", f );
+        };
+    }
+
+    // All frames appended to one stream of packed RGB24, e.g. for
+    // `ffmpeg -f rawvideo -pixel_format rgb24 -video_size WxH -i file`.
+    // A raw stream has no header, so a frame of another size (after a
+    // resize) starts a new stream in filename.1, filename.2 and so on.
+    inline sink raw_sink( std::string const &filename )
+    {
+        struct stream
+        {
+            std::string filename;
+            std::ofstream file{};
+            std::uint32_t width = 0u, height = 0u;
+            unsigned int segment = 0u;
+
+            void open( void )
+            {
+                auto const name = segment == 0u
+                    ? filename
+                    : filename + "." + std::to_string( segment );
+                file = std::ofstream(
+                    name, std::ios::binary | std::ios::trunc );
+                if( !file.is_open() )
+                {
+                    throw std::runtime_error(
+                        "raw_sink: failed to open file!" );
+                }
+            }
+        };
+        auto s = std::make_shared< stream >();
+        s->filename = filename;
+        s->open();
+        return [s]( frame const &f ) {
+            if( s->width != f.width || s->height != f.height )
+            {
+                if( s->width != 0u || s->height != 0u )
+                {
+                    ++s->segment;
+                    s->open();
+                }
+                s->width = f.width;
+                s->height = f.height;
+            }
+            std::vector< char > row( f.width * 3u );
+            for( std::uint32_t y = 0u; y < f.height; ++y )
+            {
+                write_rgb_row( row, f, y );
+                s->file.write( row.data(), row.size() );
+            }
+            if( !s->file )
+            {
+                throw std::runtime_error( "raw_sink: failed to write file!" );
+            }
+        };
+    }
+
+} // namespace capture
@@ -0,0 +1,417 @@
+#pragma once
+
+#include "memory_budget.hpp"
+#include "mesh_optimizer.hpp"
+#include "queue_timeline.hpp"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+#include <vulkan/vulkan.hpp>
+
+namespace geometry
+{
+
+    constexpr std::uint32_t INVALID_OFFSET =
+        std::numeric_limits< std::uint32_t >::max();
+
+    // First-fit free list over [0, capacity) in whole elements. Released
+    // ranges merge with free neighbours, so the arena only fragments as
+    // much as the live ranges themselves do.
+    class range_allocator
+    {
+    private:
+        // Offset to count of every free range, none of them adjacent.
+        std::map< std::uint32_t, std::uint32_t > free_ranges{};
+        std::uint32_t capacity = 0u;
+        std::uint32_t used = 0u;
+
+    public:
+        explicit range_allocator( std::uint32_t _capacity = 0u )
+            : capacity( _capacity )
+        {
+            if( capacity != 0u ) free_ranges.emplace( 0u, capacity );
+        }
+
+        // INVALID_OFFSET when no free range holds count elements.
+        std::uint32_t allocate( std::uint32_t count )
+        {
+            if( count == 0u ) return 0u;
+            for( auto it = free_ranges.begin(); it != free_ranges.end(); ++it )
+            {
+                if( it->second < count ) continue;
+                auto const offset = it->first;
+                auto const left = it->second - count;
+                free_ranges.erase( it );
+                if( left != 0u ) free_ranges.emplace( offset + count, left );
+                used += count;
+                return offset;
+            }
+            return INVALID_OFFSET;
+        }
+        void release( std::uint32_t offset, std::uint32_t count )
+        {
+            if( count == 0u ) return;
+            if( offset > capacity || count > capacity - offset )
+            {
+                throw std::runtime_error(
+                    "range_allocator::release: out of range!" );
+            }
+            auto next = free_ranges.lower_bound( offset );
+            auto const overlaps_previous = next != free_ranges.begin() &&
+                std::prev( next )->first + std::prev( next )->second > offset;
+            if( overlaps_previous ||
+                ( next != free_ranges.end() && next->first < offset + count ) )
+            {
+                throw std::runtime_error(
+                    "range_allocator::release: already free!" );
+            }
+            used -= count;
+            if( next != free_ranges.begin() )
+            {
+                auto const previous = std::prev( next );
+                if( previous->first + previous->second == offset )
+                {
+                    offset = previous->first;
+                    count += previous->second;
+                    free_ranges.erase( previous );
+                }
+            }
+            if( next != free_ranges.end() && next->first == offset + count )
+            {
+                count += next->second;
+                free_ranges.erase( next );
+            }
+            free_ranges.emplace( offset, count );
+        }
+
+        std::uint32_t get_capacity( void ) const
+        {
+            return capacity;
+        }
+        std::uint32_t get_used( void ) const
+        {
+            return used;
+        }
+        std::uint32_t get_largest_free( void ) const
+        {
+            std::uint32_t ret = 0u;
+            for( auto const &r : free_ranges ) ret = std::max( ret, r.second );
+            return ret;
+        }
+    };
+
+    // Where a mesh lives in a pool: draw it with firstIndex = first_index
+    // and vertexOffset = vertex_offset, its indices being relative to its
+    // own first vertex.
+    struct mesh_range
+    {
+        std::int32_t vertex_offset = 0;
+        std::uint32_t vertex_count = 0u;
+        std::uint32_t first_index = 0u;
+        std::uint32_t index_count = 0u;
+    };
+
+    // One device-local vertex arena and one index arena shared by every
+    // mesh, so a scene draws with a single vertex and index buffer bind.
+    // Meshes are added and removed at runtime by sub-allocating the arenas;
+    // only the arenas and a fixed staging ring are ever allocated. All
+    // vertices have the same stride and all indices the same width.
+    // add() and remove() may be called from any thread.
+    class pool
+    {
+    private:
+        // The staging ring: STAGING_REGIONS regions of STAGING_SIZE bytes,
+        // each reused once its last copy has completed.
+        static constexpr vk::DeviceSize STAGING_SIZE = 1u << 20u;
+        static constexpr std::size_t STAGING_REGIONS = 4u;
+
+        struct arena
+        {
+            memory::allocation memory{};
+            vk::UniqueBuffer buffer{};
+            void *mapped = nullptr;
+            range_allocator ranges{};
+            // How draws read it, for the barrier after a staged copy.
+            vk::AccessFlags read_access{};
+        };
+
+        vk::Device device = nullptr;
+        timeline::queue_timeline *uploads = nullptr;
+        vk::DeviceSize vertex_stride = 0u;
+        mesh::index_width width = mesh::index_width::u16;
+        std::mutex mutex{};
+        arena vertices{}, indices{};
+        // Only when an arena is not host visible.
+        struct staging_region
+        {
+            vk::UniqueCommandBuffer command_buffer{};
+            timeline::point done{};
+        };
+        memory::allocation staging_memory{};
+        vk::UniqueBuffer staging{};
+        void *staging_mapped = nullptr;
+        vk::UniqueCommandPool command_pool{};
+        std::array< staging_region, STAGING_REGIONS > regions{};
+        std::size_t next_region = 0u;
+
+    public:
+        // Capacities are in vertices of vertex_stride bytes and in indices
+        // of index_width. Uploads that cannot be written in place are
+        // submitted through _uploads, whose queue (of queue_family_index)
+        // must support transfers and also run the draws; add() does not
+        // wait for them.
+        pool(
+            memory::budget &memory_budget,
+            vk::Device _device,
+            timeline::queue_timeline &_uploads,
+            std::uint32_t queue_family_index,
+            vk::DeviceSize _vertex_stride,
+            std::uint32_t vertex_capacity,
+            mesh::index_width index_width,
+            std::uint32_t index_capacity )
+            : device( _device )
+            , uploads( &_uploads )
+            , vertex_stride( _vertex_stride )
+            , width( index_width )
+        {
+            create_arena(
+                memory_budget,
+                vertices,
+                vertex_capacity,
+                vertex_stride,
+                vk::BufferUsageFlagBits::eVertexBuffer );
+            vertices.read_access = vk::AccessFlagBits::eVertexAttributeRead;
+            create_arena(
+                memory_budget,
+                indices,
+                index_capacity,
+                mesh::index_size( width ),
+                vk::BufferUsageFlagBits::eIndexBuffer );
+            indices.read_access = vk::AccessFlagBits::eIndexRead;
+            if( vertices.mapped && indices.mapped ) return;
+
+            // Owned by the pool, so uploads never share a command pool
+            // with the render thread.
+            vk::CommandPoolCreateInfo command_pool_info;
+            command_pool_info.flags =
+                vk::CommandPoolCreateFlagBits::eResetCommandBuffer;
+            command_pool_info.queueFamilyIndex = queue_family_index;
+            command_pool = device.createCommandPoolUnique( command_pool_info );
+            vk::CommandBufferAllocateInfo allocate_info;
+            allocate_info.level = vk::CommandBufferLevel::ePrimary;
+            allocate_info.commandPool = *command_pool;
+            allocate_info.commandBufferCount =
+                static_cast< std::uint32_t >( STAGING_REGIONS );
+            auto command_buffers =
+                device.allocateCommandBuffersUnique( allocate_info );
+            for( std::size_t i = 0u; i < STAGING_REGIONS; ++i )
+                regions[ i ].command_buffer = std::move( command_buffers[ i ] );
+
+            vk::BufferCreateInfo buffer_info;
+            buffer_info.size = STAGING_SIZE * STAGING_REGIONS;
+            buffer_info.usage = vk::BufferUsageFlagBits::eTransferSrc;
+            buffer_info.sharingMode = vk::SharingMode::eExclusive;
+            staging = device.createBufferUnique( buffer_info );
+            staging_memory = memory_budget.allocate(
+                device,
+                device.getBufferMemoryRequirements( *staging ),
+                {vk::MemoryPropertyFlagBits::eHostVisible |
+                 vk::MemoryPropertyFlagBits::eHostCoherent} );
+            device.bindBufferMemory( *staging, *staging_memory, 0u );
+            staging_mapped = device.mapMemory(
+                *staging_memory, 0u, STAGING_SIZE * STAGING_REGIONS );
+        }
+        pool( pool const & ) = delete;
+        pool &operator=( pool const & ) = delete;
+        // The staging ring must outlive its copies.
+        ~pool( void )
+        {
+            for( auto const &region : regions ) region.done.wait();
+        }
+
+        // vertex_data holds vertex_count vertices of the pool's stride.
+        // Throws when either arena has no free range large enough. Staged
+        // copies are only submitted; their barriers make the mesh visible
+        // to draws submitted later on the same queue.
+        mesh_range add(
+            void const *vertex_data,
+            std::uint32_t vertex_count,
+            std::vector< std::uint32_t > const &mesh_indices )
+        {
+            auto const packed = mesh::pack_indices( mesh_indices, width );
+            auto const index_count =
+                static_cast< std::uint32_t >( mesh_indices.size() );
+            std::lock_guard< std::mutex > lock( mutex );
+            auto const vertex_offset = vertices.ranges.allocate( vertex_count );
+            if( vertex_offset == INVALID_OFFSET )
+                throw std::runtime_error( "pool::add: vertex arena full!" );
+            auto const first_index = indices.ranges.allocate( index_count );
+            if( first_index == INVALID_OFFSET )
+            {
+                vertices.ranges.release( vertex_offset, vertex_count );
+                throw std::runtime_error( "pool::add: index arena full!" );
+            }
+            write( vertices,
+                   vertex_offset * vertex_stride,
+                   vertex_data,
+                   vertex_count * vertex_stride );
+            write( indices,
+                   first_index * mesh::index_size( width ),
+                   packed.data.data(),
+                   packed.data.size() );
+
+            mesh_range ret;
+            ret.vertex_offset = static_cast< std::int32_t >( vertex_offset );
+            ret.vertex_count = vertex_count;
+            ret.first_index = first_index;
+            ret.index_count = index_count;
+            return ret;
+        }
+        template < typename V >
+        mesh_range add(
+            std::vector< V > const &mesh_vertices,
+            std::vector< std::uint32_t > const &mesh_indices )
+        {
+            if( sizeof( V ) != vertex_stride )
+                throw std::runtime_error( "pool::add: wrong vertex size!" );
+            return add(
+                mesh_vertices.data(),
+                static_cast< std::uint32_t >( mesh_vertices.size() ),
+                mesh_indices );
+        }
+        // Once no submitted work draws the mesh any more.
+        void remove( mesh_range const &range )
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+            vertices.ranges.release(
+                static_cast< std::uint32_t >( range.vertex_offset ),
+                range.vertex_count );
+            indices.ranges.release( range.first_index, range.index_count );
+        }
+
+        vk::Buffer get_vertex_buffer( void ) const
+        {
+            return *vertices.buffer;
+        }
+        vk::Buffer get_index_buffer( void ) const
+        {
+            return *indices.buffer;
+        }
+        mesh::index_width get_index_width( void ) const
+        {
+            return width;
+        }
+        // Not synchronized with add() and remove().
+        range_allocator const &get_vertex_ranges( void ) const
+        {
+            return vertices.ranges;
+        }
+        range_allocator const &get_index_ranges( void ) const
+        {
+            return indices.ranges;
+        }
+
+    private:
+        void create_arena(
+            memory::budget &memory_budget,
+            arena &a,
+            std::uint32_t capacity,
+            vk::DeviceSize element_size,
+            vk::BufferUsageFlags usage )
+        {
+            if( capacity == 0u )
+                throw std::runtime_error( "pool: empty arena!" );
+            auto const size = capacity * element_size;
+            vk::BufferCreateInfo buffer_info;
+            buffer_info.size = size;
+            buffer_info.usage = usage | vk::BufferUsageFlagBits::eTransferDst;
+            buffer_info.sharingMode = vk::SharingMode::eExclusive;
+            a.buffer = device.createBufferUnique( buffer_info );
+            std::vector< vk::MemoryPropertyFlags > candidates = {
+                vk::MemoryPropertyFlagBits::eDeviceLocal};
+            if( memory_budget.has_mappable_device_local() )
+            {
+                candidates.insert(
+                    candidates.begin(), memory::MAPPABLE_DEVICE_LOCAL );
+            }
+            a.memory = memory_budget.allocate(
+                device, device.getBufferMemoryRequirements( *a.buffer ),
+                candidates );
+            device.bindBufferMemory( *a.buffer, *a.memory, 0u );
+            if( a.memory.host_visible() )
+                a.mapped = device.mapMemory( *a.memory, 0u, size );
+            a.ranges = range_allocator( capacity );
+        }
+        void write(
+            arena &a,
+            vk::DeviceSize offset,
+            void const *data,
+            vk::DeviceSize size )
+        {
+            auto const bytes = static_cast< std::uint8_t const * >( data );
+            if( a.mapped )
+            {
+                std::memcpy(
+                    static_cast< std::uint8_t * >( a.mapped ) + offset,
+                    bytes,
+                    static_cast< std::size_t >( size ) );
+                return;
+            }
+            for( vk::DeviceSize done = 0u; done < size; done += STAGING_SIZE )
+            {
+                auto const chunk = std::min( STAGING_SIZE, size - done );
+                auto const index = next_region;
+                next_region = ( next_region + 1u ) % STAGING_REGIONS;
+                auto &region = regions[ index ];
+                // Only blocks once the ring has wrapped onto a copy still
+                // in flight.
+                region.done.wait();
+                std::memcpy(
+                    static_cast< std::uint8_t * >( staging_mapped ) +
+                        index * STAGING_SIZE,
+                    bytes + done,
+                    static_cast< std::size_t >( chunk ) );
+                auto const &command_buffer = region.command_buffer;
+                vk::CommandBufferBeginInfo begin_info;
+                begin_info.flags =
+                    vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
+                command_buffer->begin( begin_info );
+                vk::BufferCopy copy;
+                copy.srcOffset = index * STAGING_SIZE;
+                copy.dstOffset = offset + done;
+                copy.size = chunk;
+                command_buffer->copyBuffer( *staging, *a.buffer, copy );
+                // Later submissions on the queue draw from the range.
+                vk::BufferMemoryBarrier barrier;
+                barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+                barrier.dstAccessMask = a.read_access;
+                barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+                barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+                barrier.buffer = *a.buffer;
+                barrier.offset = copy.dstOffset;
+                barrier.size = chunk;
+                command_buffer->pipelineBarrier(
+                    vk::PipelineStageFlagBits::eTransfer,
+                    vk::PipelineStageFlagBits::eVertexInput,
+                    vk::DependencyFlags(),
+                    nullptr,
+                    barrier,
+                    nullptr );
+                command_buffer->end();
+                vk::SubmitInfo submit_info;
+                submit_info.commandBufferCount = 1u;
+                submit_info.pCommandBuffers = &*command_buffer;
+                region.done.line = uploads;
+                region.done.value = uploads->submit( {submit_info} );
+            }
+        }
+    };
+
+} // namespace geometry
@@ -0,0 +1,288 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace jobs
+{
+
+    using task_id = std::size_t;
+
+    // Tasks with dependencies, built once and run as often as needed (e.g.
+    // once per frame). A task becomes ready when every task it was added
+    // after has finished.
+    class task_graph
+    {
+        friend class job_system;
+
+    private:
+        struct task
+        {
+            std::function< void( void ) > work{};
+            std::vector< task * > successors{};
+            std::size_t dependencies = 0u;
+            std::atomic< std::size_t > remaining{0u};
+        };
+        // A deque keeps the tasks in place as it grows.
+        std::deque< task > tasks{};
+
+    public:
+        task_id add(
+            std::function< void( void ) > work,
+            std::initializer_list< task_id > after = {} )
+        {
+            return add( std::move( work ), std::vector< task_id >( after ) );
+        }
+        task_id add(
+            std::function< void( void ) > work,
+            std::vector< task_id > const &after )
+        {
+            auto const id = tasks.size();
+            for( auto dependency : after )
+            {
+                if( dependency >= id )
+                {
+                    throw std::runtime_error(
+                        "task_graph::add: unknown dependency!" );
+                }
+            }
+            tasks.emplace_back();
+            auto &t = tasks.back();
+            t.work = std::move( work );
+            for( auto dependency : after )
+            {
+                tasks[ dependency ].successors.push_back( &t );
+            }
+            t.dependencies = after.size();
+            return id;
+        }
+        std::size_t size( void ) const
+        {
+            return tasks.size();
+        }
+    };
+
+    // Work-stealing scheduler: every worker owns a deque, runs its own
+    // tasks newest first and steals the oldest task of another worker
+    // when it runs dry. The thread calling run() takes part as worker 0.
+    class job_system
+    {
+    public:
+        struct statistics
+        {
+            // Busy share of the time since the last call, per worker.
+            std::vector< double > utilisation{};
+            std::vector< std::uint64_t > tasks{};
+        };
+
+    private:
+        using clock = std::chrono::steady_clock;
+        struct worker_queue
+        {
+            std::mutex mutex{};
+            std::deque< task_graph::task * > tasks{};
+            std::atomic< std::uint64_t > busy_ns{0u};
+            std::atomic< std::uint64_t > executed{0u};
+        };
+
+        std::vector< std::unique_ptr< worker_queue > > queues{};
+        std::vector< std::thread > threads{};
+        std::mutex sleep_mutex{};
+        std::condition_variable wake{};
+        std::atomic< std::size_t > queued{0u};
+        std::atomic< std::size_t > outstanding{0u};
+        std::atomic< bool > stopping{false};
+        std::mutex error_mutex{};
+        std::exception_ptr error{};
+        clock::time_point window_start = clock::now();
+
+    public:
+        // worker_count threads in addition to the caller of run().
+        explicit job_system( std::size_t worker_count = default_workers() )
+        {
+            for( std::size_t i = 0u; i <= worker_count; ++i )
+                queues.push_back( std::make_unique< worker_queue >() );
+            for( std::size_t i = 1u; i <= worker_count; ++i )
+                threads.emplace_back( [this, i] { worker( i ); } );
+        }
+        job_system( job_system const & ) = delete;
+        job_system( job_system && ) = delete;
+        job_system &operator=( job_system const & ) = delete;
+        job_system &operator=( job_system && ) = delete;
+        ~job_system( void )
+        {
+            {
+                std::lock_guard< std::mutex > lock( sleep_mutex );
+                stopping = true;
+            }
+            wake.notify_all();
+            for( auto &t : threads )
+                t.join();
+        }
+
+        static std::size_t default_workers( void )
+        {
+            auto const cores = std::thread::hardware_concurrency();
+            return cores > 1u ? cores - 1u : 0u;
+        }
+        std::size_t get_worker_count( void ) const
+        {
+            return queues.size();
+        }
+
+        // Runs every task of graph and returns once all have finished.
+        // After a task throws, the remaining ones are skipped and the
+        // first exception is rethrown here.
+        void run( task_graph &graph )
+        {
+            if( graph.tasks.empty() ) return;
+            if( outstanding != 0u )
+            {
+                throw std::runtime_error( "job_system::run: not reentrant" );
+            }
+            outstanding = graph.tasks.size();
+            for( auto &t : graph.tasks )
+                t.remaining = t.dependencies;
+            std::size_t next = 0u;
+            for( auto &t : graph.tasks )
+            {
+                if( t.dependencies != 0u ) continue;
+                push( next, &t );
+                next = ( next + 1u ) % queues.size();
+            }
+            while( outstanding != 0u )
+            {
+                if( auto const t = pop( 0u ) )
+                    execute( 0u, t );
+                else
+                    std::this_thread::yield();
+            }
+            std::exception_ptr e;
+            {
+                std::lock_guard< std::mutex > lock( error_mutex );
+                std::swap( e, error );
+            }
+            if( e ) std::rethrow_exception( e );
+        }
+
+        statistics collect_statistics( void )
+        {
+            auto const now = clock::now();
+            auto const window = static_cast< double >(
+                std::chrono::duration_cast< std::chrono::nanoseconds >(
+                    now - window_start )
+                    .count() );
+            window_start = now;
+            statistics ret;
+            for( auto &q : queues )
+            {
+                auto const busy =
+                    static_cast< double >( q->busy_ns.exchange( 0u ) );
+                ret.utilisation.push_back(
+                    window > 0.0 ? busy / window : 0.0 );
+                ret.tasks.push_back( q->executed.exchange( 0u ) );
+            }
+            return ret;
+        }
+
+    private:
+        void push( std::size_t index, task_graph::task *t )
+        {
+            {
+                std::lock_guard< std::mutex > lock( queues[ index ]->mutex );
+                queues[ index ]->tasks.push_back( t );
+                ++queued;
+            }
+            // Sleeping workers test queued under sleep_mutex.
+            {
+                std::lock_guard< std::mutex > lock( sleep_mutex );
+            }
+            wake.notify_one();
+        }
+        task_graph::task *pop( std::size_t index )
+        {
+            {
+                auto &own = *queues[ index ];
+                std::lock_guard< std::mutex > lock( own.mutex );
+                if( !own.tasks.empty() )
+                {
+                    auto const t = own.tasks.back();
+                    own.tasks.pop_back();
+                    --queued;
+                    return t;
+                }
+            }
+            for( std::size_t i = 1u; i < queues.size(); ++i )
+            {
+                auto &victim = *queues[ ( index + i ) % queues.size() ];
+                std::lock_guard< std::mutex > lock( victim.mutex );
+                if( !victim.tasks.empty() )
+                {
+                    auto const t = victim.tasks.front();
+                    victim.tasks.pop_front();
+                    --queued;
+                    return t;
+                }
+            }
+            return nullptr;
+        }
+        void execute( std::size_t index, task_graph::task *t )
+        {
+            auto &q = *queues[ index ];
+            auto const start = clock::now();
+            bool failed;
+            {
+                std::lock_guard< std::mutex > lock( error_mutex );
+                failed = static_cast< bool >( error );
+            }
+            if( !failed && t->work )
+            {
+                try
+                {
+                    t->work();
+                }
+                catch( ... )
+                {
+                    std::lock_guard< std::mutex > lock( error_mutex );
+                    if( !error ) error = std::current_exception();
+                }
+            }
+            for( auto successor : t->successors )
+            {
+                if( --successor->remaining == 0u ) push( index, successor );
+            }
+            q.busy_ns += static_cast< std::uint64_t >(
+                std::chrono::duration_cast< std::chrono::nanoseconds >(
+                    clock::now() - start )
+                    .count() );
+            ++q.executed;
+            --outstanding;
+        }
+        void worker( std::size_t index )
+        {
+            while( true )
+            {
+                {
+                    std::unique_lock< std::mutex > lock( sleep_mutex );
+                    wake.wait(
+                        lock, [this] { return stopping || queued != 0u; } );
+                    if( stopping ) return;
+                }
+                while( auto const t = pop( index ) )
+                    execute( index, t );
+            }
+        }
+    };
+
+} // namespace jobs
@@ -1,16 +1,43 @@
 #define GLM_FORCE_DEPTH_ZERO_TO_ONE
 #include "VDeleter.hpp"
+#include "device_info.hpp"
+#include "file_watcher.hpp"
+#include "format_cache.hpp"
+#include "frame_capture.hpp"
+#include "geometry_pool.hpp"
+#include "job_system.hpp"
+#include "memory_budget.hpp"
+#include "mesh_optimizer.hpp"
+#include "occlusion_culling.hpp"
+#include "pipeline_variant.hpp"
+#include "queue_timeline.hpp"
+#include "render_graph.hpp"
+#include "sampler_cache.hpp"
+#include "scene_graph.hpp"
+#include "spsc_queue.hpp"
+#include "startup_profile.hpp"
+#include "texture_streaming.hpp"
 #include "vulkan_util.hpp"
 #include <GLFW/glfw3.h>
 #include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
 #include <fstream>
+#include <functional>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <iostream>
 #include <iterator>
+#include <map>
+#include <mutex>
 #include <set>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 #include <vulkan/vulkan.hpp>
 
@@ -29,24 +56,141 @@ constexpr bool DEBUG_MODE = true;
 constexpr std::size_t INVALID_INDEX = std::numeric_limits< std::size_t >::max();
 constexpr unsigned int WIDTH = 800;
 constexpr unsigned int HEIGHT = 600;
+constexpr std::size_t OFFSCREEN_IMAGE_COUNT = 2u;
+constexpr unsigned int GOLDEN_WIDTH = 256;
+constexpr unsigned int GOLDEN_HEIGHT = 256;
+constexpr std::array< float, 4 > GOLDEN_ANGLES = {{0.0f, 30.0f, 45.0f, 90.0f}};
+constexpr double GOLDEN_MAX_MISMATCH_RATIO = 0.001;
+constexpr unsigned int BENCHMARK_WIDTH = 1920;
+constexpr unsigned int BENCHMARK_HEIGHT = 1080;
+constexpr std::size_t BENCHMARK_FRAMES = 500u;
+constexpr std::uint32_t POST_GROUP_SIZE = 8u;
+// Share of --instances nodes whose rotation is animated every frame.
+constexpr std::size_t SPINNING_INSTANCE_STRIDE = 16u;
+// Generations of changed instance ranges kept for catching up the windows'
+// instance regions; a region further behind is copied whole.
+constexpr std::size_t INSTANCE_HISTORY = 8u;
+// Frame tasks per job system worker, so stealing can even out the load.
+constexpr std::size_t FRAME_TASK_SPLIT = 4u;
+// Messages between the main and the render thread, and how many frame
+// snapshots the main thread may run ahead of the presented one.
+constexpr std::size_t RENDER_QUEUE_SIZE = 16u;
+constexpr std::uint64_t MAX_FRAMES_AHEAD = 2u;
+// Streamed textures: format, default --texture-budget and how many
+// residency changes are uploaded per frame.
+constexpr vk::Format TEXTURE_FORMAT = vk::Format::eR8G8B8A8Unorm;
+constexpr std::size_t DEFAULT_TEXTURE_BUDGET_MB = 64u;
+constexpr std::size_t MAX_TEXTURE_UPLOADS = 2u;
+// Capacity of the geometry pool's arenas, in vertices and indices.
+constexpr std::uint32_t GEOMETRY_POOL_VERTICES = 1u << 20u;
+constexpr std::uint32_t GEOMETRY_POOL_INDICES = 3u << 20u;
+
+// GLSL sources and the SPIR-V loaded from the working directory; with
+// --hot-reload edits to either are picked up while running.
+struct shader_file
+{
+    char const *source;
+    char const *binary;
+};
+constexpr std::array< shader_file, 3 > SHADER_FILES = {
+    {{"shader.vert", "vert.spv"},
+     {"shader.frag", "frag.spv"},
+     {"post.comp", "post.spv"}}};
+constexpr std::size_t VERTEX_SHADER = 0u;
+constexpr std::size_t FRAGMENT_SHADER = 1u;
+constexpr std::size_t POST_SHADER = 2u;
+
+// Specialization constants of shader.frag; each distinct value set is one
+// scene pipeline variant.
+enum class color_mode : std::uint32_t
+{
+    vertex,
+    grayscale,
+    inverted
+};
+constexpr std::uint32_t COLOR_MODE_CONSTANT_ID = 0u;
+constexpr variant::constants scene_variant( color_mode mode )
+{
+    return variant::constants().set(
+        COLOR_MODE_CONSTANT_ID, static_cast< std::uint32_t >( mode ) );
+}
+// Which draws of the scene render pass a variant is for. No shader reads
+// this constant; it keys the pipeline's fixed-function state (see
+// create_graphics_pipeline()) so the extra pipelines share the variant
+// cache and hot reload.
+enum class scene_pass : std::uint32_t
+{
+    color,
+    // Depth only, before the color draws.
+    depth_prepass,
+    // Bounding boxes inside occlusion queries: no color or depth writes.
+    occlusion_proxy
+};
+constexpr std::uint32_t SCENE_PASS_CONSTANT_ID = 1u;
+constexpr variant::constants
+with_scene_pass( variant::constants const &constants, scene_pass pass )
+{
+    return constants.set(
+        SCENE_PASS_CONSTANT_ID, static_cast< std::uint32_t >( pass ) );
+}
+constexpr scene_pass get_scene_pass( variant::constants const &constants )
+{
+    return SCENE_PASS_CONSTANT_ID < constants.count
+        ? static_cast< scene_pass >(
+              constants.values[ SCENE_PASS_CONSTANT_ID ] )
+        : scene_pass::color;
+}
 
 struct Vertex
 {
-    glm::vec3 pos;
-    glm::vec3 color;
+    vulkan::snorm16x4 pos;
+    vulkan::unorm8x4 color;
 
     static auto get_vertex_input_description( std::uint32_t binding = 0u )
     {
-        return vulkan::get_vertex_input_description< Vertex >(
-            binding, &Vertex::pos, &Vertex::color );
+        return vulkan::vertex_layout<
+            Vertex,
+            VULKAN_VERTEX_ATTRIBUTE( 0u, Vertex, pos ),
+            VULKAN_VERTEX_ATTRIBUTE( 1u, Vertex, color ) >::
+            get_vertex_input_description( binding );
+    }
+};
+static_assert( sizeof( Vertex ) == 12u, "Vertex: unexpected padding" );
+// Per-instance vertex input (locations 2 to 5): the columns of the model
+// matrix, as scene_graph::update() writes them.
+struct InstanceData
+{
+    glm::vec4 model0, model1, model2, model3;
+
+    static auto get_vertex_input_description( std::uint32_t binding = 1u )
+    {
+        using layout = vulkan::vertex_layout<
+            InstanceData,
+            VULKAN_VERTEX_ATTRIBUTE( 2u, InstanceData, model0 ),
+            VULKAN_VERTEX_ATTRIBUTE( 3u, InstanceData, model1 ),
+            VULKAN_VERTEX_ATTRIBUTE( 4u, InstanceData, model2 ),
+            VULKAN_VERTEX_ATTRIBUTE( 5u, InstanceData, model3 ) >;
+        return std::make_tuple(
+            layout::binding_description(
+                binding, vk::VertexInputRate::eInstance ),
+            layout::attribute_descriptions( binding ) );
     }
 };
+static_assert(
+    sizeof( InstanceData ) == scene::scene_graph::MATRIX_SIZE,
+    "InstanceData: must match scene_graph matrices" );
 struct UniformBufferObject
 {
     glm::mat4 model;
     glm::mat4 view;
     glm::mat4 proj;
 };
+// Push constants of post.comp.
+struct PostParameters
+{
+    std::uint32_t swap_red_blue = 0u;
+    std::uint32_t encode_srgb = 0u;
+};
 
 std::vector< Vertex > const vertices = {
     {{-0.5f, -0.5f, 0.0f}, {1.0f, 0.0f, 0.0f}},
@@ -78,24 +222,31 @@ static VKAPI_ATTR vk::Bool32 VKAPI_CALL debug_callback(
     return true;
 }
 
+// verbose lists every instance extension and layer first, which takes a
+// noticeable share of startup on some loaders.
 vk::UniqueInstance create_instance(
     std::vector< char const * > const extension_names,
-    std::vector< char const * > const layer_names )
+    std::vector< char const * > const layer_names,
+    bool verbose = false )
 {
-    auto const instance_extension_properties =
-        vk::enumerateInstanceExtensionProperties();
-    std::clog << "Extensions:" << std::endl;
-    for( auto const &v : instance_extension_properties )
-        std::clog << v.extensionName << ": specVersion = " << v.specVersion
-                  << std::endl;
-    auto const instance_layer_properties =
-        vk::enumerateInstanceLayerProperties();
-    std::clog << "Layers:" << std::endl;
-    for( auto const &v : instance_layer_properties )
-        std::clog << v.layerName << ": specVersion = " << v.specVersion
-                  << " : implementationVersion = " << v.implementationVersion
-                  << " : description" << v.description << std::endl;
-    std::clog << "---------------------------------------" << std::endl;
+    if( verbose )
+    {
+        auto const instance_extension_properties =
+            vk::enumerateInstanceExtensionProperties();
+        std::clog << "Extensions:" << std::endl;
+        for( auto const &v : instance_extension_properties )
+            std::clog << v.extensionName << ": specVersion = " << v.specVersion
+                      << std::endl;
+        auto const instance_layer_properties =
+            vk::enumerateInstanceLayerProperties();
+        std::clog << "Layers:" << std::endl;
+        for( auto const &v : instance_layer_properties )
+            std::clog << v.layerName << ": specVersion = " << v.specVersion
+                      << " : implementationVersion = "
+                      << v.implementationVersion << " : description"
+                      << v.description << std::endl;
+        std::clog << "---------------------------------------" << std::endl;
+    }
 
     vk::ApplicationInfo app_info;
     app_info.pApplicationName = "Test Vulkan";
@@ -171,7 +322,7 @@ vk::UniqueSurfaceKHR create_glfw_surface(
 }
 
 std::size_t select_best_physical_device_index(
-    std::vector< vk::PhysicalDevice > const &devs )
+    std::vector< vk::PhysicalDevice > const &devs, bool allow_cpu = false )
 {
     assert( !devs.empty() );
     for( std::size_t i = 0u; i < devs.size(); ++i )
@@ -185,6 +336,7 @@ std::size_t select_best_physical_device_index(
             return i;
         }
     }
+    if( allow_cpu && !devs.empty() ) return 0u;
     throw std::runtime_error( "select_best_physical_device_index: no device" );
 }
 
@@ -202,14 +354,13 @@ std::size_t select_graphics_queue_family_index(
     throw std::runtime_error( "select_graphics_queue_family_index: no queue" );
 }
 std::size_t select_surface_queue_family_index(
-    vk::PhysicalDevice device,
-    vk::SurfaceKHR surface,
-    std::vector< vk::QueueFamilyProperties > queue_familes )
+    device_info::surface_cache &surface_info,
+    std::vector< vk::QueueFamilyProperties > const &queue_familes )
 {
     for( std::uint32_t i = 0u; i < queue_familes.size(); ++i )
     {
         auto &p = queue_familes[ i ];
-        if( p.queueCount > 0 && device.getSurfaceSupportKHR( i, surface ) )
+        if( p.queueCount > 0 && surface_info.supports_present( i ) )
         {
             return i;
         }
@@ -271,7 +422,8 @@ vk::UniqueDevice create_device(
     std::vector< char const * > const &device_extension_names = {},
     std::vector< char const * > const &device_layer_names = {},
     vk::PhysicalDeviceFeatures const &physical_device_features =
-        vk::PhysicalDeviceFeatures() )
+        vk::PhysicalDeviceFeatures(),
+    void const *next = nullptr )
 {
     std::vector< vk::DeviceQueueCreateInfo > queue_info;
     queue_info.reserve( queue_set.size() );
@@ -283,6 +435,7 @@ vk::UniqueDevice create_device(
     }
 
     vk::DeviceCreateInfo device_info;
+    device_info.pNext = next;
     device_info.pQueueCreateInfos = queue_info.data();
     device_info.queueCreateInfoCount =
         static_cast< std::uint32_t >( queue_info.size() );
@@ -310,7 +463,8 @@ vk::UniqueSwapchainKHR create_swapchain(
     vk::Extent2D surface_extent,
     vk::SurfaceTransformFlagBitsKHR pre_transform,
     vk::PresentModeKHR present_mode,
-    vk::SwapchainKHR old_swapchain = nullptr )
+    vk::SwapchainKHR old_swapchain = nullptr,
+    vk::ImageUsageFlags image_usage = vk::ImageUsageFlagBits::eColorAttachment )
 {
     std::vector< std::uint32_t > unique_queues(
         queue_set.begin(), queue_set.end() );
@@ -321,7 +475,7 @@ vk::UniqueSwapchainKHR create_swapchain(
     swapchain_info.imageColorSpace = surface_format.colorSpace;
     swapchain_info.imageExtent = surface_extent;
     swapchain_info.imageArrayLayers = 1u;
-    swapchain_info.imageUsage = vk::ImageUsageFlagBits::eColorAttachment;
+    swapchain_info.imageUsage = image_usage;
     if( unique_queues.size() == 1u )
     {
         swapchain_info.imageSharingMode = vk::SharingMode::eExclusive;
@@ -343,22 +497,23 @@ vk::UniqueSwapchainKHR create_swapchain(
 
 std::tuple< vk::UniqueSwapchainKHR, vk::Format, vk::Extent2D >
 create_simple_swapchain(
-    vk::PhysicalDevice physical_device,
+    device_info::surface_cache &surface_info,
     vk::Device device,
-    vk::SurfaceKHR surface,
     std::set< std::uint32_t > queue,
-    vk::SwapchainKHR old_swapchain = nullptr )
+    vk::SwapchainKHR old_swapchain = nullptr,
+    vk::ImageUsageFlags image_usage = vk::ImageUsageFlagBits::eColorAttachment )
 {
-    auto surface_capabilities =
-        physical_device.getSurfaceCapabilitiesKHR( surface );
-    auto surface_formats = physical_device.getSurfaceFormatsKHR( surface );
-    auto surface_present_modes =
-        physical_device.getSurfacePresentModesKHR( surface );
-
-    auto surface_format = select_surface_format( surface_formats );
+    auto surface_capabilities = surface_info.get_capabilities();
+    if( ( surface_capabilities.supportedUsageFlags & image_usage ) !=
+        image_usage )
+    {
+        throw std::runtime_error(
+            "create_simple_swapchain: unsupported image usage!" );
+    }
+    auto surface_format = select_surface_format( surface_info.get_formats() );
     auto surface_transform = surface_capabilities.currentTransform;
     auto surface_present_mode =
-        select_surface_present_mode( surface_present_modes );
+        select_surface_present_mode( surface_info.get_present_modes() );
     auto surface_extent = calc_surface_extent( surface_capabilities );
     auto image_count = surface_capabilities.minImageCount + 1u;
     if( surface_capabilities.maxImageCount > 0 &&
@@ -369,14 +524,15 @@ create_simple_swapchain(
     return std::make_tuple(
         create_swapchain(
             device,
-            surface,
+            surface_info.get_surface(),
             queue,
             image_count,
             surface_format,
             surface_extent,
             surface_transform,
             surface_present_mode,
-            old_swapchain ),
+            old_swapchain,
+            image_usage ),
         surface_format.format,
         surface_extent );
 }
@@ -385,7 +541,8 @@ vk::UniqueImageView create_simple_image_view(
     vk::Device device,
     vk::Image image,
     vk::Format format,
-    vk::ImageAspectFlags aspect_flags )
+    vk::ImageAspectFlags aspect_flags,
+    std::uint32_t level_count = 1u )
 {
     vk::ImageViewCreateInfo image_view_info;
     image_view_info.image = image;
@@ -397,7 +554,7 @@ vk::UniqueImageView create_simple_image_view(
     image_view_info.components.a = vk::ComponentSwizzle::eIdentity;
     image_view_info.subresourceRange.aspectMask = aspect_flags;
     image_view_info.subresourceRange.baseMipLevel = 0u;
-    image_view_info.subresourceRange.levelCount = 1u;
+    image_view_info.subresourceRange.levelCount = level_count;
     image_view_info.subresourceRange.baseArrayLayer = 0u;
     image_view_info.subresourceRange.layerCount = 1u;
     return device.createImageViewUnique( image_view_info, nullptr );
@@ -429,38 +586,32 @@ create_shader_module( vk::Device device, std::vector< char > const &code )
     return device.createShaderModuleUnique( shader_module_info );
 }
 
-std::uint32_t select_memory_type_index(
-    vk::PhysicalDeviceMemoryProperties const &memory_properties,
-    std::uint32_t memory_type_bits,
-    vk::MemoryPropertyFlags properties )
+vk::MemoryPropertyFlags
+select_readback_memory_properties( device_info::snapshot const &info )
 {
+    vk::MemoryPropertyFlags const cached =
+        vk::MemoryPropertyFlagBits::eHostVisible |
+        vk::MemoryPropertyFlagBits::eHostCached;
+    auto const &memory_properties = info.memory;
     for( std::uint32_t i = 0u; i < memory_properties.memoryTypeCount; ++i )
     {
-        if( memory_type_bits & ( static_cast< std::uint32_t >( 1u ) << i ) &&
-            ( memory_properties.memoryTypes[ i ].propertyFlags & properties ) ==
-                properties )
+        if( ( memory_properties.memoryTypes[ i ].propertyFlags & cached ) ==
+            cached )
         {
-            return i;
+            return cached;
         }
     }
-    throw std::runtime_error( "select_memory_type_index: error!" );
-}
-std::uint32_t select_memory_type_index(
-    vk::PhysicalDevice physical_device,
-    std::uint32_t memory_type_bits,
-    vk::MemoryPropertyFlags properties )
-{
-    auto memory_properties = physical_device.getMemoryProperties();
-    return select_memory_type_index(
-        memory_properties, memory_type_bits, properties );
+    return vk::MemoryPropertyFlagBits::eHostVisible |
+        vk::MemoryPropertyFlagBits::eHostCoherent;
 }
 
-std::tuple< vk::UniqueDeviceMemory, vk::UniqueBuffer > create_buffer(
-    vk::PhysicalDevice physical_device,
+// Memory properties are tried in order, see memory::budget::allocate().
+std::tuple< memory::allocation, vk::UniqueBuffer > create_buffer(
+    memory::budget &memory_budget,
     vk::Device device,
     vk::DeviceSize size,
     vk::BufferUsageFlags usage,
-    vk::MemoryPropertyFlags properties )
+    std::vector< vk::MemoryPropertyFlags > const &properties_candidates )
 {
 
     vk::BufferCreateInfo buffer_create_info;
@@ -470,160 +621,113 @@ std::tuple< vk::UniqueDeviceMemory, vk::UniqueBuffer > create_buffer(
     auto buffer = device.createBufferUnique( buffer_create_info );
 
     auto memory_requirements = device.getBufferMemoryRequirements( *buffer );
-
-    vk::MemoryAllocateInfo memory_allocate_info;
-    memory_allocate_info.allocationSize = memory_requirements.size;
-    memory_allocate_info.memoryTypeIndex = select_memory_type_index(
-        physical_device, memory_requirements.memoryTypeBits, properties );
-    auto buffer_memory = device.allocateMemoryUnique( memory_allocate_info );
+    auto buffer_memory = memory_budget.allocate(
+        device, memory_requirements, properties_candidates );
 
     device.bindBufferMemory( *buffer, *buffer_memory, 0u );
 
     return std::make_tuple( std::move( buffer_memory ), std::move( buffer ) );
 }
+std::tuple< memory::allocation, vk::UniqueBuffer > create_buffer(
+    memory::budget &memory_budget,
+    vk::Device device,
+    vk::DeviceSize size,
+    vk::BufferUsageFlags usage,
+    vk::MemoryPropertyFlags properties )
+{
+    return create_buffer(
+        memory_budget,
+        device,
+        size,
+        usage,
+        std::vector< vk::MemoryPropertyFlags >{properties} );
+}
 
-std::tuple< vk::UniqueDeviceMemory, vk::UniqueImage > create_image(
-    vk::PhysicalDevice physical_device,
+// Memory properties are tried in order, see memory::budget::allocate().
+std::tuple< memory::allocation, vk::UniqueImage > create_image(
+    memory::budget &memory_budget,
     vk::Device device,
     std::uint32_t width,
     std::uint32_t height,
     vk::Format format,
     vk::ImageTiling tiling,
     vk::ImageUsageFlags usage,
-    vk::MemoryPropertyFlags properties )
+    std::vector< vk::MemoryPropertyFlags > const &properties_candidates,
+    vk::SampleCountFlagBits samples = vk::SampleCountFlagBits::e1,
+    std::set< std::uint32_t > const &queue_set = {},
+    std::uint32_t mip_levels = 1u )
 {
+    std::vector< std::uint32_t > unique_queues(
+        queue_set.begin(), queue_set.end() );
     vk::ImageCreateInfo image_create_info;
     image_create_info.imageType = vk::ImageType::e2D;
     image_create_info.extent.width = width;
     image_create_info.extent.height = height;
     image_create_info.extent.depth = 1u;
-    image_create_info.mipLevels = 1u;
+    image_create_info.mipLevels = mip_levels;
     image_create_info.arrayLayers = 1u;
     image_create_info.format = format;
     image_create_info.tiling = tiling;
     image_create_info.initialLayout = vk::ImageLayout::eUndefined;
     image_create_info.usage = usage;
-    image_create_info.samples = vk::SampleCountFlagBits::e1;
-    image_create_info.sharingMode = vk::SharingMode::eExclusive;
+    image_create_info.samples = samples;
+    if( unique_queues.size() <= 1u )
+    {
+        image_create_info.sharingMode = vk::SharingMode::eExclusive;
+    }
+    else
+    {
+        image_create_info.sharingMode = vk::SharingMode::eConcurrent;
+        image_create_info.queueFamilyIndexCount =
+            static_cast< std::uint32_t >( unique_queues.size() );
+        image_create_info.pQueueFamilyIndices = unique_queues.data();
+    }
     auto image = device.createImageUnique( image_create_info );
 
     auto memory_requirements = device.getImageMemoryRequirements( *image );
-
-    vk::MemoryAllocateInfo memory_allocate_info;
-    memory_allocate_info.allocationSize = memory_requirements.size;
-    memory_allocate_info.memoryTypeIndex = select_memory_type_index(
-        physical_device, memory_requirements.memoryTypeBits, properties );
-    auto image_memory = device.allocateMemoryUnique( memory_allocate_info );
+    auto image_memory = memory_budget.allocate(
+        device, memory_requirements, properties_candidates );
 
     device.bindImageMemory( *image, *image_memory, 0u );
 
     return std::make_tuple( std::move( image_memory ), std::move( image ) );
 }
-
-auto auto_submit_onetime_unique_command_buffer(
-    vk::Device device, vk::Queue queue, vk::CommandPool command_pool )
-{
-    class auto_submit_onetime_unique_command_buffer_struct
-    {
-    private:
-        vk::Queue queue;
-        vk::UniqueCommandBuffer command_buffer{};
-
-    public:
-        auto_submit_onetime_unique_command_buffer_struct(
-            vk::Device _device,
-            vk::Queue _queue,
-            vk::CommandPool _command_pool )
-            : queue( _queue )
-        {
-            vk::CommandBufferAllocateInfo command_buffer_allocate_info;
-            command_buffer_allocate_info.level =
-                vk::CommandBufferLevel::ePrimary;
-            command_buffer_allocate_info.commandPool = _command_pool;
-            command_buffer_allocate_info.commandBufferCount = 1;
-            auto command_buffers = _device.allocateCommandBuffersUnique(
-                command_buffer_allocate_info );
-            command_buffer = std::move( command_buffers[ 0 ] );
-
-            vk::CommandBufferBeginInfo begin_info;
-            begin_info.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
-            command_buffer->begin( begin_info );
-        }
-        auto_submit_onetime_unique_command_buffer_struct(
-            auto_submit_onetime_unique_command_buffer_struct const & ) = delete;
-        auto_submit_onetime_unique_command_buffer_struct(
-            auto_submit_onetime_unique_command_buffer_struct && ) = default;
-        auto_submit_onetime_unique_command_buffer_struct &operator=(
-            auto_submit_onetime_unique_command_buffer_struct const & ) = delete;
-        auto_submit_onetime_unique_command_buffer_struct &operator=(
-            auto_submit_onetime_unique_command_buffer_struct && ) = default;
-        vk::CommandBuffer const *operator->() const
-        {
-            return &*command_buffer;
-        }
-        vk::CommandBuffer operator*() const
-        {
-            return *command_buffer;
-        }
-        ~auto_submit_onetime_unique_command_buffer_struct()
-        {
-            command_buffer->end();
-
-            vk::SubmitInfo submit_info;
-            submit_info.commandBufferCount = 1u;
-            submit_info.pCommandBuffers = &*command_buffer;
-            queue.submit( 1u, &submit_info, nullptr );
-            queue.waitIdle();
-        }
-    };
-    return auto_submit_onetime_unique_command_buffer_struct(
-        device, queue, command_pool );
-}
-
-void copy_buffer(
+std::tuple< memory::allocation, vk::UniqueImage > create_image(
+    memory::budget &memory_budget,
     vk::Device device,
-    vk::Queue queue,
-    vk::CommandPool command_pool,
-    vk::Buffer src_buffer,
-    vk::Buffer dst_buffer,
-    vk::DeviceSize size )
+    std::uint32_t width,
+    std::uint32_t height,
+    vk::Format format,
+    vk::ImageTiling tiling,
+    vk::ImageUsageFlags usage,
+    vk::MemoryPropertyFlags properties )
 {
-    auto onetime_command_buffer = auto_submit_onetime_unique_command_buffer(
-        device, queue, command_pool );
-
-    vk::BufferCopy copy;
-    copy.size = size;
-    onetime_command_buffer->copyBuffer( src_buffer, dst_buffer, copy );
+    return create_image(
+        memory_budget,
+        device,
+        width,
+        height,
+        format,
+        tiling,
+        usage,
+        std::vector< vk::MemoryPropertyFlags >{properties} );
 }
 
-vk::Format find_supported_format(
-    vk::PhysicalDevice physical_device,
-    std::vector< vk::Format > const &candidates,
-    vk::ImageTiling tiling,
-    vk::FormatFeatureFlags features )
+// For data the host rewrites and the device reads, such as uniform and
+// instance buffers: device-local when the host can map that directly.
+std::vector< vk::MemoryPropertyFlags >
+host_write_memory( memory::budget const &memory_budget )
 {
-    for( auto const &format : candidates )
-    {
-        auto props = physical_device.getFormatProperties( format );
-        if( tiling == vk::ImageTiling::eLinear &&
-            ( props.linearTilingFeatures & features ) == features )
-        {
-            return format;
-        }
-        else if(
-            tiling == vk::ImageTiling::eOptimal &&
-            ( props.optimalTilingFeatures & features ) == features )
-        {
-            return format;
-        }
-    }
-    throw std::runtime_error( "find_supported_format: failed to find format!" );
+    vk::MemoryPropertyFlags const host =
+        vk::MemoryPropertyFlagBits::eHostVisible |
+        vk::MemoryPropertyFlagBits::eHostCoherent;
+    if( !memory_budget.has_mappable_device_local() ) return {host};
+    return {memory::MAPPABLE_DEVICE_LOCAL, host};
 }
 
-vk::Format find_depth_format( vk::PhysicalDevice physical_device )
+vk::Format find_depth_format( format::capability_cache const &formats )
 {
-    return find_supported_format(
-        physical_device,
+    return formats.find_supported(
         {vk::Format::eD32Sfloat,
          vk::Format::eD32SfloatS8Uint,
          vk::Format::eD24UnormS8Uint},
@@ -631,410 +735,924 @@ vk::Format find_depth_format( vk::PhysicalDevice physical_device )
         vk::FormatFeatureFlagBits::eDepthStencilAttachment );
 }
 
-bool has_stencil_component_format( vk::Format format )
+// The highest sample count not above requested that both color and depth
+// framebuffer attachments support.
+vk::SampleCountFlagBits select_sample_count(
+    device_info::snapshot const &info, std::uint32_t requested )
 {
-    return format == vk::Format::eD32SfloatS8Uint ||
-        format == vk::Format::eD24UnormS8Uint;
+    auto const &limits = info.properties.limits;
+    auto const supported = limits.framebufferColorSampleCounts &
+        limits.framebufferDepthSampleCounts;
+    for( std::uint32_t count = 64u; count > 1u; count >>= 1u )
+    {
+        auto const bit = static_cast< vk::SampleCountFlagBits >( count );
+        if( count <= requested && ( supported & bit ) ) return bit;
+    }
+    return vk::SampleCountFlagBits::e1;
 }
 
-void transition_image_layout(
-    vk::Device device,
-    vk::Queue queue,
-    vk::CommandPool command_pool,
+// Copies buffer into the levels of image described by copies and leaves
+// them shader readable.
+void record_mip_upload(
+    vk::CommandBuffer command_buffer,
+    vk::Buffer buffer,
     vk::Image image,
-    vk::Format format,
-    vk::ImageLayout old_layout,
-    vk::ImageLayout new_layout )
+    std::vector< vk::BufferImageCopy > const &copies )
 {
-    auto onetime_command_buffer = auto_submit_onetime_unique_command_buffer(
-        device, queue, command_pool );
-
     vk::ImageMemoryBarrier barrier;
-    barrier.oldLayout = old_layout;
-    barrier.newLayout = new_layout;
     barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
     barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
     barrier.image = image;
-    if( new_layout == vk::ImageLayout::eDepthStencilAttachmentOptimal )
-    {
-        barrier.subresourceRange.aspectMask = vk::ImageAspectFlagBits::eDepth;
-        if( has_stencil_component_format( format ) )
-        {
-            barrier.subresourceRange.aspectMask |=
-                vk::ImageAspectFlagBits::eStencil;
-        }
-    }
-    else
-    {
-        barrier.subresourceRange.aspectMask = vk::ImageAspectFlagBits::eColor;
-    }
+    barrier.subresourceRange.aspectMask = vk::ImageAspectFlagBits::eColor;
     barrier.subresourceRange.baseMipLevel = 0u;
-    barrier.subresourceRange.levelCount = 1u;
+    barrier.subresourceRange.levelCount =
+        static_cast< std::uint32_t >( copies.size() );
     barrier.subresourceRange.baseArrayLayer = 0u;
     barrier.subresourceRange.layerCount = 1u;
+    barrier.oldLayout = vk::ImageLayout::eUndefined;
+    barrier.newLayout = vk::ImageLayout::eTransferDstOptimal;
+    barrier.dstAccessMask = vk::AccessFlagBits::eTransferWrite;
+    command_buffer.pipelineBarrier(
+        vk::PipelineStageFlagBits::eTopOfPipe,
+        vk::PipelineStageFlagBits::eTransfer,
+        vk::DependencyFlags{},
+        nullptr,
+        nullptr,
+        barrier );
 
-    vk::PipelineStageFlags src_stage, dst_stage;
-    if( old_layout == vk::ImageLayout::eUndefined &&
-        new_layout == vk::ImageLayout::eTransferDstOptimal )
-    {
-        barrier.srcAccessMask = vk::AccessFlags{};
-        barrier.dstAccessMask = vk::AccessFlagBits::eTransferWrite;
-        src_stage = vk::PipelineStageFlagBits::eTopOfPipe;
-        dst_stage = vk::PipelineStageFlagBits::eTransfer;
-    }
-    else if(
-        old_layout == vk::ImageLayout::eTransferDstOptimal &&
-        new_layout == vk::ImageLayout::eShaderReadOnlyOptimal )
-    {
-        barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
-        barrier.dstAccessMask = vk::AccessFlagBits::eShaderRead;
-        src_stage = vk::PipelineStageFlagBits::eTransfer;
-        dst_stage = vk::PipelineStageFlagBits::eFragmentShader;
-    }
-    else if(
-        old_layout == vk::ImageLayout::eUndefined &&
-        new_layout == vk::ImageLayout::eDepthStencilAttachmentOptimal )
-    {
-        barrier.srcAccessMask = vk::AccessFlags{};
-        barrier.dstAccessMask =
-            vk::AccessFlagBits::eDepthStencilAttachmentRead |
-            vk::AccessFlagBits::eDepthStencilAttachmentWrite;
-        src_stage = vk::PipelineStageFlagBits::eTopOfPipe;
-        dst_stage = vk::PipelineStageFlagBits::eEarlyFragmentTests;
-    }
-    else
-    {
-        throw std::runtime_error(
-            "transition_image_layout: unsupported layout transition!" );
-    }
+    command_buffer.copyBufferToImage(
+        buffer, image, vk::ImageLayout::eTransferDstOptimal, copies );
 
-    onetime_command_buffer->pipelineBarrier(
-        src_stage,
-        dst_stage,
+    barrier.oldLayout = vk::ImageLayout::eTransferDstOptimal;
+    barrier.newLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
+    barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+    barrier.dstAccessMask = vk::AccessFlagBits::eShaderRead;
+    command_buffer.pipelineBarrier(
+        vk::PipelineStageFlagBits::eTransfer,
+        vk::PipelineStageFlagBits::eFragmentShader,
         vk::DependencyFlags{},
         nullptr,
         nullptr,
         barrier );
 }
 
-class vulkan_window
+vk::IndexType to_index_type( mesh::index_width width )
+{
+    return width == mesh::index_width::u16 ? vk::IndexType::eUint16
+                                           : vk::IndexType::eUint32;
+}
+
+// Everything that only depends on the logical device and can be shared by
+// every surface rendered with it: command pool, descriptor set layout,
+// pipeline layout, render passes per color format with their pipeline
+// variants, the sample count they are built for, the post-process pipeline,
+// samplers, the scene mesh and its texture.
+class vulkan_device
 {
 private:
-    GLFWwindow *window = nullptr;
-    std::uint32_t graphics_family_index =
-                      std::numeric_limits< std::uint32_t >::max(),
-                  surface_family_index =
-                      std::numeric_limits< std::uint32_t >::max();
+    using pipeline_map = std::unordered_map<
+        variant::constants,
+        vk::UniquePipeline,
+        variant::constants_hash >;
+    struct render_pass_entry
+    {
+        vk::UniqueRenderPass render_pass{};
+        pipeline_map pipelines{};
+    };
+    struct gpu_texture
+    {
+        memory::allocation memory{};
+        vk::UniqueImage image{};
+        vk::UniqueImageView view{};
+    };
+    // What an upload needs until the graphics timeline passes done: its
+    // staging buffer and command buffer, and the image it replaced.
+    struct texture_upload
+    {
+        timeline::point done{};
+        memory::allocation staging_memory{};
+        vk::UniqueBuffer staging_buffer{};
+        vk::UniqueCommandBuffer command_buffer{};
+        gpu_texture replaced{};
+    };
 
     vk::Instance instance = nullptr;
     vk::PhysicalDevice physical_device = nullptr;
+    std::shared_ptr< device_info::snapshot const > info{};
+    // Every device allocation goes through the budget; windows share it.
+    bool memory_budget_extension = false;
+    std::shared_ptr< memory::budget > memory_budget{};
     vk::Device device = nullptr;
-    vk::Queue graphics_queue = nullptr, surface_queue = nullptr;
-
-    vk::UniqueSurfaceKHR surface{};
-    vk::UniqueSwapchainKHR swapchain{};
-    vk::Format format{};
-    vk::Extent2D extent{};
-    std::vector< vk::Image > images{};
-    std::vector< vk::UniqueImageView > image_views{};
+    std::uint32_t graphics_family_index =
+        std::numeric_limits< std::uint32_t >::max();
+    vk::Queue graphics_queue = nullptr;
+    std::uint32_t compute_family_index =
+        std::numeric_limits< std::uint32_t >::max();
+    vk::Queue compute_queue = nullptr;
+    // One timeline per queue; the compute one aliases the graphics one
+    // when both are the same queue.
+    bool timeline_semaphores = false;
+    std::unique_ptr< timeline::queue_timeline > graphics_timeline{},
+        compute_timeline{};
+    vk::Format depth_format = vk::Format::eUndefined;
+    vk::SampleCountFlagBits sample_count = vk::SampleCountFlagBits::e1;
 
+    vk::UniqueCommandPool command_pool{}, compute_command_pool{};
     vk::UniqueDescriptorSetLayout ubo_descriptor_set_layout{};
-
-    vk::UniqueShaderModule vertexshader_module{}, fragmentshader_module{};
     vk::UniquePipelineLayout pipeline_layout{};
-    vk::UniqueRenderPass render_pass{};
-    vk::UniquePipeline graphics_pipeline{};
-
-    std::vector< vk::UniqueFramebuffer > framebuffers{};
-
-    vk::UniqueCommandPool command_pool{};
-    vk::UniqueDeviceMemory depth_image_memory{};
-    vk::UniqueImage depth_image{};
-    vk::UniqueImageView depth_image_view{};
-    vk::UniqueDeviceMemory vertex_buffer_memory{},
-        vertex_staging_buffer_memory{};
-    vk::UniqueBuffer vertex_buffer{}, vertex_staging_buffer{};
-    vk::UniqueDeviceMemory index_buffer_memory{};
-    vk::UniqueBuffer index_buffer{};
-    vk::UniqueDeviceMemory uniform_buffer_memory{};
-    vk::UniqueBuffer uniform_buffer{};
-    vk::UniqueDescriptorPool uniform_descriptor_pool{};
-    vk::UniqueDescriptorSet uniform_descriptor_set{};
-    std::vector< vk::UniqueCommandBuffer > command_buffers{};
+    vk::UniqueShaderModule vertexshader_module{}, fragmentshader_module{};
+    vk::UniquePipelineCache pipeline_cache{};
+    std::map< vk::Format, render_pass_entry > render_passes{};
 
-    vk::UniqueSemaphore semaphore_image_available{},
-        semaphore_render_finished{};
+    vk::UniqueDescriptorSetLayout post_descriptor_set_layout{};
+    vk::UniquePipelineLayout post_pipeline_layout{};
+    vk::UniqueShaderModule postshader_module{};
+    vk::UniquePipeline post_pipeline{};
+    sampler::sampler_cache samplers{};
 
-public:
-    vulkan_window( std::nullptr_t )
+    // Hot reload: rebuild_shaders() runs on the watcher thread and leaves a
+    // complete set of modules and pipelines here for apply_shaders().
+    struct shader_set
     {
-    }
-    vulkan_window( GLFWwindow *_window )
-        : window( _window )
-    {
-    }
-    vulkan_window(
-        vk::Instance _instance, vk::PhysicalDevice _physical_device = nullptr )
-        : vulkan_window( nullptr, _instance, _physical_device )
+        vk::UniqueShaderModule vertex{}, fragment{}, post{};
+        std::map< vk::Format, pipeline_map > graphics_pipelines{};
+        vk::UniquePipeline post_pipeline{};
+    };
+    // Guards render_passes, the shader modules, the post pipeline and
+    // pending_shaders against the watcher thread. Never held while
+    // pipelines compile; pipeline_cache synchronizes itself.
+    std::mutex pipeline_mutex{};
+    std::unique_ptr< shader_set > pending_shaders{};
+    // Set with pending_shaders so apply_shaders() skips the lock when
+    // there is nothing to apply.
+    std::atomic< bool > shaders_pending{false};
+    // What apply_shaders() replaced, kept until the work submitted before
+    // the swap has completed.
+    struct retired_shader_set
     {
-    }
-    vulkan_window(
-        GLFWwindow *_window = nullptr,
-        vk::Instance _instance = nullptr,
-        vk::PhysicalDevice _physical_device = nullptr )
-        : window( _window )
-        , instance( _instance )
-        , physical_device( _physical_device )
+        std::unique_ptr< shader_set > objects{};
+        timeline::point graphics{}, compute{};
+    };
+    std::deque< retired_shader_set > retired_shaders{};
+    std::uint64_t pipeline_generation = 0u;
+
+    mesh::optimized_mesh< Vertex > scene_mesh{};
+    // Level 0 first; coarser levels follow it in the same index buffer.
+    std::vector< mesh::lod_level > scene_lods{};
+    // Bounding sphere of scene_mesh (xyz center, w radius) in mesh units.
+    glm::vec4 mesh_sphere{};
+    // Per instance, the world position of mesh_sphere's center and the
+    // largest scale of the instance's matrix, for LOD selection.
+    std::vector< glm::vec4 > instance_bounds{};
+    // Every mesh drawn, bound once per command buffer.
+    std::unique_ptr< geometry::pool > geometry_pool{};
+    geometry::mesh_range scene_geometry{};
+    // The current instance matrices. Every window copies what changed
+    // into the instance buffer region of the image it renders next, once
+    // the GPU is done with that region; instance_history holds the nodes
+    // each of the last generations changed.
+    std::uint32_t instance_count = 1u;
+    std::vector< InstanceData > instance_data{};
+    std::uint64_t instance_generation = 0u;
+    struct instance_change
     {
-        if( window )
-        {
-            glfwSetWindowUserPointer( window, this );
-        }
-    }
-    vulkan_window( vulkan_window const & ) = delete;
-    vulkan_window( vulkan_window && ) = delete;
-    vulkan_window &operator=( vulkan_window const & ) = delete;
-    vulkan_window &operator=( vulkan_window && ) = delete;
-    ~vulkan_window( void ) = default;
+        std::uint64_t generation = 0u;
+        std::vector< scene::node_range > ranges{};
+    };
+    std::deque< instance_change > instance_history{};
+    // The bounding box of scene_mesh, drawn per instance inside occlusion
+    // queries with occlusion::BOX_INDICES.
+    geometry::mesh_range proxy_geometry{};
+    vk::PhysicalDeviceFeatures enabled_features{};
 
-    operator GLFWwindow *( void )
+    // The streamer decides which levels are resident; gpu_textures (by
+    // texture id) follow it. Until a texture has levels on the GPU the
+    // white placeholder stands in.
+    std::string scene_texture_path{};
+    std::size_t texture_budget = DEFAULT_TEXTURE_BUDGET_MB << 20u;
+    std::unique_ptr< texture::streamer > textures{};
+    texture::texture_id scene_texture = 0u;
+    gpu_texture placeholder_texture{};
+    std::vector< gpu_texture > gpu_textures{};
+    std::deque< texture_upload > texture_uploads{};
+    std::uint64_t texture_generation = 0u;
+
+public:
+    vulkan_device( vk::Instance _instance, vk::PhysicalDevice _physical_device )
+        : instance( _instance )
+        , physical_device( _physical_device )
+        , info( device_info::take_snapshot( _physical_device ) )
     {
-        return window;
     }
+    vulkan_device( vulkan_device const & ) = delete;
+    vulkan_device( vulkan_device && ) = delete;
+    vulkan_device &operator=( vulkan_device const & ) = delete;
+    vulkan_device &operator=( vulkan_device && ) = delete;
+    ~vulkan_device( void ) = default;
 
-    void set_instance( vk::Instance _instance )
+    std::uint32_t select_queue_family( void )
     {
-        instance = _instance;
+        if( graphics_family_index ==
+            std::numeric_limits< std::uint32_t >::max() )
+        {
+            graphics_family_index = static_cast< std::uint32_t >(
+                select_graphics_queue_family_index( info->queue_families ) );
+        }
+        return graphics_family_index;
     }
-    void set_physical_device( vk::PhysicalDevice _physical_device )
+    // A compute-only family runs post-processing asynchronously to the
+    // graphics queue; without one compute work shares the graphics family.
+    std::uint32_t select_compute_queue_family( void )
     {
-        if( !instance )
+        if( compute_family_index ==
+            std::numeric_limits< std::uint32_t >::max() )
         {
-            throw std::runtime_error(
-                "vulkan_window::set_physical_device: error!" );
+            compute_family_index = select_queue_family();
+            auto const &properties = info->queue_families;
+            for( std::uint32_t i = 0u; i < properties.size(); ++i )
+            {
+                if( properties[ i ].queueCount > 0u &&
+                    ( properties[ i ].queueFlags &
+                      vk::QueueFlagBits::eCompute ) &&
+                    !( properties[ i ].queueFlags &
+                       vk::QueueFlagBits::eGraphics ) )
+                {
+                    compute_family_index = i;
+                    break;
+                }
+            }
         }
-        physical_device = _physical_device;
+        return compute_family_index;
     }
     void set_device( vk::Device _device )
     {
         if( graphics_family_index ==
-                std::numeric_limits< std::uint32_t >::max() ||
-            surface_family_index ==
-                std::numeric_limits< std::uint32_t >::max() )
+            std::numeric_limits< std::uint32_t >::max() )
         {
-            throw std::runtime_error( "vulkan_window::set_device: error!" );
+            throw std::runtime_error( "vulkan_device::set_device: error!" );
         }
         if( device ) return;
         device = _device;
+        memory_budget = std::make_shared< memory::budget >(
+            info, instance, memory_budget_extension );
+        samplers.set_device( device );
         graphics_queue = device.getQueue( graphics_family_index, 0u );
-        surface_queue = device.getQueue( surface_family_index, 0u );
+        compute_queue = compute_family_index ==
+                std::numeric_limits< std::uint32_t >::max()
+            ? graphics_queue
+            : device.getQueue( compute_family_index, 0u );
+        graphics_timeline = std::make_unique< timeline::queue_timeline >(
+            device, graphics_queue, timeline_semaphores );
+        if( compute_queue != graphics_queue )
+        {
+            compute_timeline = std::make_unique< timeline::queue_timeline >(
+                device, compute_queue, timeline_semaphores );
+        }
     }
-    void create_window( void )
+    // Whether the device was created with VK_KHR_timeline_semaphore; must
+    // be set before set_device().
+    void set_timeline_semaphores( bool enabled )
     {
-        if( window ) return;
-        glfwWindowHint( GLFW_CLIENT_API, GLFW_NO_API );
-        window = glfwCreateWindow( WIDTH, HEIGHT, "Vulkan", nullptr, nullptr );
-        glfwSetWindowUserPointer( window, this );
-        glfwSetWindowSizeCallback(
-            window, &vulkan_window::window_size_callback );
+        timeline_semaphores = enabled;
     }
-    void create_surface( void )
+    // The optional features the renderer uses that the device has; the
+    // device must be created with them for them to be used.
+    vk::PhysicalDeviceFeatures select_features( void )
     {
-        if( !window || !instance )
+        enabled_features.multiDrawIndirect = info->features.multiDrawIndirect;
+        return enabled_features;
+    }
+    bool multi_draw_indirect( void ) const
+    {
+        return enabled_features.multiDrawIndirect == VK_TRUE;
+    }
+    // Whether the device was created with VK_EXT_memory_budget; must be
+    // set before set_device().
+    void set_memory_budget( bool enabled )
+    {
+        memory_budget_extension = enabled;
+    }
+    // Capped to what the device supports; must be set before any render
+    // pass is created.
+    void set_sample_count( std::uint32_t requested )
+    {
+        if( !render_passes.empty() )
         {
-            throw std::runtime_error( "vulkan_window::create_surface: error!" );
+            throw std::runtime_error(
+                "vulkan_device::set_sample_count: render passes exist!" );
         }
-        if( surface ) return;
-        surface = create_glfw_surface( instance, window );
+        sample_count = select_sample_count( *info, requested );
     }
-    std::set< std::uint32_t > select_queue_family( void )
+    // Must be set before initialize().
+    void set_instance_count( std::uint32_t count )
     {
-        if( !physical_device || !surface )
+        if( !instance_data.empty() || count == 0u )
         {
             throw std::runtime_error(
-                "vulkan_window::select_queue_family: error!" );
+                "vulkan_device::set_instance_count: error!" );
         }
-        if( graphics_family_index ==
-                std::numeric_limits< std::uint32_t >::max() ||
-            surface_family_index ==
-                std::numeric_limits< std::uint32_t >::max() )
+        instance_count = count;
+    }
+    // Must be set before initialize(); without a file the scene samples a
+    // white texture.
+    void set_scene_texture( std::string path, std::size_t budget_bytes )
+    {
+        if( textures )
         {
-            auto queue_familiy_properties =
-                physical_device.getQueueFamilyProperties();
-            graphics_family_index = static_cast< std::uint32_t >(
-                select_graphics_queue_family_index(
-                    queue_familiy_properties ) );
-            surface_family_index =
-                static_cast< std::uint32_t >( select_surface_queue_family_index(
-                    physical_device, *surface, queue_familiy_properties ) );
+            throw std::runtime_error(
+                "vulkan_device::set_scene_texture: error!" );
         }
-        return {graphics_family_index, surface_family_index};
+        scene_texture_path = std::move( path );
+        texture_budget = budget_bytes;
     }
-    void initialize_presentation( void )
+    void initialize( void )
     {
-        create_swapchain();
-        create_image_view();
-        create_render_pass();
-        create_descriptor_set_layout();
-        create_graphics_pipeline();
+        initialize_objects();
+        load_shaders();
+        upload_geometry();
+        upload_textures();
+    }
+    // initialize() in phases, for startup to run them concurrently: once
+    // initialize_objects() is done, load_shaders() (and then pipelines,
+    // see get_render_pass()) may run alongside upload_geometry().
+    // upload_textures() comes after upload_geometry() since both submit
+    // on the graphics queue from the same command pool.
+    void initialize_objects( void )
+    {
+        depth_format = find_depth_format( info->formats );
         create_command_pool();
-        create_depth_resources();
-        create_framebuffer();
-        create_vertex_buffer();
-        create_index_buffer();
-        create_uniform_buffer();
-        create_descriptor_pool();
-        create_descriptor_set();
-        create_command_buffer();
-        create_semaphore();
+        create_descriptor_set_layout();
+        create_pipeline_layout();
     }
-    void reinitialize_presentation( void )
+    void load_shaders( void )
     {
-        create_swapchain();
-        create_image_view();
-        create_render_pass();
-        create_graphics_pipeline();
-        create_depth_resources();
-        create_framebuffer();
-        create_command_buffer();
+        create_shader_modules();
+        create_pipeline_cache();
     }
-
-    void present( void ) try
+    void upload_geometry( void )
     {
-        constexpr static std::size_t NUM_COUNT = 1000u;
-        static std::size_t count = 0u;
-        static auto start = std::chrono::high_resolution_clock::now();
-        count++;
-        if( count % NUM_COUNT == 0 )
-        {
-            // count = 0u;
-            auto end = std::chrono::high_resolution_clock::now();
-            std::cout << 1 /
-                    std::chrono::duration< double >( end - start ).count() *
-                    NUM_COUNT
-                      << "fps" << std::endl;
-            start = end;
-        }
+        create_mesh();
+        create_geometry_pool();
+        create_instance_data();
+        create_proxy_geometry();
+    }
+    void upload_textures( void )
+    {
+        create_textures();
+    }
 
-        UniformBufferObject ubo;
-        ubo.model = glm::rotate(
-            glm::mat4(),
-            count * glm::radians( 90.0f ) / 10000,
-            glm::vec3( 0.0f, 0.0f, 1.0f ) );
-        ubo.view = glm::lookAt(
-            glm::vec3( 2.0f, 2.0f, 2.0f ),
-            glm::vec3( 0.0f, 0.0f, 0.0f ),
-            glm::vec3( 0.0f, 0.0f, 1.0f ) );
-        ubo.proj = glm::perspective(
-            glm::radians( 45.0f ),
-            extent.width / static_cast< float >( extent.height ),
-            0.1f,
-            10.0f );
-        ubo.proj[ 1 ][ 1 ] *= -1;
+    vk::Instance get_instance( void ) const
+    {
+        return instance;
+    }
+    vk::PhysicalDevice get_physical_device( void ) const
+    {
+        return physical_device;
+    }
+    device_info::snapshot const &get_info( void ) const
+    {
+        return *info;
+    }
+    vk::Device get_device( void ) const
+    {
+        return device;
+    }
+    memory::budget &get_memory( void ) const
+    {
+        return *memory_budget;
+    }
+    std::uint32_t get_graphics_family_index( void ) const
+    {
+        return graphics_family_index;
+    }
+    vk::Queue get_graphics_queue( void ) const
+    {
+        return graphics_queue;
+    }
+    vk::CommandPool get_command_pool( void ) const
+    {
+        return *command_pool;
+    }
+    std::uint32_t get_compute_family_index( void ) const
+    {
+        return compute_family_index ==
+                std::numeric_limits< std::uint32_t >::max()
+            ? graphics_family_index
+            : compute_family_index;
+    }
+    vk::Queue get_compute_queue( void ) const
+    {
+        return compute_queue;
+    }
+    timeline::queue_timeline &get_graphics_timeline( void ) const
+    {
+        return *graphics_timeline;
+    }
+    timeline::queue_timeline &get_compute_timeline( void ) const
+    {
+        return compute_timeline ? *compute_timeline : *graphics_timeline;
+    }
+    // Waits for everything submitted through the timelines; presentation
+    // is not included.
+    void wait_idle( void ) const
+    {
+        graphics_timeline->wait_idle();
+        if( compute_timeline ) compute_timeline->wait_idle();
+    }
+    vk::CommandPool get_compute_command_pool( void ) const
+    {
+        return compute_command_pool ? *compute_command_pool : *command_pool;
+    }
+    vk::Format get_depth_format( void ) const
+    {
+        return depth_format;
+    }
+    vk::SampleCountFlagBits get_sample_count( void ) const
+    {
+        return sample_count;
+    }
+    bool multisampled( void ) const
+    {
+        return sample_count != vk::SampleCountFlagBits::e1;
+    }
+    vk::DescriptorSetLayout get_descriptor_set_layout( void ) const
+    {
+        return *ubo_descriptor_set_layout;
+    }
+    vk::PipelineLayout get_pipeline_layout( void ) const
+    {
+        return *pipeline_layout;
+    }
+    vk::Buffer get_vertex_buffer( void ) const
+    {
+        return geometry_pool->get_vertex_buffer();
+    }
+    vk::Buffer get_index_buffer( void ) const
+    {
+        return geometry_pool->get_index_buffer();
+    }
+    vk::IndexType get_index_type( void ) const
+    {
+        return to_index_type( geometry_pool->get_index_width() );
+    }
+    // Where the scene mesh, all its LODs included, sits in the pool.
+    geometry::mesh_range const &get_scene_geometry( void ) const
+    {
+        return scene_geometry;
+    }
+    // Of the full-detail level.
+    std::uint32_t get_index_count( void ) const
+    {
+        return scene_lods.front().index_count;
+    }
+    std::vector< mesh::lod_level > const &get_lods( void ) const
+    {
+        return scene_lods;
+    }
+    glm::vec4 const &get_mesh_sphere( void ) const
+    {
+        return mesh_sphere;
+    }
+    std::vector< glm::vec4 > const &get_instance_bounds( void ) const
+    {
+        return instance_bounds;
+    }
+    // Brings a region holding the instances of generation since up to
+    // date, copying only the ranges changed after it when those are known.
+    void copy_instances( void *destination, std::uint64_t since ) const
+    {
+        auto const out = static_cast< std::uint8_t * >( destination );
+        if( instance_history.empty() ||
+            since + 1u < instance_history.front().generation )
+        {
+            std::memcpy(
+                out,
+                instance_data.data(),
+                instance_data.size() * sizeof( InstanceData ) );
+            return;
+        }
+        for( auto const &change : instance_history )
+        {
+            if( change.generation <= since ) continue;
+            for( auto const &range : change.ranges )
+            {
+                std::memcpy(
+                    out + range.first * sizeof( InstanceData ),
+                    &instance_data[ range.first ],
+                    ( range.last - range.first ) * sizeof( InstanceData ) );
+            }
+        }
+    }
+    std::uint64_t get_instance_generation( void ) const
+    {
+        return instance_generation;
+    }
+    std::uint32_t get_instance_count( void ) const
+    {
+        return instance_count;
+    }
+    geometry::mesh_range const &get_proxy_geometry( void ) const
+    {
+        return proxy_geometry;
+    }
+    // Finishes graph's update (see scene_graph::update_world()) into the
+    // instance data; node n is instance n.
+    std::size_t write_instances( scene::scene_graph &graph )
+    {
+        if( graph.size() > instance_count )
+        {
+            throw std::runtime_error(
+                "vulkan_device::write_instances: too many nodes!" );
+        }
+        instance_change change;
+        auto const updated = graph.update_world(
+            instance_data.data(), sizeof( InstanceData ), &change.ranges );
+        if( updated == 0u ) return 0u;
+        for( auto const &range : change.ranges )
+        {
+            for( auto n = range.first; n < range.last; ++n )
+            {
+                glm::mat4 world;
+                std::memcpy( &world, graph.get_world( n ), sizeof( world ) );
+                instance_bounds[ n ] = get_bounds( world );
+            }
+        }
+        change.generation = ++instance_generation;
+        instance_history.push_back( std::move( change ) );
+        if( instance_history.size() > INSTANCE_HISTORY )
+            instance_history.pop_front();
+        return updated;
+    }
 
-        auto data = device.mapMemory(
-            *uniform_buffer_memory, 0, sizeof( UniformBufferObject ) );
-        std::memcpy( data, &ubo, sizeof( UniformBufferObject ) );
-        device.unmapMemory( *uniform_buffer_memory );
+    // Called once per frame before the windows begin theirs. Uploads what
+    // the streamer planned without waiting for the GPU; a new image is
+    // usable right away since later submissions on the graphics queue see
+    // the upload's final barrier.
+    void stream_textures( void )
+    {
+        auto const completed = graphics_timeline->get_completed();
+        while( !texture_uploads.empty() &&
+               texture_uploads.front().done.value <= completed )
+        {
+            texture_uploads.pop_front();
+        }
+        // Textures never get more than the device-local heap has left, so
+        // under pressure the streamer drops top levels before allocations
+        // start failing.
+        memory_budget->refresh();
+        auto const available =
+            static_cast< std::int64_t >( textures->get_used() ) +
+            memory_budget->get_headroom(
+                memory_budget->get_device_local_heap() );
+        textures->set_budget( std::min(
+            texture_budget,
+            static_cast< std::size_t >(
+                std::max< std::int64_t >( available, 0 ) ) ) );
+        for( auto const &change : textures->plan( MAX_TEXTURE_UPLOADS ) )
+        {
+            if( change.texture >= gpu_textures.size() )
+                gpu_textures.resize( change.texture + 1u );
+            upload_texture(
+                change.format,
+                *change.mips,
+                change.base_level,
+                gpu_textures[ change.texture ] );
+            if( change.texture == scene_texture ) ++texture_generation;
+        }
+    }
+    vk::ImageView get_scene_texture_view( void ) const
+    {
+        if( scene_texture < gpu_textures.size() &&
+            gpu_textures[ scene_texture ].view )
+        {
+            return *gpu_textures[ scene_texture ].view;
+        }
+        return *placeholder_texture.view;
+    }
+    vk::Sampler get_texture_sampler( void )
+    {
+        sampler::sampler_state state;
+        state.max_lod = VK_LOD_CLAMP_NONE;
+        return samplers.get( state );
+    }
+    // Bumped whenever get_scene_texture_view() changes; windows then
+    // rewrite their descriptor sets.
+    std::uint64_t get_texture_generation( void ) const
+    {
+        return texture_generation;
+    }
 
-        auto image_index = device.acquireNextImageKHR(
-            *swapchain,
-            std::numeric_limits< std::uint64_t >::max(),
-            *semaphore_image_available,
-            nullptr );
+    // Render passes and their pipeline variants are created on first use
+    // and shared by every surface with the same color format and
+    // specialization constants.
+    std::tuple< vk::RenderPass, vk::Pipeline > get_render_pass(
+        vk::Format color_format, variant::constants const &constants )
+    {
+        std::lock_guard< std::mutex > lock( pipeline_mutex );
+        auto it = render_passes.find( color_format );
+        if( it == render_passes.end() )
+        {
+            render_pass_entry entry;
+            entry.render_pass = create_render_pass( color_format );
+            it = render_passes.emplace( color_format, std::move( entry ) )
+                     .first;
+        }
+        auto &pipelines = it->second.pipelines;
+        auto pipeline = pipelines.find( constants );
+        if( pipeline == pipelines.end() )
+        {
+            pipeline = pipelines
+                           .emplace(
+                               constants,
+                               create_graphics_pipeline(
+                                   *it->second.render_pass,
+                                   *vertexshader_module,
+                                   *fragmentshader_module,
+                                   constants ) )
+                           .first;
+        }
+        return std::make_tuple( *it->second.render_pass, *pipeline->second );
+    }
 
-        vk::SubmitInfo submit_info;
-        vk::Semaphore wait_semaphores[] = {*semaphore_image_available};
-        vk::Semaphore signal_semaphores[] = {*semaphore_render_finished};
-        vk::PipelineStageFlags pipeline_stage_flags[] = {
-            vk::PipelineStageFlagBits::eColorAttachmentOutput};
-        vk::CommandBuffer submit_command_buffers[] = {
-            *command_buffers[ image_index.value ]};
-        submit_info.waitSemaphoreCount = 1u;
-        submit_info.pWaitSemaphores = wait_semaphores;
-        submit_info.pWaitDstStageMask = pipeline_stage_flags;
-        submit_info.commandBufferCount = 1u;
-        submit_info.pCommandBuffers = submit_command_buffers;
-        submit_info.signalSemaphoreCount = 1u;
-        submit_info.pSignalSemaphores = signal_semaphores;
-        graphics_queue.submit( submit_info, nullptr );
+    // The post-process pipeline is only built once a window asks for it,
+    // so post.spv is not needed otherwise.
+    void initialize_post( void )
+    {
+        std::lock_guard< std::mutex > lock( pipeline_mutex );
+        if( post_pipeline ) return;
+        create_post_descriptor_set_layout();
+        create_post_pipeline_layout();
+        postshader_module = create_shader_module(
+            device, read_file( SHADER_FILES[ POST_SHADER ].binary ) );
+        post_pipeline = create_post_pipeline( *postshader_module );
+    }
+    vk::DescriptorSetLayout get_post_descriptor_set_layout( void ) const
+    {
+        return *post_descriptor_set_layout;
+    }
+    vk::PipelineLayout get_post_pipeline_layout( void ) const
+    {
+        return *post_pipeline_layout;
+    }
+    vk::Pipeline get_post_pipeline( void ) const
+    {
+        return *post_pipeline;
+    }
+    vk::Sampler get_post_sampler( void )
+    {
+        sampler::sampler_state state;
+        state.filter = vk::Filter::eNearest;
+        state.mipmap_mode = vk::SamplerMipmapMode::eNearest;
+        state.address_mode = vk::SamplerAddressMode::eClampToEdge;
+        return samplers.get( state );
+    }
 
-        vk::PresentInfoKHR present_info;
-        present_info.waitSemaphoreCount = 1u;
-        present_info.pWaitSemaphores = signal_semaphores;
-        vk::SwapchainKHR swapchains[] = {*swapchain};
-        present_info.swapchainCount = 1u;
-        present_info.pSwapchains = swapchains;
-        present_info.pImageIndices = &image_index.value;
-        surface_queue.presentKHR( present_info );
+    // Called from any thread once the SPIR-V files changed. Throws (and
+    // keeps the current shaders) when they do not load. Compiles the
+    // variants that exist when it starts without holding pipeline_mutex,
+    // so rendering and get_render_pass() carry on meanwhile.
+    void rebuild_shaders( void )
+    {
+        auto next = std::make_unique< shader_set >();
+        next->vertex = create_shader_module(
+            device, read_file( SHADER_FILES[ VERTEX_SHADER ].binary ) );
+        next->fragment = create_shader_module(
+            device, read_file( SHADER_FILES[ FRAGMENT_SHADER ].binary ) );
+        // Render passes live as long as the device, so their handles stay
+        // valid after the lock is released.
+        std::vector< std::tuple<
+            vk::Format,
+            vk::RenderPass,
+            std::vector< variant::constants > > >
+            variants;
+        bool post = false;
+        {
+            std::lock_guard< std::mutex > lock( pipeline_mutex );
+            for( auto const &entry : render_passes )
+            {
+                std::vector< variant::constants > constants;
+                for( auto const &pipeline : entry.second.pipelines )
+                    constants.push_back( pipeline.first );
+                variants.emplace_back(
+                    entry.first,
+                    *entry.second.render_pass,
+                    std::move( constants ) );
+            }
+            post = static_cast< bool >( post_pipeline );
+        }
+        for( auto const &v : variants )
+        {
+            auto &pipelines = next->graphics_pipelines[ std::get< 0 >( v ) ];
+            for( auto const &constants : std::get< 2 >( v ) )
+            {
+                pipelines.emplace(
+                    constants,
+                    create_graphics_pipeline(
+                        std::get< 1 >( v ),
+                        *next->vertex,
+                        *next->fragment,
+                        constants ) );
+            }
+        }
+        if( post )
+        {
+            next->post = create_shader_module(
+                device, read_file( SHADER_FILES[ POST_SHADER ].binary ) );
+            next->post_pipeline = create_post_pipeline( *next->post );
+        }
+        std::lock_guard< std::mutex > lock( pipeline_mutex );
+        pending_shaders = std::move( next );
+        shaders_pending = true;
     }
-    catch( std::system_error &err )
+    // Swaps in the result of the last rebuild_shaders(), between frames.
+    // Variants created after that rebuild took its snapshot still use the
+    // old modules and are rebuilt here. Windows notice the new generation
+    // and re-record their command buffers; the replaced objects live on
+    // until the frames already submitted are done with them.
+    void apply_shaders( void )
     {
-        auto &code = err.code();
-        auto &category = code.category();
-        if( category.name() == "vk::Result"s &&
-            vk::Result( code.value() ) == vk::Result::eErrorOutOfDateKHR )
+        while( !retired_shaders.empty() &&
+               retired_shaders.front().graphics.is_complete() &&
+               retired_shaders.front().compute.is_complete() )
         {
-            reinitialize_presentation();
+            retired_shaders.pop_front();
         }
-        else
+        if( !shaders_pending.exchange( false ) ) return;
+        std::lock_guard< std::mutex > lock( pipeline_mutex );
+        if( !pending_shaders ) return;
+        auto next = std::move( pending_shaders );
+        // Swapped, so next ends up holding what is being replaced.
+        std::swap( vertexshader_module, next->vertex );
+        std::swap( fragmentshader_module, next->fragment );
+        for( auto &entry : render_passes )
+        {
+            auto &rebuilt = next->graphics_pipelines[ entry.first ];
+            for( auto &pipeline : entry.second.pipelines )
+            {
+                auto &replacement = rebuilt[ pipeline.first ];
+                if( !replacement )
+                {
+                    replacement = create_graphics_pipeline(
+                        *entry.second.render_pass,
+                        *vertexshader_module,
+                        *fragmentshader_module,
+                        pipeline.first );
+                }
+                std::swap( pipeline.second, replacement );
+            }
+        }
+        if( post_pipeline )
         {
-            throw;
+            if( !next->post_pipeline )
+            {
+                // initialize_post() ran after the snapshot.
+                next->post = create_shader_module(
+                    device, read_file( SHADER_FILES[ POST_SHADER ].binary ) );
+                next->post_pipeline = create_post_pipeline( *next->post );
+            }
+            std::swap( postshader_module, next->post );
+            std::swap( post_pipeline, next->post_pipeline );
         }
+        retired_shader_set retired;
+        retired.objects = std::move( next );
+        retired.graphics.line = graphics_timeline.get();
+        retired.graphics.value = graphics_timeline->get_submitted();
+        retired.compute.line = &get_compute_timeline();
+        retired.compute.value = get_compute_timeline().get_submitted();
+        retired_shaders.push_back( std::move( retired ) );
+        ++pipeline_generation;
     }
-
-private:
-    void create_swapchain( void )
+    std::uint64_t get_pipeline_generation( void ) const
     {
-        if( !physical_device || !device || !window )
-            throw std::runtime_error(
-                "create_swapchain_and_image_view: error!" );
-        auto swapchain_tmp = create_simple_swapchain(
-            physical_device,
-            device,
-            *surface,
-            {graphics_family_index, surface_family_index},
-            *swapchain );
-        swapchain =
-            std::move( std::get< vk::UniqueSwapchainKHR >( swapchain_tmp ) );
-        format = std::get< vk::Format >( swapchain_tmp );
-        extent = std::get< vk::Extent2D >( swapchain_tmp );
+        return pipeline_generation;
     }
-    void create_image_view( void )
+
+private:
+    void create_command_pool( void )
     {
-        images = device.getSwapchainImagesKHR( *swapchain );
-        image_views.clear();
-        image_views.resize( images.size() );
-        for( std::size_t i = 0u; i < image_views.size(); ++i )
+        vk::CommandPoolCreateInfo command_pool_info;
+        command_pool_info.queueFamilyIndex = graphics_family_index;
+        command_pool = device.createCommandPoolUnique( command_pool_info );
+        if( get_compute_family_index() != graphics_family_index )
         {
-            image_views[ i ] = create_simple_image_view(
-                device, images[ i ], format, vk::ImageAspectFlagBits::eColor );
+            command_pool_info.queueFamilyIndex = compute_family_index;
+            compute_command_pool =
+                device.createCommandPoolUnique( command_pool_info );
         }
     }
-    void create_render_pass( void )
+    void create_descriptor_set_layout( void )
+    {
+        vk::DescriptorSetLayoutBinding ubo_descriptor_set_layout_bindings[ 2 ];
+        ubo_descriptor_set_layout_bindings[ 0 ].binding = 0u;
+        ubo_descriptor_set_layout_bindings[ 0 ].descriptorType =
+            vk::DescriptorType::eUniformBuffer;
+        ubo_descriptor_set_layout_bindings[ 0 ].descriptorCount = 1u;
+        ubo_descriptor_set_layout_bindings[ 0 ].stageFlags =
+            vk::ShaderStageFlagBits::eVertex;
+        ubo_descriptor_set_layout_bindings[ 1 ].binding = 1u;
+        ubo_descriptor_set_layout_bindings[ 1 ].descriptorType =
+            vk::DescriptorType::eCombinedImageSampler;
+        ubo_descriptor_set_layout_bindings[ 1 ].descriptorCount = 1u;
+        ubo_descriptor_set_layout_bindings[ 1 ].stageFlags =
+            vk::ShaderStageFlagBits::eFragment;
+
+        vk::DescriptorSetLayoutCreateInfo ubo_descriptor_set_layout_info;
+        ubo_descriptor_set_layout_info.bindingCount = 2u;
+        ubo_descriptor_set_layout_info.pBindings =
+            ubo_descriptor_set_layout_bindings;
+
+        ubo_descriptor_set_layout = device.createDescriptorSetLayoutUnique(
+            ubo_descriptor_set_layout_info );
+    }
+    void create_pipeline_layout( void )
+    {
+        vk::PipelineLayoutCreateInfo pipeline_layout_info;
+        pipeline_layout_info.setLayoutCount = 1u;
+        pipeline_layout_info.pSetLayouts = &*ubo_descriptor_set_layout;
+        pipeline_layout =
+            device.createPipelineLayoutUnique( pipeline_layout_info );
+    }
+    void create_shader_modules( void )
+    {
+        auto vertexshader =
+            read_file( SHADER_FILES[ VERTEX_SHADER ].binary );
+        auto fragmentshader =
+            read_file( SHADER_FILES[ FRAGMENT_SHADER ].binary );
+        vertexshader_module = create_shader_module( device, vertexshader );
+        fragmentshader_module = create_shader_module( device, fragmentshader );
+    }
+    void create_pipeline_cache( void )
+    {
+        pipeline_cache =
+            device.createPipelineCacheUnique( vk::PipelineCacheCreateInfo() );
+    }
+    // The window's color image stays in its attachment layout; the frame
+    // graph transitions it and provides its external dependencies. Depth is
+    // cleared and discarded every frame, so the render pass brings it in
+    // from undefined itself. With multisampling the samples go to a
+    // transient color attachment (attachment 0) that is resolved into the
+    // window's image (attachment 2) at the end of the subpass.
+    vk::UniqueRenderPass create_render_pass( vk::Format color_format )
     {
-        std::array< vk::AttachmentDescription, 2 > attachment_description;
+        std::vector< vk::AttachmentDescription > attachment_description(
+            multisampled() ? 3u : 2u );
         auto &color_attachment_description = attachment_description[ 0 ];
-        color_attachment_description.format = format;
-        color_attachment_description.samples = vk::SampleCountFlagBits::e1;
+        color_attachment_description.format = color_format;
+        color_attachment_description.samples = sample_count;
         color_attachment_description.loadOp = vk::AttachmentLoadOp::eClear;
-        color_attachment_description.storeOp = vk::AttachmentStoreOp::eStore;
-        color_attachment_description.initialLayout =
-            vk::ImageLayout::eUndefined;
+        color_attachment_description.storeOp = multisampled()
+            ? vk::AttachmentStoreOp::eDontCare
+            : vk::AttachmentStoreOp::eStore;
+        color_attachment_description.stencilLoadOp =
+            vk::AttachmentLoadOp::eDontCare;
+        color_attachment_description.stencilStoreOp =
+            vk::AttachmentStoreOp::eDontCare;
+        color_attachment_description.initialLayout = multisampled()
+            ? vk::ImageLayout::eUndefined
+            : vk::ImageLayout::eColorAttachmentOptimal;
         color_attachment_description.finalLayout =
-            vk::ImageLayout::ePresentSrcKHR;
+            vk::ImageLayout::eColorAttachmentOptimal;
 
         auto &depth_attachment_description = attachment_description[ 1 ];
-        depth_attachment_description.format =
-            find_depth_format( physical_device );
-        depth_attachment_description.samples = vk::SampleCountFlagBits::e1;
+        depth_attachment_description.format = depth_format;
+        depth_attachment_description.samples = sample_count;
         depth_attachment_description.loadOp = vk::AttachmentLoadOp::eClear;
-        depth_attachment_description.storeOp = vk::AttachmentStoreOp::eStore;
+        depth_attachment_description.storeOp =
+            vk::AttachmentStoreOp::eDontCare;
+        depth_attachment_description.stencilLoadOp =
+            vk::AttachmentLoadOp::eDontCare;
+        depth_attachment_description.stencilStoreOp =
+            vk::AttachmentStoreOp::eDontCare;
         depth_attachment_description.initialLayout =
             vk::ImageLayout::eUndefined;
         depth_attachment_description.finalLayout =
             vk::ImageLayout::eDepthStencilAttachmentOptimal;
 
+        vk::AttachmentReference resolve_attachment_reference;
+        if( multisampled() )
+        {
+            auto &resolve_attachment_description = attachment_description[ 2 ];
+            resolve_attachment_description.format = color_format;
+            resolve_attachment_description.samples =
+                vk::SampleCountFlagBits::e1;
+            resolve_attachment_description.loadOp =
+                vk::AttachmentLoadOp::eDontCare;
+            resolve_attachment_description.storeOp =
+                vk::AttachmentStoreOp::eStore;
+            resolve_attachment_description.stencilLoadOp =
+                vk::AttachmentLoadOp::eDontCare;
+            resolve_attachment_description.stencilStoreOp =
+                vk::AttachmentStoreOp::eDontCare;
+            resolve_attachment_description.initialLayout =
+                vk::ImageLayout::eColorAttachmentOptimal;
+            resolve_attachment_description.finalLayout =
+                vk::ImageLayout::eColorAttachmentOptimal;
+
+            resolve_attachment_reference.attachment = 2u;
+            resolve_attachment_reference.layout =
+                vk::ImageLayout::eColorAttachmentOptimal;
+        }
+
         vk::AttachmentReference color_attachment_reference;
         color_attachment_reference.attachment = 0u;
         color_attachment_reference.layout =
@@ -1050,78 +1668,102 @@ private:
             vk::PipelineBindPoint::eGraphics;
         subpass_description.colorAttachmentCount = 1u;
         subpass_description.pColorAttachments = &color_attachment_reference;
+        if( multisampled() )
+        {
+            subpass_description.pResolveAttachments =
+                &resolve_attachment_reference;
+        }
         subpass_description.pDepthStencilAttachment =
             &depth_attachment_reference;
 
-        vk::SubpassDependency subpass_dependency;
-        subpass_dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
-        subpass_dependency.dstSubpass = 0u;
-        subpass_dependency.srcStageMask =
-            vk::PipelineStageFlagBits::eColorAttachmentOutput;
-        subpass_dependency.srcAccessMask = vk::AccessFlags();
-        subpass_dependency.dstStageMask =
-            vk::PipelineStageFlagBits::eColorAttachmentOutput;
-        subpass_dependency.dstAccessMask =
-            vk::AccessFlagBits::eColorAttachmentRead |
-            vk::AccessFlagBits::eColorAttachmentWrite;
-
         vk::RenderPassCreateInfo render_pass_info;
         render_pass_info.attachmentCount =
             static_cast< std::uint32_t >( attachment_description.size() );
         render_pass_info.pAttachments = attachment_description.data();
         render_pass_info.subpassCount = 1u;
         render_pass_info.pSubpasses = &subpass_description;
+        // Orders the previous frame's depth (and multisampled color) writes
+        // before this frame's clear of the same images.
+        vk::SubpassDependency depth_dependency;
+        depth_dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
+        depth_dependency.dstSubpass = 0u;
+        depth_dependency.srcStageMask =
+            vk::PipelineStageFlagBits::eEarlyFragmentTests |
+            vk::PipelineStageFlagBits::eLateFragmentTests;
+        depth_dependency.srcAccessMask =
+            vk::AccessFlagBits::eDepthStencilAttachmentWrite;
+        depth_dependency.dstStageMask =
+            vk::PipelineStageFlagBits::eEarlyFragmentTests |
+            vk::PipelineStageFlagBits::eLateFragmentTests;
+        depth_dependency.dstAccessMask =
+            vk::AccessFlagBits::eDepthStencilAttachmentRead |
+            vk::AccessFlagBits::eDepthStencilAttachmentWrite;
+        if( multisampled() )
+        {
+            depth_dependency.srcStageMask |=
+                vk::PipelineStageFlagBits::eColorAttachmentOutput;
+            depth_dependency.srcAccessMask |=
+                vk::AccessFlagBits::eColorAttachmentWrite;
+            depth_dependency.dstStageMask |=
+                vk::PipelineStageFlagBits::eColorAttachmentOutput;
+            depth_dependency.dstAccessMask |=
+                vk::AccessFlagBits::eColorAttachmentWrite;
+        }
         render_pass_info.dependencyCount = 1u;
-        render_pass_info.pDependencies = &subpass_dependency;
-        render_pass = device.createRenderPassUnique( render_pass_info );
-    }
-    void create_descriptor_set_layout( void )
-    {
-        vk::DescriptorSetLayoutBinding ubo_descriptor_set_layout_binding;
-        ubo_descriptor_set_layout_binding.binding = 0u;
-        ubo_descriptor_set_layout_binding.descriptorType =
-            vk::DescriptorType::eUniformBuffer;
-        ubo_descriptor_set_layout_binding.descriptorCount = 1u;
-        ubo_descriptor_set_layout_binding.stageFlags =
-            vk::ShaderStageFlagBits::eVertex;
-
-        vk::DescriptorSetLayoutCreateInfo ubo_descriptor_set_layout_info;
-        ubo_descriptor_set_layout_info.bindingCount = 1u;
-        ubo_descriptor_set_layout_info.pBindings =
-            &ubo_descriptor_set_layout_binding;
-
-        ubo_descriptor_set_layout = device.createDescriptorSetLayoutUnique(
-            ubo_descriptor_set_layout_info );
+        render_pass_info.pDependencies = &depth_dependency;
+        return device.createRenderPassUnique( render_pass_info );
     }
-    void create_graphics_pipeline( void )
+    vk::UniquePipeline create_graphics_pipeline(
+        vk::RenderPass render_pass,
+        vk::ShaderModule vertex_module,
+        vk::ShaderModule fragment_module,
+        variant::constants const &constants )
     {
-        auto vertexshader = read_file( "vert.spv" );
-        auto fragmentshader = read_file( "frag.spv" );
-        vertexshader_module = create_shader_module( device, vertexshader );
-        fragmentshader_module = create_shader_module( device, fragmentshader );
-
+        std::array<
+            vk::SpecializationMapEntry,
+            variant::constants::MAX_CONSTANTS >
+            specialization_entries;
+        auto const specialization_info = variant::make_specialization_info(
+            constants, specialization_entries );
+        auto const pass = get_scene_pass( constants );
         vk::PipelineShaderStageCreateInfo pipeline_shader_stage_info[ 2 ];
         pipeline_shader_stage_info[ 0 ].stage =
             vk::ShaderStageFlagBits::eVertex;
-        pipeline_shader_stage_info[ 0 ].module = *vertexshader_module;
+        pipeline_shader_stage_info[ 0 ].module = vertex_module;
         pipeline_shader_stage_info[ 0 ].pName = "main";
         pipeline_shader_stage_info[ 1 ].stage =
             vk::ShaderStageFlagBits::eFragment;
-        pipeline_shader_stage_info[ 1 ].module = *fragmentshader_module;
+        pipeline_shader_stage_info[ 1 ].module = fragment_module;
         pipeline_shader_stage_info[ 1 ].pName = "main";
+        pipeline_shader_stage_info[ 1 ].pSpecializationInfo =
+            &specialization_info;
 
         vk::PipelineVertexInputStateCreateInfo pipeline_vertex_input_state_info;
         auto const vertex_input_description =
-            Vertex::get_vertex_input_description();
-        auto const &binding_description =
-            std::get< 0 >( vertex_input_description );
-        auto const &attribute_description =
+            Vertex::get_vertex_input_description( 0u );
+        auto const instance_input_description =
+            InstanceData::get_vertex_input_description( 1u );
+        std::array< vk::VertexInputBindingDescription, 2 > const
+            binding_description = {
+                {std::get< 0 >( vertex_input_description ),
+                 std::get< 0 >( instance_input_description )}};
+        auto const &vertex_attributes =
             std::get< 1 >( vertex_input_description );
-        pipeline_vertex_input_state_info.vertexBindingDescriptionCount = 1;
+        auto const &instance_attributes =
+            std::get< 1 >( instance_input_description );
+        std::vector< vk::VertexInputAttributeDescription >
+            attribute_description( vertex_attributes.begin(),
+                                   vertex_attributes.end() );
+        attribute_description.insert(
+            attribute_description.end(),
+            instance_attributes.begin(),
+            instance_attributes.end() );
+        pipeline_vertex_input_state_info.vertexBindingDescriptionCount =
+            static_cast< std::uint32_t >( binding_description.size() );
         pipeline_vertex_input_state_info.pVertexBindingDescriptions =
-            &binding_description;
+            binding_description.data();
         pipeline_vertex_input_state_info.vertexAttributeDescriptionCount =
-            attribute_description.size();
+            static_cast< std::uint32_t >( attribute_description.size() );
         pipeline_vertex_input_state_info.pVertexAttributeDescriptions =
             attribute_description.data();
 
@@ -1131,54 +1773,57 @@ private:
             vk::PrimitiveTopology::eTriangleList;
         pipeline_input_assembly_state_info.primitiveRestartEnable = VK_FALSE;
 
-        vk::Viewport viewport;
-        viewport.x = 0.0f;
-        viewport.y = 0.0f;
-        viewport.width = static_cast< float >( extent.width );
-        viewport.height = static_cast< float >( extent.height );
-        viewport.minDepth = 0.0f;
-        viewport.maxDepth = 1.0f;
-
-        vk::Rect2D scissor;
-        scissor.offset.x = 0;
-        scissor.offset.y = 0;
-        scissor.extent = extent;
-
+        // Viewport and scissor are dynamic so one pipeline serves every
+        // surface size and survives swapchain recreation.
         vk::PipelineViewportStateCreateInfo pipeline_viewport_state_info;
         pipeline_viewport_state_info.viewportCount = 1u;
-        pipeline_viewport_state_info.pViewports = &viewport;
         pipeline_viewport_state_info.scissorCount = 1u;
-        pipeline_viewport_state_info.pScissors = &scissor;
+
+        std::array< vk::DynamicState, 2 > dynamic_states = {
+            {vk::DynamicState::eViewport, vk::DynamicState::eScissor}};
+        vk::PipelineDynamicStateCreateInfo pipeline_dynamic_state_info;
+        pipeline_dynamic_state_info.dynamicStateCount =
+            static_cast< std::uint32_t >( dynamic_states.size() );
+        pipeline_dynamic_state_info.pDynamicStates = dynamic_states.data();
 
         vk::PipelineRasterizationStateCreateInfo
             pipeline_rasterization_state_info;
         pipeline_rasterization_state_info.depthClampEnable = VK_FALSE;
         pipeline_rasterization_state_info.polygonMode = vk::PolygonMode::eFill;
         pipeline_rasterization_state_info.lineWidth = 1.0f;
+        // The camera may look at a proxy box from inside.
         pipeline_rasterization_state_info.cullMode =
-            vk::CullModeFlagBits::eBack;
+            pass == scene_pass::occlusion_proxy ? vk::CullModeFlagBits::eNone
+                                                : vk::CullModeFlagBits::eBack;
         pipeline_rasterization_state_info.frontFace =
             vk::FrontFace::eCounterClockwise;
         pipeline_rasterization_state_info.depthBiasEnable = VK_FALSE;
 
         vk::PipelineMultisampleStateCreateInfo pipeline_multisample_state_info;
         pipeline_multisample_state_info.sampleShadingEnable = VK_FALSE;
-        pipeline_multisample_state_info.rasterizationSamples =
-            vk::SampleCountFlagBits::e1;
+        pipeline_multisample_state_info.rasterizationSamples = sample_count;
 
         vk::PipelineDepthStencilStateCreateInfo
             pipeline_depth_stencil_state_info;
         pipeline_depth_stencil_state_info.depthTestEnable = true;
-        pipeline_depth_stencil_state_info.depthWriteEnable = true;
-        pipeline_depth_stencil_state_info.depthCompareOp = vk::CompareOp::eLess;
+        pipeline_depth_stencil_state_info.depthWriteEnable =
+            pass != scene_pass::occlusion_proxy;
+        // Less or equal lets the color draws pass over their own prepass.
+        pipeline_depth_stencil_state_info.depthCompareOp =
+            vk::CompareOp::eLessOrEqual;
         pipeline_depth_stencil_state_info.depthBoundsTestEnable = false;
         pipeline_depth_stencil_state_info.stencilTestEnable = false;
 
         vk::PipelineColorBlendAttachmentState
             pipeline_color_blend_attachment_state;
-        pipeline_color_blend_attachment_state.colorWriteMask =
-            vk::ColorComponentFlagBits::eR | vk::ColorComponentFlagBits::eG |
-            vk::ColorComponentFlagBits::eB | vk::ColorComponentFlagBits::eA;
+        if( pass == scene_pass::color )
+        {
+            pipeline_color_blend_attachment_state.colorWriteMask =
+                vk::ColorComponentFlagBits::eR |
+                vk::ColorComponentFlagBits::eG |
+                vk::ColorComponentFlagBits::eB |
+                vk::ColorComponentFlagBits::eA;
+        }
         pipeline_color_blend_attachment_state.blendEnable = VK_FALSE;
 
         vk::PipelineColorBlendStateCreateInfo pipeline_color_blend_state_info;
@@ -1187,14 +1832,9 @@ private:
         pipeline_color_blend_state_info.pAttachments =
             &pipeline_color_blend_attachment_state;
 
-        vk::PipelineLayoutCreateInfo pipeline_layout_info;
-        pipeline_layout_info.setLayoutCount = 1u;
-        pipeline_layout_info.pSetLayouts = &*ubo_descriptor_set_layout;
-        pipeline_layout =
-            device.createPipelineLayoutUnique( pipeline_layout_info );
-
         vk::GraphicsPipelineCreateInfo graphics_pipeline_info;
-        graphics_pipeline_info.stageCount = 2u;
+        // Depth-only passes need no fragment shader.
+        graphics_pipeline_info.stageCount = pass == scene_pass::color ? 2u : 1u;
         graphics_pipeline_info.pStages = pipeline_shader_stage_info;
         graphics_pipeline_info.pVertexInputState =
             &pipeline_vertex_input_state_info;
@@ -1209,287 +1849,2858 @@ private:
             &pipeline_depth_stencil_state_info;
         graphics_pipeline_info.pColorBlendState =
             &pipeline_color_blend_state_info;
+        graphics_pipeline_info.pDynamicState = &pipeline_dynamic_state_info;
         graphics_pipeline_info.layout = *pipeline_layout;
-        graphics_pipeline_info.renderPass = *render_pass;
+        graphics_pipeline_info.renderPass = render_pass;
         graphics_pipeline_info.subpass = 0u;
-        graphics_pipeline = device.createGraphicsPipelineUnique(
-            nullptr, graphics_pipeline_info );
+        return device.createGraphicsPipelineUnique(
+            *pipeline_cache, graphics_pipeline_info );
     }
-    void create_framebuffer()
+    void create_post_descriptor_set_layout( void )
     {
-        framebuffers.clear();
-        framebuffers.resize( image_views.size() );
-        for( std::size_t i = 0u; i < image_views.size(); ++i )
-        {
-            std::array< vk::ImageView, 2 > attachment = {*image_views[ i ],
-                                                         *depth_image_view};
-            vk::FramebufferCreateInfo framebuffer_info;
-            framebuffer_info.renderPass = *render_pass;
-            framebuffer_info.attachmentCount =
-                static_cast< std::uint32_t >( attachment.size() );
-            framebuffer_info.pAttachments = attachment.data();
-            framebuffer_info.width = extent.width;
-            framebuffer_info.height = extent.height;
-            framebuffer_info.layers = 1u;
-            framebuffers[ i ] =
-                device.createFramebufferUnique( framebuffer_info );
-        }
+        std::array< vk::DescriptorSetLayoutBinding, 2 > bindings;
+        bindings[ 0 ].binding = 0u;
+        bindings[ 0 ].descriptorType =
+            vk::DescriptorType::eCombinedImageSampler;
+        bindings[ 0 ].descriptorCount = 1u;
+        bindings[ 0 ].stageFlags = vk::ShaderStageFlagBits::eCompute;
+        bindings[ 1 ].binding = 1u;
+        bindings[ 1 ].descriptorType = vk::DescriptorType::eStorageImage;
+        bindings[ 1 ].descriptorCount = 1u;
+        bindings[ 1 ].stageFlags = vk::ShaderStageFlagBits::eCompute;
+
+        vk::DescriptorSetLayoutCreateInfo descriptor_set_layout_info;
+        descriptor_set_layout_info.bindingCount =
+            static_cast< std::uint32_t >( bindings.size() );
+        descriptor_set_layout_info.pBindings = bindings.data();
+        post_descriptor_set_layout = device.createDescriptorSetLayoutUnique(
+            descriptor_set_layout_info );
     }
-    void create_command_pool( void )
+    void create_post_pipeline_layout( void )
     {
-        vk::CommandPoolCreateInfo command_pool_info;
-        command_pool_info.queueFamilyIndex = graphics_family_index;
-        command_pool = device.createCommandPoolUnique( command_pool_info );
+        vk::PushConstantRange push_constant_range;
+        push_constant_range.stageFlags = vk::ShaderStageFlagBits::eCompute;
+        push_constant_range.offset = 0u;
+        push_constant_range.size = sizeof( PostParameters );
+
+        vk::PipelineLayoutCreateInfo pipeline_layout_info;
+        pipeline_layout_info.setLayoutCount = 1u;
+        pipeline_layout_info.pSetLayouts = &*post_descriptor_set_layout;
+        pipeline_layout_info.pushConstantRangeCount = 1u;
+        pipeline_layout_info.pPushConstantRanges = &push_constant_range;
+        post_pipeline_layout =
+            device.createPipelineLayoutUnique( pipeline_layout_info );
     }
-    void create_depth_resources( void )
+    vk::UniquePipeline create_post_pipeline( vk::ShaderModule module )
     {
-        auto const depth_format = find_depth_format( physical_device );
-
-        std::tie( depth_image_memory, depth_image ) = create_image(
-            physical_device,
+        vk::ComputePipelineCreateInfo compute_pipeline_info;
+        compute_pipeline_info.stage.stage = vk::ShaderStageFlagBits::eCompute;
+        compute_pipeline_info.stage.module = module;
+        compute_pipeline_info.stage.pName = "main";
+        compute_pipeline_info.layout = *post_pipeline_layout;
+        return device.createComputePipelineUnique(
+            *pipeline_cache, compute_pipeline_info );
+    }
+    void create_mesh( void )
+    {
+        scene_mesh = mesh::optimize( vertices, indices );
+        auto const position = []( Vertex const &v ) {
+            std::array< float, 3 > ret;
+            for( std::size_t c = 0u; c < 3u; ++c )
+                ret[ c ] = std::max( v.pos.value[ c ] / 32767.0f, -1.0f );
+            return ret;
+        };
+        scene_lods = mesh::build_lod_chain(
+            scene_mesh.vertices, scene_mesh.indices, position );
+        auto const width =
+            mesh::select_index_width( scene_mesh.vertices.size() );
+        std::clog << "mesh: " << scene_mesh.vertices.size() << " vertices, "
+                  << scene_mesh.indices.size() << " indices ("
+                  << ( width == mesh::index_width::u16 ? 16 : 32 )
+                  << "-bit), ACMR " << scene_mesh.before.acmr << " -> "
+                  << scene_mesh.after.acmr << ", ATVR "
+                  << scene_mesh.before.atvr << " -> " << scene_mesh.after.atvr
+                  << std::endl;
+        for( std::size_t l = 1u; l < scene_lods.size(); ++l )
+        {
+            std::clog << "mesh: LOD " << l << ", "
+                      << scene_lods[ l ].index_count / 3u
+                      << " triangles, error " << scene_lods[ l ].error
+                      << std::endl;
+        }
+
+        auto lo = position( scene_mesh.vertices.front() ), hi = lo;
+        for( auto const &v : scene_mesh.vertices )
+        {
+            auto const p = position( v );
+            for( std::size_t c = 0u; c < 3u; ++c )
+            {
+                lo[ c ] = std::min( lo[ c ], p[ c ] );
+                hi[ c ] = std::max( hi[ c ], p[ c ] );
+            }
+        }
+        auto const min = glm::vec3( lo[ 0 ], lo[ 1 ], lo[ 2 ] );
+        auto const max = glm::vec3( hi[ 0 ], hi[ 1 ], hi[ 2 ] );
+        mesh_sphere = glm::vec4(
+            ( min + max ) * 0.5f, glm::length( max - min ) * 0.5f );
+    }
+    glm::vec4 get_bounds( glm::mat4 const &world ) const
+    {
+        auto const scale = std::max(
+            glm::length( glm::vec3( world[ 0 ] ) ),
+            std::max(
+                glm::length( glm::vec3( world[ 1 ] ) ),
+                glm::length( glm::vec3( world[ 2 ] ) ) ) );
+        auto const center = world * glm::vec4( glm::vec3( mesh_sphere ), 1.0f );
+        return glm::vec4( glm::vec3( center ), scale );
+    }
+    // The pool's indices are as narrow as the scene mesh allows; meshes
+    // added later must fit the same width.
+    void create_geometry_pool( void )
+    {
+        geometry_pool = std::make_unique< geometry::pool >(
+            *memory_budget,
+            device,
+            *graphics_timeline,
+            graphics_family_index,
+            sizeof( Vertex ),
+            GEOMETRY_POOL_VERTICES,
+            mesh::select_index_width( scene_mesh.vertices.size() ),
+            GEOMETRY_POOL_INDICES );
+        scene_geometry =
+            geometry_pool->add( scene_mesh.vertices, scene_mesh.indices );
+    }
+    // Starts out with identity matrices so a scene without a graph draws
+    // its single instance untransformed.
+    void create_instance_data( void )
+    {
+        auto const identity = glm::mat4();
+        instance_bounds.assign( instance_count, get_bounds( identity ) );
+        InstanceData data;
+        std::memcpy( &data, &identity, sizeof( InstanceData ) );
+        instance_data.assign( instance_count, data );
+    }
+    void create_proxy_geometry( void )
+    {
+        auto lo = scene_mesh.vertices.front().pos.value;
+        auto hi = lo;
+        for( auto const &v : scene_mesh.vertices )
+        {
+            for( std::size_t c = 0u; c < 3u; ++c )
+            {
+                lo[ c ] = std::min( lo[ c ], v.pos.value[ c ] );
+                hi[ c ] = std::max( hi[ c ], v.pos.value[ c ] );
+            }
+        }
+        std::array< Vertex, 8 > corners{};
+        for( std::size_t i = 0u; i < corners.size(); ++i )
+        {
+            for( std::size_t c = 0u; c < 3u; ++c )
+            {
+                corners[ i ].pos.value[ c ] =
+                    ( i >> c ) & 1u ? hi[ c ] : lo[ c ];
+            }
+        }
+        std::vector< std::uint32_t > const box(
+            occlusion::BOX_INDICES.begin(), occlusion::BOX_INDICES.end() );
+        proxy_geometry = geometry_pool->add(
+            corners.data(),
+            static_cast< std::uint32_t >( corners.size() ),
+            box );
+    }
+    void create_textures( void )
+    {
+        texture::image_data white;
+        white.width = 1u;
+        white.height = 1u;
+        white.bytes.assign( 4u, 0xffu );
+        upload_texture( TEXTURE_FORMAT, {white}, 0u, placeholder_texture );
+
+        textures = std::make_unique< texture::streamer >(
+            texture_budget, [this]( vk::Format format ) {
+                return info->formats.supports(
+                    format,
+                    vk::ImageTiling::eOptimal,
+                    vk::FormatFeatureFlagBits::eSampledImage );
+            } );
+        if( !scene_texture_path.empty() )
+            scene_texture = textures->add( scene_texture_path );
+        else
+            scene_texture = textures->add( std::move( white ) );
+    }
+    // Replaces target with an image holding levels base_level.. of mips.
+    // Every level comes from the CPU chain: the streamer may make any of
+    // them the base, so it keeps them all anyway.
+    void upload_texture(
+        vk::Format image_format,
+        std::vector< texture::image_data > const &mips,
+        std::uint32_t base_level,
+        gpu_texture &target )
+    {
+        auto const levels =
+            static_cast< std::uint32_t >( mips.size() ) - base_level;
+        // Offsets stay multiples of every block size used.
+        std::vector< vk::BufferImageCopy > copies( levels );
+        vk::DeviceSize size = 0u;
+        for( std::uint32_t i = 0u; i < levels; ++i )
+        {
+            auto const &level = mips[ base_level + i ];
+            copies[ i ].bufferOffset = size;
+            copies[ i ].imageSubresource = vk::ImageSubresourceLayers(
+                vk::ImageAspectFlagBits::eColor, i, 0u, 1u );
+            copies[ i ].imageExtent =
+                vk::Extent3D( level.width, level.height, 1u );
+            size += ( level.bytes.size() + 15u ) & ~vk::DeviceSize( 15u );
+        }
+
+        texture_upload upload;
+        std::tie( upload.staging_memory, upload.staging_buffer ) =
+            create_buffer(
+                *memory_budget,
+                device,
+                size,
+                vk::BufferUsageFlagBits::eTransferSrc,
+                vk::MemoryPropertyFlagBits::eHostVisible |
+                    vk::MemoryPropertyFlagBits::eHostCoherent );
+        auto data = static_cast< std::uint8_t * >(
+            device.mapMemory( *upload.staging_memory, 0u, size ) );
+        for( std::uint32_t i = 0u; i < levels; ++i )
+        {
+            auto const &bytes = mips[ base_level + i ].bytes;
+            std::memcpy(
+                data + copies[ i ].bufferOffset, bytes.data(), bytes.size() );
+        }
+        device.unmapMemory( *upload.staging_memory );
+
+        auto const &base = mips[ base_level ];
+        gpu_texture next;
+        std::tie( next.memory, next.image ) = create_image(
+            *memory_budget,
+            device,
+            base.width,
+            base.height,
+            image_format,
+            vk::ImageTiling::eOptimal,
+            vk::ImageUsageFlagBits::eTransferDst |
+                vk::ImageUsageFlagBits::eSampled,
+            {vk::MemoryPropertyFlagBits::eDeviceLocal,
+             vk::MemoryPropertyFlags()},
+            vk::SampleCountFlagBits::e1,
+            {},
+            levels );
+        next.view = create_simple_image_view(
+            device,
+            *next.image,
+            image_format,
+            vk::ImageAspectFlagBits::eColor,
+            levels );
+
+        vk::CommandBufferAllocateInfo command_buffer_allocation_info;
+        command_buffer_allocation_info.commandPool = *command_pool;
+        command_buffer_allocation_info.level = vk::CommandBufferLevel::ePrimary;
+        command_buffer_allocation_info.commandBufferCount = 1u;
+        upload.command_buffer = std::move( device.allocateCommandBuffersUnique(
+            command_buffer_allocation_info )[ 0 ] );
+        vk::CommandBufferBeginInfo command_buffer_begin_info;
+        command_buffer_begin_info.flags =
+            vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
+        upload.command_buffer->begin( command_buffer_begin_info );
+        record_mip_upload(
+            *upload.command_buffer,
+            *upload.staging_buffer,
+            *next.image,
+            copies );
+        upload.command_buffer->end();
+
+        vk::SubmitInfo submit_info;
+        submit_info.commandBufferCount = 1u;
+        submit_info.pCommandBuffers = &*upload.command_buffer;
+        upload.done.line = graphics_timeline.get();
+        upload.done.value = graphics_timeline->submit( {submit_info} );
+        upload.replaced = std::move( target );
+        target = std::move( next );
+        texture_uploads.push_back( std::move( upload ) );
+    }
+};
+
+// Collects the work of every window taking part in one present_windows()
+// call so it goes out as a single submit.
+struct frame_batch
+{
+    std::vector< vk::Semaphore > wait_semaphores{};
+    std::vector< vk::PipelineStageFlags > wait_stages{};
+    std::vector< vk::CommandBuffer > command_buffers{};
+    std::vector< vk::Semaphore > signal_semaphores{};
+};
+
+// Per-surface state: swapchain (or offscreen images when headless), depth
+// buffer, framebuffers, uniform buffer, command buffers and readback.
+class vulkan_window
+{
+private:
+    struct readback_slot
+    {
+        memory::allocation memory{};
+        vk::UniqueBuffer buffer{};
+        timeline::point done{};
+        vk::UniqueCommandBuffer command_buffer{};
+        std::uint8_t *data = nullptr;
+    };
+
+    vulkan_device *shared = nullptr;
+    GLFWwindow *window = nullptr;
+    std::function< void( int, int ) > resize_handler{};
+    std::uint32_t graphics_family_index =
+                      std::numeric_limits< std::uint32_t >::max(),
+                  surface_family_index =
+                      std::numeric_limits< std::uint32_t >::max();
+
+    vk::Instance instance = nullptr;
+    vk::PhysicalDevice physical_device = nullptr;
+    device_info::snapshot const *info = nullptr;
+    memory::budget *memory_budget = nullptr;
+    vk::Device device = nullptr;
+    vk::Queue graphics_queue = nullptr, surface_queue = nullptr;
+
+    vk::UniqueSurfaceKHR surface{};
+    device_info::surface_cache surface_info{};
+    vk::UniqueSwapchainKHR swapchain{};
+    vk::Format format{};
+    vk::Extent2D extent{};
+    std::vector< memory::allocation > offscreen_image_memory{};
+    std::vector< vk::UniqueImage > offscreen_images{};
+    std::vector< vk::Image > images{};
+    // When the last frame rendered to each image has completed, i.e. its
+    // per-image resources are free again.
+    std::vector< timeline::point > image_done{};
+    std::vector< vk::UniqueImageView > image_views{};
+
+    vk::RenderPass render_pass = nullptr;
+    vk::Pipeline graphics_pipeline = nullptr;
+    variant::constants scene_constants = scene_variant( color_mode::vertex );
+    // Null unless enabled; see scene_pass.
+    bool depth_prepass = false, occlusion_culling = false;
+    vk::Pipeline depth_prepass_pipeline = nullptr, proxy_pipeline = nullptr;
+    // Draws the instances indirectly when occlusion culling or LOD
+    // selection is on; only the former uses its queries.
+    std::unique_ptr< occlusion::culler > culler{};
+    bool lod_selection = false;
+    // Instances drawn at each LOD by the last selection.
+    std::vector< std::size_t > lod_counts{};
+
+    memory::allocation color_image_memory{};
+    vk::UniqueImage color_image{};
+    vk::UniqueImageView color_image_view{};
+    memory::allocation depth_image_memory{};
+    vk::UniqueImage depth_image{};
+    vk::UniqueImageView depth_image_view{};
+    std::vector< vk::UniqueFramebuffer > framebuffers{};
+
+    graph::render_graph frame_graph{};
+    graph::resource_id frame_color = graph::INVALID_RESOURCE,
+                       frame_scene = graph::INVALID_RESOURCE,
+                       frame_post = graph::INVALID_RESOURCE;
+    std::size_t recording_image = 0u;
+    std::uint64_t pipeline_generation = 0u;
+
+    // Optional compute post-process: the scene renders into scene_images, a
+    // compute pass writes post_images and the result is copied into the
+    // window's image. With a compute-only queue family this runs on its
+    // own queue (post_graph), chained to the scene by a semaphore.
+    bool post_enabled = false, async_post = false;
+    PostParameters post_parameters{};
+    std::vector< memory::allocation > scene_image_memory{},
+        post_image_memory{};
+    std::vector< vk::UniqueImage > scene_images{}, post_images{};
+    std::vector< vk::UniqueImageView > scene_image_views{},
+        post_image_views{};
+    vk::UniqueDescriptorPool post_descriptor_pool{};
+    std::vector< vk::UniqueDescriptorSet > post_descriptor_sets{};
+    std::vector< vk::UniqueCommandBuffer > post_command_buffers{};
+    graph::render_graph post_graph{};
+    graph::resource_id post_scene = graph::INVALID_RESOURCE,
+                       post_output = graph::INVALID_RESOURCE,
+                       post_color = graph::INVALID_RESOURCE;
+
+    // One UBO region per image, persistently mapped like the instances.
+    memory::allocation uniform_buffer_memory{};
+    vk::UniqueBuffer uniform_buffer{};
+    void *uniform_mapped = nullptr;
+    // One region of the device's instance data per image, persistently
+    // mapped; instance_generations is what each region holds, so only
+    // the instances changed since are copied.
+    memory::allocation instance_buffer_memory{};
+    vk::UniqueBuffer instance_buffer{};
+    void *instance_mapped = nullptr;
+    std::vector< std::uint64_t > instance_generations{};
+    vk::UniqueDescriptorPool uniform_descriptor_pool{};
+    // One per image, so a new scene texture is written into each set once
+    // that image's last frame is done with it; texture_generations is
+    // what each set last received.
+    std::vector< vk::UniqueDescriptorSet > uniform_descriptor_sets{};
+    std::vector< std::uint64_t > texture_generations{};
+    std::vector< vk::UniqueCommandBuffer > command_buffers{};
+
+    vk::UniqueSemaphore semaphore_image_available{},
+        semaphore_render_finished{}, semaphore_scene_finished{};
+
+    vk::UniqueCommandPool readback_command_pool{};
+    std::vector< readback_slot > readback_slots{};
+    bool readback_coherent = false;
+    capture::pixel_order readback_order = capture::pixel_order::bgra;
+    graph::render_graph readback_graph{};
+    graph::resource_id readback_color = graph::INVALID_RESOURCE,
+                       readback_buffer = graph::INVALID_RESOURCE;
+    std::uint64_t frame_number = 0u;
+    std::uint32_t image_index = 0u;
+    std::size_t capture_slot = capture::frame_capture::npos;
+    bool capture_lossless = false;
+    std::unique_ptr< capture::frame_capture > frame_capture{};
+
+    // Pixels rendered elsewhere (another device) are copied into the
+    // swapchain image through one host visible upload buffer per image.
+    bool composite_enabled = false;
+    std::vector< std::uint8_t > const *composite_source = nullptr;
+    std::vector< memory::allocation > upload_memory{};
+    std::vector< vk::UniqueBuffer > upload_buffers{};
+    std::vector< void * > upload_data{};
+    std::vector< vk::UniqueCommandBuffer > composite_command_buffers{};
+    graph::render_graph composite_graph{};
+    graph::resource_id composite_color = graph::INVALID_RESOURCE,
+                       composite_upload = graph::INVALID_RESOURCE;
+
+public:
+    vulkan_window( vulkan_device &_shared, GLFWwindow *_window = nullptr )
+        : shared( &_shared )
+        , window( _window )
+        , instance( _shared.get_instance() )
+        , physical_device( _shared.get_physical_device() )
+        , info( &_shared.get_info() )
+    {
+        if( window )
+        {
+            glfwSetWindowUserPointer( window, this );
+        }
+    }
+    vulkan_window( vulkan_window const & ) = delete;
+    vulkan_window( vulkan_window && ) = delete;
+    vulkan_window &operator=( vulkan_window const & ) = delete;
+    vulkan_window &operator=( vulkan_window && ) = delete;
+    ~vulkan_window( void ) = default;
+
+    operator GLFWwindow *( void )
+    {
+        return window;
+    }
+
+    void set_extent( vk::Extent2D _extent )
+    {
+        extent = _extent;
+    }
+    // Color format of the offscreen images; ignored when presenting.
+    void set_format( vk::Format _format )
+    {
+        format = _format;
+    }
+    vk::Extent2D get_extent( void ) const
+    {
+        return extent;
+    }
+    vk::Format get_format( void ) const
+    {
+        return format;
+    }
+    // A capture drops frames rather than stall the renderer; a lossless one
+    // (golden images, AFR composition) waits for a free slot instead.
+    void enable_capture(
+        std::size_t slot_count, capture::sink sink, bool lossless = false )
+    {
+        if( !images.empty() )
+        {
+            throw std::runtime_error(
+                "vulkan_window::enable_capture: already presenting!" );
+        }
+        frame_capture = std::make_unique< capture::frame_capture >(
+            slot_count, std::move( sink ) );
+        capture_lossless = lossless;
+    }
+    void enable_composite( void )
+    {
+        if( !images.empty() )
+        {
+            throw std::runtime_error(
+                "vulkan_window::enable_composite: already presenting!" );
+        }
+        composite_enabled = true;
+    }
+    void enable_post( void )
+    {
+        if( !images.empty() )
+        {
+            throw std::runtime_error(
+                "vulkan_window::enable_post: already presenting!" );
+        }
+        post_enabled = true;
+    }
+    bool get_post_enabled( void ) const
+    {
+        return post_enabled;
+    }
+    // Lays down the scene's depth before shading it, so each pixel is
+    // shaded once.
+    void enable_depth_prepass( void )
+    {
+        if( !images.empty() )
+        {
+            throw std::runtime_error(
+                "vulkan_window::enable_depth_prepass: already presenting!" );
+        }
+        depth_prepass = true;
+    }
+    // Skips instances whose bounding box was hidden the last time the
+    // same swapchain image was rendered (see occlusion::culler).
+    void enable_occlusion_culling( void )
+    {
+        if( !images.empty() )
+        {
+            throw std::runtime_error(
+                "vulkan_window::enable_occlusion_culling: error!" );
+        }
+        occlusion_culling = true;
+    }
+    // Draws each instance at the coarsest LOD whose error stays under a
+    // pixel at its distance from the camera.
+    void enable_lod_selection( void )
+    {
+        if( !images.empty() )
+        {
+            throw std::runtime_error(
+                "vulkan_window::enable_lod_selection: already presenting!" );
+        }
+        lod_selection = true;
+    }
+    // Switching variants while presenting waits for this window's frames
+    // in flight and re-records the command buffers.
+    void set_scene_variant( variant::constants const &constants )
+    {
+        if( constants == scene_constants ) return;
+        scene_constants = constants;
+        if( images.empty() ) return;
+        wait_frames();
+        select_render_pass();
+        create_command_buffer();
+    }
+    variant::constants get_scene_variant( void ) const
+    {
+        return scene_constants;
+    }
+    // While set, the next frames show these tightly packed pixels (same
+    // format and extent as the window) instead of rendering the scene.
+    void set_composite_source( std::vector< std::uint8_t > const *pixels )
+    {
+        composite_source = pixels;
+    }
+    void set_device( void )
+    {
+        if( graphics_family_index ==
+                std::numeric_limits< std::uint32_t >::max() ||
+            surface_family_index ==
+                std::numeric_limits< std::uint32_t >::max() ||
+            !shared->get_device() )
+        {
+            throw std::runtime_error( "vulkan_window::set_device: error!" );
+        }
+        if( device ) return;
+        device = shared->get_device();
+        memory_budget = &shared->get_memory();
+        graphics_queue = shared->get_graphics_queue();
+        surface_queue = device.getQueue( surface_family_index, 0u );
+    }
+    void create_window( void )
+    {
+        if( window ) return;
+        glfwWindowHint( GLFW_CLIENT_API, GLFW_NO_API );
+        window = glfwCreateWindow( WIDTH, HEIGHT, "Vulkan", nullptr, nullptr );
+        glfwSetWindowUserPointer( window, this );
+        glfwSetWindowSizeCallback(
+            window, &vulkan_window::window_size_callback );
+    }
+    void create_surface( void )
+    {
+        if( !window || !instance )
+        {
+            throw std::runtime_error( "vulkan_window::create_surface: error!" );
+        }
+        if( surface ) return;
+        surface = create_glfw_surface( instance, window );
+        surface_info.reset( physical_device, *surface );
+    }
+    std::set< std::uint32_t > select_queue_family( void )
+    {
+        if( !physical_device || ( window && !surface ) )
+        {
+            throw std::runtime_error(
+                "vulkan_window::select_queue_family: error!" );
+        }
+        if( graphics_family_index ==
+                std::numeric_limits< std::uint32_t >::max() ||
+            surface_family_index ==
+                std::numeric_limits< std::uint32_t >::max() )
+        {
+            graphics_family_index = shared->select_queue_family();
+            surface_family_index = headless()
+                ? graphics_family_index
+                : static_cast< std::uint32_t >(
+                      select_surface_queue_family_index(
+                          surface_info, info->queue_families ) );
+            // Captured frames are read back on the graphics queue, so
+            // their post-process stays there too.
+            async_post = post_enabled && !frame_capture &&
+                shared->select_compute_queue_family() != graphics_family_index;
+        }
+        if( async_post )
+        {
+            return {graphics_family_index,
+                    surface_family_index,
+                    shared->get_compute_family_index()};
+        }
+        return {graphics_family_index, surface_family_index};
+    }
+    bool headless( void ) const
+    {
+        return !surface;
+    }
+    void flush_capture( void )
+    {
+        if( frame_capture ) frame_capture->flush();
+    }
+    void print_statistics( void )
+    {
+        if( culler )
+        {
+            std::cout << "occlusion: " << culler->get_visible() << " of "
+                      << culler->get_object_count() << " instances visible"
+                      << std::endl;
+        }
+        if( !lod_counts.empty() )
+        {
+            std::cout << "lod:";
+            for( auto const count : lod_counts ) std::cout << " " << count;
+            std::cout << std::endl;
+        }
+        if( !frame_capture ) return;
+        std::cout << "captured " << frame_capture->captured_count()
+                  << ", dropped " << frame_capture->dropped_count()
+                  << std::endl;
+    }
+    // Compiles the pipelines for the color format the swapchain will get,
+    // so startup can overlap that with uploads; initialize_presentation()
+    // then finds them in the device's cache. Needs the shaders loaded.
+    void prepare_pipelines( void )
+    {
+        if( !headless() )
+            format = select_surface_format( surface_info.get_formats() ).format;
+        else if( format == vk::Format::eUndefined )
+            format = vk::Format::eR8G8B8A8Unorm;
+        select_render_pass();
+    }
+    void initialize_presentation( void )
+    {
+        create_swapchain();
+        create_image_view();
+        create_instance_buffer();
+        create_post_resources();
+        select_render_pass();
+        create_color_resources();
+        create_depth_resources();
+        create_framebuffer();
+        create_frame_graph();
+        create_post_graph();
+        create_uniform_buffer();
+        create_descriptor_pool();
+        create_descriptor_set();
+        create_occlusion_resources();
+        create_command_buffer();
+        create_semaphore();
+        create_readback_resources();
+        create_composite_resources();
+    }
+    // Recreates the per-image resources once this window's frames in
+    // flight are done with them; other windows keep rendering.
+    void reinitialize_presentation( void )
+    {
+        wait_frames();
+        create_swapchain();
+        create_image_view();
+        create_instance_buffer();
+        create_post_resources();
+        select_render_pass();
+        create_color_resources();
+        create_depth_resources();
+        create_framebuffer();
+        create_frame_graph();
+        create_post_graph();
+        create_uniform_buffer();
+        create_descriptor_pool();
+        create_descriptor_set();
+        create_occlusion_resources();
+        create_command_buffer();
+        create_readback_resources();
+        create_composite_resources();
+    }
+
+    // Frame steps driven by present_windows(). begin_frame() returns false
+    // when the window has to sit this frame out (swapchain out of date).
+    bool begin_frame( glm::mat4 const &model ) try
+    {
+        if( pipeline_generation != shared->get_pipeline_generation() )
+        {
+            select_render_pass();
+            // Pending command buffers must not be re-recorded.
+            wait_frames();
+            create_command_buffer();
+        }
+
+        UniformBufferObject ubo;
+        ubo.model = model;
+        ubo.view = glm::lookAt(
+            glm::vec3( 2.0f, 2.0f, 2.0f ),
+            glm::vec3( 0.0f, 0.0f, 0.0f ),
+            glm::vec3( 0.0f, 0.0f, 1.0f ) );
+        ubo.proj = glm::perspective(
+            glm::radians( 45.0f ),
+            extent.width / static_cast< float >( extent.height ),
+            0.1f,
+            10.0f );
+        ubo.proj[ 1 ][ 1 ] *= -1;
+
+        if( headless() )
+        {
+            image_index = static_cast< std::uint32_t >(
+                frame_number % images.size() );
+        }
+        else
+        {
+            image_index = device
+                              .acquireNextImageKHR(
+                                  *swapchain,
+                                  std::numeric_limits< std::uint64_t >::max(),
+                                  *semaphore_image_available,
+                                  nullptr )
+                              .value;
+        }
+        // The image's previous frame may still be in flight (an acquired
+        // swapchain image only means presentation is done with it).
+        image_done[ image_index ].wait();
+        std::memcpy(
+            static_cast< std::uint8_t * >( uniform_mapped ) +
+                image_index * uniform_region(),
+            &ubo,
+            sizeof( UniformBufferObject ) );
+        write_instances( image_index );
+        if( texture_generations[ image_index ] !=
+            shared->get_texture_generation() )
+        {
+            // Updating a bound set invalidates the command buffer.
+            write_texture_descriptor( image_index );
+            record_command_buffer( image_index );
+        }
+        if( culler && !composite_source && culler->update( image_index ) &&
+            lod_selection )
+        {
+            select_lods( ubo );
+        }
+
+        if( composite_source )
+        {
+            auto const upload_size =
+                static_cast< std::size_t >( extent.width ) * extent.height * 4u;
+            if( composite_source->size() != upload_size )
+            {
+                throw std::runtime_error(
+                    "vulkan_window::begin_frame: composite size mismatch!" );
+            }
+            std::memcpy(
+                upload_data[ image_index ],
+                composite_source->data(),
+                composite_source->size() );
+        }
+
+        capture_slot = frame_capture
+            ? frame_capture->acquire_slot( capture_lossless )
+            : capture::frame_capture::npos;
+        if( capture_slot != capture::frame_capture::npos )
+        {
+            auto &slot = readback_slots[ capture_slot ];
+            record_readback( slot, images[ image_index ] );
+        }
+        return true;
+    }
+    catch( std::system_error &err )
+    {
+        if( !is_out_of_date( err ) ) throw;
+        reinitialize_presentation();
+        return false;
+    }
+    void append_to_batch( frame_batch &batch ) const
+    {
+        if( !headless() )
+        {
+            batch.wait_semaphores.push_back( *semaphore_image_available );
+            batch.wait_stages.push_back( image_wait_stages() );
+        }
+        if( async_post_frame() )
+        {
+            batch.signal_semaphores.push_back( *semaphore_scene_finished );
+        }
+        else if( !headless() )
+        {
+            batch.signal_semaphores.push_back( *semaphore_render_finished );
+        }
+        batch.command_buffers.push_back(
+            composite_source ? *composite_command_buffers[ image_index ]
+                             : *command_buffers[ image_index ] );
+        if( capture_slot != capture::frame_capture::npos )
+        {
+            batch.command_buffers.push_back(
+                *readback_slots[ capture_slot ].command_buffer );
+        }
+    }
+    // The async post-process of this frame, submitted to the compute queue
+    // after the graphics batch.
+    void append_to_compute_batch( frame_batch &batch ) const
+    {
+        if( !async_post_frame() ) return;
+        batch.wait_semaphores.push_back( *semaphore_scene_finished );
+        batch.wait_stages.push_back(
+            vk::PipelineStageFlagBits::eComputeShader );
+        batch.command_buffers.push_back( *post_command_buffers[ image_index ] );
+        if( !headless() )
+        {
+            batch.signal_semaphores.push_back( *semaphore_render_finished );
+        }
+    }
+    // rendered is the graphics submission of this frame, post_processed
+    // the compute one (the same point without async post-processing).
+    void end_frame( timeline::point rendered, timeline::point post_processed )
+    {
+        if( capture_slot != capture::frame_capture::npos )
+        {
+            readback_slots[ capture_slot ].done = rendered;
+            submit_readback( capture_slot );
+            capture_slot = capture::frame_capture::npos;
+        }
+        image_done[ image_index ] =
+            async_post_frame() ? post_processed : rendered;
+        if( culler && !composite_source )
+            culler->set_done( image_index, rendered );
+        ++frame_number;
+    }
+    vk::Queue get_surface_queue( void ) const
+    {
+        return surface_queue;
+    }
+    vk::SwapchainKHR get_swapchain( void ) const
+    {
+        return *swapchain;
+    }
+    std::uint32_t get_image_index( void ) const
+    {
+        return image_index;
+    }
+    vk::Semaphore get_render_finished_semaphore( void ) const
+    {
+        return *semaphore_render_finished;
+    }
+    void window_size_changed( int width, int height )
+    {
+        std::cout << "vulkan_window::window_size_changed" << std::endl;
+        reinitialize_presentation();
+    }
+    // Replaces the synchronous window_size_changed() call from inside
+    // glfwPollEvents(), e.g. to hand the event to a render thread.
+    void set_resize_handler( std::function< void( int, int ) > handler )
+    {
+        resize_handler = std::move( handler );
+    }
+    void present_result( vk::Result result )
+    {
+        if( result == vk::Result::eErrorOutOfDateKHR )
+            reinitialize_presentation();
+    }
+
+    // Blocks until the last frame of every image has completed.
+    void wait_frames( void ) const
+    {
+        for( auto const &done : image_done ) done.wait();
+    }
+
+    static bool is_out_of_date( std::system_error const &err )
+    {
+        auto &code = err.code();
+        auto &category = code.category();
+        return category.name() == "vk::Result"s &&
+            vk::Result( code.value() ) == vk::Result::eErrorOutOfDateKHR;
+    }
+
+private:
+    void create_swapchain( void )
+    {
+        if( !physical_device || !device || ( !window && !headless() ) )
+            throw std::runtime_error(
+                "create_swapchain_and_image_view: error!" );
+        if( headless() )
+        {
+            create_offscreen_images();
+            return;
+        }
+        vk::ImageUsageFlags image_usage =
+            vk::ImageUsageFlagBits::eColorAttachment;
+        if( frame_capture ) image_usage |= vk::ImageUsageFlagBits::eTransferSrc;
+        if( composite_enabled || post_enabled )
+            image_usage |= vk::ImageUsageFlagBits::eTransferDst;
+        auto swapchain_tmp = create_simple_swapchain(
+            surface_info,
+            device,
+            image_queue_families(),
+            *swapchain,
+            image_usage );
+        swapchain =
+            std::move( std::get< vk::UniqueSwapchainKHR >( swapchain_tmp ) );
+        format = std::get< vk::Format >( swapchain_tmp );
+        extent = std::get< vk::Extent2D >( swapchain_tmp );
+    }
+    void create_offscreen_images( void )
+    {
+        if( extent.width == 0u || extent.height == 0u )
+        {
+            extent = vk::Extent2D( WIDTH, HEIGHT );
+        }
+        if( format == vk::Format::eUndefined )
+        {
+            format = vk::Format::eR8G8B8A8Unorm;
+        }
+        offscreen_images.clear();
+        offscreen_image_memory.clear();
+        images.clear();
+        for( std::size_t i = 0u; i < OFFSCREEN_IMAGE_COUNT; ++i )
+        {
+            memory::allocation memory;
+            vk::UniqueImage image;
+            std::tie( memory, image ) = create_image(
+                *memory_budget,
+                device,
+                extent.width,
+                extent.height,
+                format,
+                vk::ImageTiling::eOptimal,
+                vk::ImageUsageFlagBits::eColorAttachment |
+                    vk::ImageUsageFlagBits::eTransferSrc |
+                    vk::ImageUsageFlagBits::eTransferDst,
+                {vk::MemoryPropertyFlagBits::eDeviceLocal},
+                vk::SampleCountFlagBits::e1,
+                image_queue_families() );
+            images.push_back( *image );
+            offscreen_images.push_back( std::move( image ) );
+            offscreen_image_memory.push_back( std::move( memory ) );
+        }
+    }
+    void create_image_view( void )
+    {
+        if( !headless() ) images = device.getSwapchainImagesKHR( *swapchain );
+        image_done.assign( images.size(), timeline::point() );
+        image_views.clear();
+        image_views.resize( images.size() );
+        for( std::size_t i = 0u; i < image_views.size(); ++i )
+        {
+            image_views[ i ] = create_simple_image_view(
+                device, images[ i ], format, vk::ImageAspectFlagBits::eColor );
+        }
+    }
+    void select_render_pass( void )
+    {
+        std::tie( render_pass, graphics_pipeline ) =
+            shared->get_render_pass( format, scene_constants );
+        if( depth_prepass )
+        {
+            depth_prepass_pipeline = std::get< vk::Pipeline >(
+                shared->get_render_pass(
+                    format,
+                    with_scene_pass(
+                        scene_constants, scene_pass::depth_prepass ) ) );
+        }
+        if( occlusion_culling )
+        {
+            proxy_pipeline = std::get< vk::Pipeline >(
+                shared->get_render_pass(
+                    format,
+                    with_scene_pass(
+                        scene_constants, scene_pass::occlusion_proxy ) ) );
+        }
+    }
+    // One culler slot per framebuffer, i.e. per recorded command buffer.
+    void create_occlusion_resources( void )
+    {
+        culler.reset();
+        lod_counts.clear();
+        if( !occlusion_culling && !lod_selection ) return;
+        auto const &scene = shared->get_scene_geometry();
+        vk::DrawIndexedIndirectCommand draw;
+        draw.indexCount = shared->get_index_count();
+        draw.instanceCount = 1u;
+        draw.firstIndex = scene.first_index;
+        draw.vertexOffset = scene.vertex_offset;
+        culler = std::make_unique< occlusion::culler >(
+            *memory_budget,
+            device,
+            framebuffers.size(),
+            shared->get_instance_count(),
+            draw,
+            host_write_memory( *memory_budget ),
+            occlusion_culling );
+    }
+    // Projects each instance's bounding sphere with the frame's matrices
+    // and points its draw in slot image_index at the LOD chosen for it.
+    // A camera inside the sphere gets full detail.
+    void select_lods( UniformBufferObject const &ubo )
+    {
+        auto const &levels = shared->get_lods();
+        auto const &bounds = shared->get_instance_bounds();
+        auto const first_index = shared->get_scene_geometry().first_index;
+        auto const mesh_radius = shared->get_mesh_sphere().w;
+        auto const view_model = ubo.view * ubo.model;
+        auto const model_scale = std::max(
+            glm::length( glm::vec3( ubo.model[ 0 ] ) ),
+            std::max(
+                glm::length( glm::vec3( ubo.model[ 1 ] ) ),
+                glm::length( glm::vec3( ubo.model[ 2 ] ) ) ) );
+        // Pixels covered by one unit at distance 1.
+        auto const focal =
+            std::abs( ubo.proj[ 1 ][ 1 ] ) * 0.5f * extent.height;
+        lod_counts.assign( levels.size(), 0u );
+        for( std::uint32_t o = 0u; o < culler->get_object_count(); ++o )
+        {
+            auto const scale = bounds[ o ].w * model_scale;
+            auto const center =
+                view_model * glm::vec4( glm::vec3( bounds[ o ] ), 1.0f );
+            auto const distance = -center.z;
+            auto const level = distance > mesh_radius * scale
+                ? mesh::select_lod( levels, focal * scale / distance )
+                : 0u;
+            culler->set_indices(
+                image_index,
+                o,
+                first_index + levels[ level ].first_index,
+                levels[ level ].index_count );
+            ++lod_counts[ level ];
+        }
+    }
+    void create_framebuffer()
+    {
+        framebuffers.clear();
+        framebuffers.resize( image_views.size() );
+        for( std::size_t i = 0u; i < image_views.size(); ++i )
+        {
+            auto const target =
+                post_enabled ? *scene_image_views[ i ] : *image_views[ i ];
+            std::vector< vk::ImageView > attachment = {target,
+                                                       *depth_image_view};
+            if( shared->multisampled() )
+            {
+                attachment = {*color_image_view, *depth_image_view, target};
+            }
+            vk::FramebufferCreateInfo framebuffer_info;
+            framebuffer_info.renderPass = render_pass;
+            framebuffer_info.attachmentCount =
+                static_cast< std::uint32_t >( attachment.size() );
+            framebuffer_info.pAttachments = attachment.data();
+            framebuffer_info.width = extent.width;
+            framebuffer_info.height = extent.height;
+            framebuffer_info.layers = 1u;
+            framebuffers[ i ] =
+                device.createFramebufferUnique( framebuffer_info );
+        }
+    }
+    // The multisampled color attachment only lives inside the render pass,
+    // like depth.
+    void create_color_resources( void )
+    {
+        color_image_view.reset();
+        color_image.reset();
+        color_image_memory.reset();
+        if( !shared->multisampled() ) return;
+        std::tie( color_image_memory, color_image ) = create_image(
+            *memory_budget,
+            device,
+            extent.width,
+            extent.height,
+            format,
+            vk::ImageTiling::eOptimal,
+            vk::ImageUsageFlagBits::eColorAttachment |
+                vk::ImageUsageFlagBits::eTransientAttachment,
+            {vk::MemoryPropertyFlagBits::eDeviceLocal |
+                 vk::MemoryPropertyFlagBits::eLazilyAllocated,
+             vk::MemoryPropertyFlagBits::eDeviceLocal},
+            shared->get_sample_count() );
+        color_image_view = create_simple_image_view(
+            device, *color_image, format, vk::ImageAspectFlagBits::eColor );
+    }
+    void create_depth_resources( void )
+    {
+        auto const depth_format = shared->get_depth_format();
+
+        // Never read after the pass: on tile-based GPUs lazily allocated
+        // memory lets it live in tile memory only.
+        std::tie( depth_image_memory, depth_image ) = create_image(
+            *memory_budget,
             device,
             extent.width,
             extent.height,
             depth_format,
             vk::ImageTiling::eOptimal,
-            vk::ImageUsageFlagBits::eDepthStencilAttachment,
-            vk::MemoryPropertyFlagBits::eDeviceLocal );
+            vk::ImageUsageFlagBits::eDepthStencilAttachment |
+                vk::ImageUsageFlagBits::eTransientAttachment,
+            {vk::MemoryPropertyFlagBits::eDeviceLocal |
+                 vk::MemoryPropertyFlagBits::eLazilyAllocated,
+             vk::MemoryPropertyFlagBits::eDeviceLocal},
+            shared->get_sample_count() );
         depth_image_view = create_simple_image_view(
             device,
             *depth_image,
             depth_format,
             vk::ImageAspectFlagBits::eDepth );
-
-        transition_image_layout(
+    }
+    vk::DeviceSize instance_region( void ) const
+    {
+        return sizeof( InstanceData ) * shared->get_instance_count();
+    }
+    void create_instance_buffer( void )
+    {
+        auto const size = instance_region() * images.size();
+        std::tie( instance_buffer_memory, instance_buffer ) = create_buffer(
+            *memory_budget,
             device,
-            graphics_queue,
-            *command_pool,
-            *depth_image,
-            depth_format,
-            vk::ImageLayout::eUndefined,
-            vk::ImageLayout::eDepthStencilAttachmentOptimal );
+            size,
+            vk::BufferUsageFlagBits::eVertexBuffer,
+            host_write_memory( *memory_budget ) );
+        instance_mapped =
+            device.mapMemory( *instance_buffer_memory, 0u, size );
+        instance_generations.assign(
+            images.size(), std::numeric_limits< std::uint64_t >::max() );
+    }
+    // Only once image_done[ i ] has completed.
+    void write_instances( std::size_t i )
+    {
+        auto const generation = shared->get_instance_generation();
+        if( instance_generations[ i ] == generation ) return;
+        shared->copy_instances(
+            static_cast< std::uint8_t * >( instance_mapped ) +
+                i * instance_region(),
+            instance_generations[ i ] );
+        instance_generations[ i ] = generation;
+    }
+    vk::DeviceSize uniform_region( void ) const
+    {
+        auto const alignment =
+            info->properties.limits.minUniformBufferOffsetAlignment;
+        return ( sizeof( UniformBufferObject ) + alignment - 1u ) /
+            alignment * alignment;
+    }
+    void create_uniform_buffer( void )
+    {
+        auto const size = uniform_region() * images.size();
+        std::tie( uniform_buffer_memory, uniform_buffer ) = create_buffer(
+            *memory_budget,
+            device,
+            size,
+            vk::BufferUsageFlagBits::eUniformBuffer,
+            host_write_memory( *memory_budget ) );
+        uniform_mapped = device.mapMemory( *uniform_buffer_memory, 0u, size );
+    }
+    void create_descriptor_pool( void )
+    {
+        // The sets go back to the pool they came from.
+        uniform_descriptor_sets.clear();
+        auto const set_count = static_cast< std::uint32_t >( images.size() );
+        vk::DescriptorPoolSize descriptor_pool_size[ 2 ];
+        constexpr std::size_t descriptor_pool_size_size =
+            sizeof( descriptor_pool_size ) /
+            sizeof( descriptor_pool_size[ 0 ] );
+        descriptor_pool_size[ 0 ].type = vk::DescriptorType::eUniformBuffer;
+        descriptor_pool_size[ 0 ].descriptorCount = set_count;
+        descriptor_pool_size[ 1 ].type =
+            vk::DescriptorType::eCombinedImageSampler;
+        descriptor_pool_size[ 1 ].descriptorCount = set_count;
+
+        vk::DescriptorPoolCreateInfo descriptor_pool_info;
+        descriptor_pool_info.flags =
+            vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet;
+        descriptor_pool_info.poolSizeCount =
+            static_cast< std::uint32_t >( descriptor_pool_size_size );
+        descriptor_pool_info.pPoolSizes = descriptor_pool_size;
+        descriptor_pool_info.maxSets = set_count;
+        uniform_descriptor_pool =
+            device.createDescriptorPoolUnique( descriptor_pool_info );
+    }
+    void create_descriptor_set( void )
+    {
+        std::vector< vk::DescriptorSetLayout > descriptor_set_layouts(
+            images.size(), shared->get_descriptor_set_layout() );
+        vk::DescriptorSetAllocateInfo descriptor_set_allocate_info;
+        descriptor_set_allocate_info.descriptorPool = *uniform_descriptor_pool;
+        descriptor_set_allocate_info.descriptorSetCount =
+            static_cast< std::uint32_t >( descriptor_set_layouts.size() );
+        descriptor_set_allocate_info.pSetLayouts =
+            descriptor_set_layouts.data();
+        uniform_descriptor_sets =
+            device.allocateDescriptorSetsUnique( descriptor_set_allocate_info );
+        texture_generations.assign( images.size(), 0u );
+
+        vk::DescriptorBufferInfo descriptor_buffer_info;
+        descriptor_buffer_info.buffer = *uniform_buffer;
+        descriptor_buffer_info.range = sizeof( UniformBufferObject );
+
+        for( std::size_t i = 0u; i < uniform_descriptor_sets.size(); ++i )
+        {
+            descriptor_buffer_info.offset = i * uniform_region();
+            vk::WriteDescriptorSet write_descriptor_set;
+            write_descriptor_set.dstSet = *uniform_descriptor_sets[ i ];
+            write_descriptor_set.dstBinding = 0u;
+            write_descriptor_set.dstArrayElement = 0u;
+            write_descriptor_set.descriptorType =
+                vk::DescriptorType::eUniformBuffer;
+            write_descriptor_set.descriptorCount = 1u;
+            write_descriptor_set.pBufferInfo = &descriptor_buffer_info;
+            device.updateDescriptorSets( write_descriptor_set, nullptr );
+            write_texture_descriptor( i );
+        }
+    }
+    // Only once image_done[ i ] has completed.
+    void write_texture_descriptor( std::size_t i )
+    {
+        texture_generations[ i ] = shared->get_texture_generation();
+        vk::DescriptorImageInfo descriptor_image_info;
+        descriptor_image_info.sampler = shared->get_texture_sampler();
+        descriptor_image_info.imageView = shared->get_scene_texture_view();
+        descriptor_image_info.imageLayout =
+            vk::ImageLayout::eShaderReadOnlyOptimal;
+
+        vk::WriteDescriptorSet write_descriptor_set;
+        write_descriptor_set.dstSet = *uniform_descriptor_sets[ i ];
+        write_descriptor_set.dstBinding = 1u;
+        write_descriptor_set.dstArrayElement = 0u;
+        write_descriptor_set.descriptorType =
+            vk::DescriptorType::eCombinedImageSampler;
+        write_descriptor_set.descriptorCount = 1u;
+        write_descriptor_set.pImageInfo = &descriptor_image_info;
+        device.updateDescriptorSets( write_descriptor_set, nullptr );
+    }
+    // One scene pass writing the window's color image (depth is internal to
+    // the render pass). The graph moves the acquired image into the
+    // attachment layout and on to presentation, or to the readback source
+    // layout when headless. With post-processing the scene goes to the
+    // scene image instead, followed by the post passes here or, async, in
+    // post_graph.
+    void create_frame_graph( void )
+    {
+        frame_graph = graph::render_graph();
+        frame_color = graph::INVALID_RESOURCE;
+        frame_scene = graph::INVALID_RESOURCE;
+        frame_post = graph::INVALID_RESOURCE;
+        if( !async_post )
+        {
+            frame_color = frame_graph.import_image(
+                "color",
+                vk::ImageAspectFlagBits::eColor,
+                graph::usage::undefined,
+                color_final_usage(),
+                image_wait_stages() );
+        }
+        if( post_enabled )
+        {
+            frame_scene = frame_graph.import_image(
+                "scene",
+                vk::ImageAspectFlagBits::eColor,
+                graph::usage::undefined,
+                async_post ? graph::usage::compute_read
+                           : graph::usage::undefined );
+        }
+        frame_graph
+            .add_pass(
+                "scene",
+                [this]( vk::CommandBuffer command_buffer ) {
+                    record_scene( command_buffer, recording_image );
+                } )
+            .write(
+                post_enabled ? frame_scene : frame_color,
+                graph::usage::color_attachment );
+        if( post_enabled && !async_post )
+        {
+            frame_post =
+                add_post_passes( frame_graph, frame_scene, frame_color );
+        }
+        frame_graph.compile( info->memory, device );
+    }
+    // The compute queue side of an async post-process: the scene image
+    // arrives already in the shader read layout.
+    void create_post_graph( void )
+    {
+        post_graph = graph::render_graph();
+        if( !async_post ) return;
+        post_scene = post_graph.import_image(
+            "scene",
+            vk::ImageAspectFlagBits::eColor,
+            graph::usage::compute_read,
+            graph::usage::undefined );
+        post_color = post_graph.import_image(
+            "color",
+            vk::ImageAspectFlagBits::eColor,
+            graph::usage::undefined,
+            color_final_usage(),
+            vk::PipelineStageFlagBits::eComputeShader );
+        post_output = add_post_passes( post_graph, post_scene, post_color );
+        post_graph.compile( info->memory, device );
+    }
+    graph::resource_id add_post_passes(
+        graph::render_graph &g,
+        graph::resource_id scene,
+        graph::resource_id color )
+    {
+        auto const output = g.import_image(
+            "post",
+            vk::ImageAspectFlagBits::eColor,
+            graph::usage::undefined,
+            graph::usage::undefined );
+        g.add_pass(
+             "post",
+             [this]( vk::CommandBuffer command_buffer ) {
+                 record_post( command_buffer, recording_image );
+             } )
+            .read( scene, graph::usage::compute_read )
+            .write( output, graph::usage::compute_write );
+        g.add_pass(
+             "post copy",
+             [this, &g, output, color]( vk::CommandBuffer command_buffer ) {
+                 vk::ImageCopy region;
+                 region.srcSubresource.aspectMask =
+                     vk::ImageAspectFlagBits::eColor;
+                 region.srcSubresource.mipLevel = 0u;
+                 region.srcSubresource.baseArrayLayer = 0u;
+                 region.srcSubresource.layerCount = 1u;
+                 region.dstSubresource = region.srcSubresource;
+                 region.extent.width = extent.width;
+                 region.extent.height = extent.height;
+                 region.extent.depth = 1u;
+                 command_buffer.copyImage(
+                     g.get_image( output ),
+                     vk::ImageLayout::eTransferSrcOptimal,
+                     g.get_image( color ),
+                     vk::ImageLayout::eTransferDstOptimal,
+                     region );
+             } )
+            .read( output, graph::usage::transfer_src )
+            .write( color, graph::usage::transfer_dst );
+        return output;
+    }
+    void create_command_buffer( void )
+    {
+        pipeline_generation = shared->get_pipeline_generation();
+        command_buffers.clear();
+        command_buffers.resize( framebuffers.size() );
+        for( std::size_t i = 0; i < command_buffers.size(); ++i )
+            record_command_buffer( i );
+
+        post_command_buffers.clear();
+        if( !async_post ) return;
+        vk::CommandBufferAllocateInfo command_buffer_allocation_info;
+        command_buffer_allocation_info.commandPool =
+            shared->get_compute_command_pool();
+        command_buffer_allocation_info.level = vk::CommandBufferLevel::ePrimary;
+        command_buffer_allocation_info.commandBufferCount =
+            static_cast< std::uint32_t >( framebuffers.size() );
+        post_command_buffers = device.allocateCommandBuffersUnique(
+            command_buffer_allocation_info );
+        for( std::size_t i = 0; i < post_command_buffers.size(); ++i )
+        {
+            vk::CommandBufferBeginInfo command_buffer_begin_info;
+            command_buffer_begin_info.flags =
+                vk::CommandBufferUsageFlagBits::eSimultaneousUse;
+            post_command_buffers[ i ]->begin( command_buffer_begin_info );
+            post_graph.bind_image( post_scene, *scene_images[ i ] );
+            post_graph.bind_image( post_output, *post_images[ i ] );
+            post_graph.bind_image( post_color, images[ i ] );
+            recording_image = i;
+            post_graph.execute( *post_command_buffers[ i ] );
+            post_command_buffers[ i ]->end();
+        }
+    }
+    // Replaces the command buffer of image i, which must not be pending.
+    void record_command_buffer( std::size_t i )
+    {
+        vk::CommandBufferAllocateInfo command_buffer_allocation_info;
+        command_buffer_allocation_info.commandPool = shared->get_command_pool();
+        command_buffer_allocation_info.level = vk::CommandBufferLevel::ePrimary;
+        command_buffer_allocation_info.commandBufferCount = 1u;
+        command_buffers[ i ] = std::move( device.allocateCommandBuffersUnique(
+            command_buffer_allocation_info )[ 0 ] );
+
+        vk::CommandBufferBeginInfo command_buffer_begin_info;
+        command_buffer_begin_info.flags =
+            vk::CommandBufferUsageFlagBits::eSimultaneousUse;
+        command_buffers[ i ]->begin( command_buffer_begin_info );
+        if( frame_color != graph::INVALID_RESOURCE )
+            frame_graph.bind_image( frame_color, images[ i ] );
+        if( frame_scene != graph::INVALID_RESOURCE )
+            frame_graph.bind_image( frame_scene, *scene_images[ i ] );
+        if( frame_post != graph::INVALID_RESOURCE )
+            frame_graph.bind_image( frame_post, *post_images[ i ] );
+        recording_image = i;
+        frame_graph.execute( *command_buffers[ i ] );
+        command_buffers[ i ]->end();
+    }
+    void record_scene( vk::CommandBuffer command_buffer, std::size_t i )
+    {
+        vk::Viewport viewport;
+        viewport.x = 0.0f;
+        viewport.y = 0.0f;
+        viewport.width = static_cast< float >( extent.width );
+        viewport.height = static_cast< float >( extent.height );
+        viewport.minDepth = 0.0f;
+        viewport.maxDepth = 1.0f;
+
+        vk::Rect2D scissor;
+        scissor.offset.x = 0;
+        scissor.offset.y = 0;
+        scissor.extent = extent;
+
+        vk::RenderPassBeginInfo render_pass_begin_info;
+        render_pass_begin_info.renderPass = render_pass;
+        render_pass_begin_info.framebuffer = *framebuffers[ i ];
+        render_pass_begin_info.renderArea.offset.x = 0;
+        render_pass_begin_info.renderArea.offset.y = 0;
+        render_pass_begin_info.renderArea.extent = extent;
+        std::array< vk::ClearValue, 2 > clear_value{};
+        clear_value[ 0 ].color = vk::ClearColorValue(
+            std::array< float, 4 >{0.0f, 0.0f, 0.0f, 1.0f} );
+        clear_value[ 1 ].depthStencil = vk::ClearDepthStencilValue( 1.0f, 0 );
+        render_pass_begin_info.clearValueCount =
+            static_cast< std::uint32_t >( clear_value.size() );
+        render_pass_begin_info.pClearValues = clear_value.data();
+        if( culler ) culler->record_reset( command_buffer, i );
+        command_buffer.beginRenderPass(
+            render_pass_begin_info, vk::SubpassContents::eInline );
+        command_buffer.bindPipeline(
+            vk::PipelineBindPoint::eGraphics,
+            depth_prepass_pipeline ? depth_prepass_pipeline
+                                   : graphics_pipeline );
+        command_buffer.setViewport( 0u, viewport );
+        command_buffer.setScissor( 0u, scissor );
+        vk::Buffer vertex_buffers[] = {
+            shared->get_vertex_buffer(), *instance_buffer};
+        vk::DeviceSize vertex_buffer_offsets[] = {0, i * instance_region()};
+        command_buffer.bindVertexBuffers(
+            0, 2, vertex_buffers, vertex_buffer_offsets );
+        command_buffer.bindIndexBuffer(
+            shared->get_index_buffer(), 0u, shared->get_index_type() );
+        command_buffer.bindDescriptorSets(
+            vk::PipelineBindPoint::eGraphics,
+            shared->get_pipeline_layout(),
+            0u,
+            *uniform_descriptor_sets[ i ],
+            nullptr );
+        auto const draw = [&]( void ) {
+            if( culler )
+            {
+                culler->record_draws(
+                    command_buffer, i, shared->multi_draw_indirect() );
+                return;
+            }
+            auto const &scene = shared->get_scene_geometry();
+            command_buffer.drawIndexed(
+                shared->get_index_count(),
+                shared->get_instance_count(),
+                scene.first_index,
+                scene.vertex_offset,
+                0u );
+        };
+        draw();
+        if( depth_prepass_pipeline )
+        {
+            command_buffer.bindPipeline(
+                vk::PipelineBindPoint::eGraphics, graphics_pipeline );
+            draw();
+        }
+        if( proxy_pipeline )
+        {
+            command_buffer.bindPipeline(
+                vk::PipelineBindPoint::eGraphics, proxy_pipeline );
+            auto const &proxy = shared->get_proxy_geometry();
+            culler->record_queries(
+                command_buffer, i, [&]( std::uint32_t instance ) {
+                    command_buffer.drawIndexed(
+                        proxy.index_count,
+                        1u,
+                        proxy.first_index,
+                        proxy.vertex_offset,
+                        instance );
+                } );
+        }
+        command_buffer.endRenderPass();
+    }
+    void record_post( vk::CommandBuffer command_buffer, std::size_t i )
+    {
+        command_buffer.bindPipeline(
+            vk::PipelineBindPoint::eCompute, shared->get_post_pipeline() );
+        command_buffer.bindDescriptorSets(
+            vk::PipelineBindPoint::eCompute,
+            shared->get_post_pipeline_layout(),
+            0u,
+            *post_descriptor_sets[ i ],
+            nullptr );
+        command_buffer.pushConstants< PostParameters >(
+            shared->get_post_pipeline_layout(),
+            vk::ShaderStageFlagBits::eCompute,
+            0u,
+            post_parameters );
+        command_buffer.dispatch(
+            ( extent.width + POST_GROUP_SIZE - 1u ) / POST_GROUP_SIZE,
+            ( extent.height + POST_GROUP_SIZE - 1u ) / POST_GROUP_SIZE,
+            1u );
+    }
+    void create_semaphore( void )
+    {
+        vk::SemaphoreCreateInfo semaphore_info;
+        semaphore_image_available =
+            device.createSemaphoreUnique( semaphore_info );
+        semaphore_render_finished =
+            device.createSemaphoreUnique( semaphore_info );
+        semaphore_scene_finished =
+            device.createSemaphoreUnique( semaphore_info );
+    }
+    graph::usage color_final_usage( void ) const
+    {
+        return headless() ? graph::usage::transfer_src : graph::usage::present;
+    }
+    bool async_post_frame( void ) const
+    {
+        return async_post && !composite_source;
+    }
+    // Stages of this frame's submit that wait for the acquired image. The
+    // post-process also writes the scene image there, whose previous
+    // reader is only ordered by the acquire.
+    vk::PipelineStageFlags image_wait_stages( void ) const
+    {
+        if( composite_source ) return vk::PipelineStageFlagBits::eTransfer;
+        if( post_enabled && !async_post )
+        {
+            return vk::PipelineStageFlagBits::eColorAttachmentOutput |
+                vk::PipelineStageFlagBits::eTransfer;
+        }
+        return vk::PipelineStageFlagBits::eColorAttachmentOutput;
+    }
+    // Queue families touching the window's images.
+    std::set< std::uint32_t > image_queue_families( void ) const
+    {
+        std::set< std::uint32_t > ret = {graphics_family_index,
+                                         surface_family_index};
+        if( async_post ) ret.insert( shared->get_compute_family_index() );
+        return ret;
+    }
+    // One scene and one post image per window image, so reusing them is
+    // ordered by the same acquire (or offscreen fence) as the image itself.
+    // The post image is always RGBA8 (storage support is guaranteed); the
+    // shader swizzles and encodes so a plain copy matches the window
+    // format.
+    void create_post_resources( void )
+    {
+        if( !post_enabled ) return;
+        shared->initialize_post();
+
+        post_parameters = PostParameters();
+        if( format == vk::Format::eB8G8R8A8Unorm ||
+            format == vk::Format::eB8G8R8A8Srgb )
+        {
+            post_parameters.swap_red_blue = 1u;
+        }
+        else if(
+            format != vk::Format::eR8G8B8A8Unorm &&
+            format != vk::Format::eR8G8B8A8Srgb )
+        {
+            throw std::runtime_error(
+                "vulkan_window::create_post_resources: unsupported format!" );
+        }
+        if( format == vk::Format::eB8G8R8A8Srgb ||
+            format == vk::Format::eR8G8B8A8Srgb )
+        {
+            post_parameters.encode_srgb = 1u;
+        }
+
+        post_descriptor_sets.clear();
+        scene_image_views.clear();
+        post_image_views.clear();
+        scene_images.clear();
+        post_images.clear();
+        scene_image_memory.clear();
+        post_image_memory.clear();
+        std::set< std::uint32_t > scene_queue_families = {
+            graphics_family_index};
+        if( async_post )
+            scene_queue_families.insert( shared->get_compute_family_index() );
+        for( std::size_t i = 0u; i < images.size(); ++i )
+        {
+            memory::allocation memory;
+            vk::UniqueImage image;
+            std::tie( memory, image ) = create_image(
+                *memory_budget,
+                device,
+                extent.width,
+                extent.height,
+                format,
+                vk::ImageTiling::eOptimal,
+                vk::ImageUsageFlagBits::eColorAttachment |
+                    vk::ImageUsageFlagBits::eSampled,
+                {vk::MemoryPropertyFlagBits::eDeviceLocal},
+                vk::SampleCountFlagBits::e1,
+                scene_queue_families );
+            scene_image_views.push_back( create_simple_image_view(
+                device, *image, format, vk::ImageAspectFlagBits::eColor ) );
+            scene_images.push_back( std::move( image ) );
+            scene_image_memory.push_back( std::move( memory ) );
+
+            std::tie( memory, image ) = create_image(
+                *memory_budget,
+                device,
+                extent.width,
+                extent.height,
+                vk::Format::eR8G8B8A8Unorm,
+                vk::ImageTiling::eOptimal,
+                vk::ImageUsageFlagBits::eStorage |
+                    vk::ImageUsageFlagBits::eTransferSrc,
+                vk::MemoryPropertyFlagBits::eDeviceLocal );
+            post_image_views.push_back( create_simple_image_view(
+                device,
+                *image,
+                vk::Format::eR8G8B8A8Unorm,
+                vk::ImageAspectFlagBits::eColor ) );
+            post_images.push_back( std::move( image ) );
+            post_image_memory.push_back( std::move( memory ) );
+        }
+
+        std::array< vk::DescriptorPoolSize, 2 > descriptor_pool_size;
+        descriptor_pool_size[ 0 ].type =
+            vk::DescriptorType::eCombinedImageSampler;
+        descriptor_pool_size[ 0 ].descriptorCount =
+            static_cast< std::uint32_t >( images.size() );
+        descriptor_pool_size[ 1 ].type = vk::DescriptorType::eStorageImage;
+        descriptor_pool_size[ 1 ].descriptorCount =
+            static_cast< std::uint32_t >( images.size() );
+        vk::DescriptorPoolCreateInfo descriptor_pool_info;
+        descriptor_pool_info.flags =
+            vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet;
+        descriptor_pool_info.poolSizeCount =
+            static_cast< std::uint32_t >( descriptor_pool_size.size() );
+        descriptor_pool_info.pPoolSizes = descriptor_pool_size.data();
+        descriptor_pool_info.maxSets =
+            static_cast< std::uint32_t >( images.size() );
+        post_descriptor_pool =
+            device.createDescriptorPoolUnique( descriptor_pool_info );
+
+        std::vector< vk::DescriptorSetLayout > descriptor_set_layouts(
+            images.size(), shared->get_post_descriptor_set_layout() );
+        vk::DescriptorSetAllocateInfo descriptor_set_allocate_info;
+        descriptor_set_allocate_info.descriptorPool = *post_descriptor_pool;
+        descriptor_set_allocate_info.descriptorSetCount =
+            static_cast< std::uint32_t >( descriptor_set_layouts.size() );
+        descriptor_set_allocate_info.pSetLayouts =
+            descriptor_set_layouts.data();
+        post_descriptor_sets =
+            device.allocateDescriptorSetsUnique( descriptor_set_allocate_info );
+
+        for( std::size_t i = 0u; i < images.size(); ++i )
+        {
+            vk::DescriptorImageInfo scene_info;
+            scene_info.sampler = shared->get_post_sampler();
+            scene_info.imageView = *scene_image_views[ i ];
+            scene_info.imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
+            vk::DescriptorImageInfo post_info;
+            post_info.imageView = *post_image_views[ i ];
+            post_info.imageLayout = vk::ImageLayout::eGeneral;
+
+            std::array< vk::WriteDescriptorSet, 2 > write_descriptor_set;
+            write_descriptor_set[ 0 ].dstSet = *post_descriptor_sets[ i ];
+            write_descriptor_set[ 0 ].dstBinding = 0u;
+            write_descriptor_set[ 0 ].descriptorType =
+                vk::DescriptorType::eCombinedImageSampler;
+            write_descriptor_set[ 0 ].descriptorCount = 1u;
+            write_descriptor_set[ 0 ].pImageInfo = &scene_info;
+            write_descriptor_set[ 1 ].dstSet = *post_descriptor_sets[ i ];
+            write_descriptor_set[ 1 ].dstBinding = 1u;
+            write_descriptor_set[ 1 ].descriptorType =
+                vk::DescriptorType::eStorageImage;
+            write_descriptor_set[ 1 ].descriptorCount = 1u;
+            write_descriptor_set[ 1 ].pImageInfo = &post_info;
+            device.updateDescriptorSets( write_descriptor_set, nullptr );
+        }
+    }
+    void create_readback_resources( void )
+    {
+        if( !frame_capture ) return;
+        frame_capture->flush();
+        readback_slots.clear();
+
+        if( format == vk::Format::eB8G8R8A8Unorm ||
+            format == vk::Format::eB8G8R8A8Srgb )
+        {
+            readback_order = capture::pixel_order::bgra;
+        }
+        else if(
+            format == vk::Format::eR8G8B8A8Unorm ||
+            format == vk::Format::eR8G8B8A8Srgb )
+        {
+            readback_order = capture::pixel_order::rgba;
+        }
+        else
+        {
+            throw std::runtime_error(
+                "vulkan_window::create_readback_resources: unsupported "
+                "format!" );
+        }
+
+        if( !readback_command_pool )
+        {
+            vk::CommandPoolCreateInfo command_pool_info;
+            command_pool_info.flags =
+                vk::CommandPoolCreateFlagBits::eResetCommandBuffer;
+            command_pool_info.queueFamilyIndex = graphics_family_index;
+            readback_command_pool =
+                device.createCommandPoolUnique( command_pool_info );
+        }
+        vk::CommandBufferAllocateInfo command_buffer_allocation_info;
+        command_buffer_allocation_info.commandPool = *readback_command_pool;
+        command_buffer_allocation_info.level = vk::CommandBufferLevel::ePrimary;
+        command_buffer_allocation_info.commandBufferCount =
+            static_cast< std::uint32_t >( frame_capture->slot_count() );
+        auto readback_command_buffers = device.allocateCommandBuffersUnique(
+            command_buffer_allocation_info );
+
+        auto const memory_properties =
+            select_readback_memory_properties( *info );
+        readback_coherent = static_cast< bool >(
+            memory_properties & vk::MemoryPropertyFlagBits::eHostCoherent );
+        vk::DeviceSize const size =
+            static_cast< vk::DeviceSize >( extent.width ) * extent.height * 4u;
+
+        readback_slots.resize( frame_capture->slot_count() );
+        for( std::size_t i = 0u; i < readback_slots.size(); ++i )
+        {
+            auto &slot = readback_slots[ i ];
+            std::tie( slot.memory, slot.buffer ) = create_buffer(
+                *memory_budget,
+                device,
+                size,
+                vk::BufferUsageFlagBits::eTransferDst,
+                memory_properties );
+            slot.data = static_cast< std::uint8_t * >(
+                device.mapMemory( *slot.memory, 0u, size ) );
+            slot.command_buffer = std::move( readback_command_buffers[ i ] );
+        }
+
+        // The color image is borrowed from its final layout and handed
+        // back; the slot buffer ends up visible to the host.
+        readback_graph = graph::render_graph();
+        readback_color = readback_graph.import_image(
+            "color",
+            vk::ImageAspectFlagBits::eColor,
+            color_final_usage(),
+            color_final_usage() );
+        readback_buffer = readback_graph.import_buffer(
+            "readback", graph::usage::host_read, graph::usage::host_read );
+        readback_graph
+            .add_pass(
+                "readback",
+                [this]( vk::CommandBuffer command_buffer ) {
+                    vk::BufferImageCopy region;
+                    region.bufferOffset = 0u;
+                    region.bufferRowLength = 0u;
+                    region.bufferImageHeight = 0u;
+                    region.imageSubresource.aspectMask =
+                        vk::ImageAspectFlagBits::eColor;
+                    region.imageSubresource.mipLevel = 0u;
+                    region.imageSubresource.baseArrayLayer = 0u;
+                    region.imageSubresource.layerCount = 1u;
+                    region.imageExtent.width = extent.width;
+                    region.imageExtent.height = extent.height;
+                    region.imageExtent.depth = 1u;
+                    command_buffer.copyImageToBuffer(
+                        readback_graph.get_image( readback_color ),
+                        vk::ImageLayout::eTransferSrcOptimal,
+                        readback_graph.get_buffer( readback_buffer ),
+                        region );
+                } )
+            .read( readback_color, graph::usage::transfer_src )
+            .write( readback_buffer, graph::usage::transfer_dst );
+        readback_graph.compile( info->memory, device );
+    }
+    void record_readback( readback_slot &slot, vk::Image image )
+    {
+        auto &command_buffer = *slot.command_buffer;
+        command_buffer.reset( vk::CommandBufferResetFlags() );
+        vk::CommandBufferBeginInfo begin_info;
+        begin_info.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
+        command_buffer.begin( begin_info );
+        readback_graph.bind_image( readback_color, image );
+        readback_graph.bind_buffer( readback_buffer, *slot.buffer );
+        readback_graph.execute( command_buffer );
+        command_buffer.end();
+    }
+    void submit_readback( std::size_t slot_index )
+    {
+        auto const &slot = readback_slots[ slot_index ];
+        capture::frame info;
+        info.number = frame_number;
+        info.width = extent.width;
+        info.height = extent.height;
+        info.row_pitch = static_cast< std::size_t >( extent.width ) * 4u;
+        info.order = readback_order;
+        info.data = slot.data;
+
+        auto const dev = device;
+        auto const done = slot.done;
+        auto const memory = *slot.memory;
+        auto const coherent = readback_coherent;
+        frame_capture->submit(
+            slot_index, info, [dev, done, memory, coherent] {
+                done.wait();
+                if( !coherent )
+                {
+                    dev.invalidateMappedMemoryRanges(
+                        vk::MappedMemoryRange( memory, 0u, VK_WHOLE_SIZE ) );
+                }
+            } );
+    }
+
+    void create_composite_resources( void )
+    {
+        if( !composite_enabled ) return;
+        vk::DeviceSize const size =
+            static_cast< vk::DeviceSize >( extent.width ) * extent.height * 4u;
+        upload_memory.clear();
+        upload_buffers.clear();
+        upload_data.clear();
+        for( std::size_t i = 0u; i < images.size(); ++i )
+        {
+            memory::allocation memory;
+            vk::UniqueBuffer buffer;
+            std::tie( memory, buffer ) = create_buffer(
+                *memory_budget,
+                device,
+                size,
+                vk::BufferUsageFlagBits::eTransferSrc,
+                vk::MemoryPropertyFlagBits::eHostVisible |
+                    vk::MemoryPropertyFlagBits::eHostCoherent );
+            upload_data.push_back( device.mapMemory( *memory, 0u, size ) );
+            upload_buffers.push_back( std::move( buffer ) );
+            upload_memory.push_back( std::move( memory ) );
+        }
+
+        vk::CommandBufferAllocateInfo command_buffer_allocation_info;
+        command_buffer_allocation_info.commandPool = shared->get_command_pool();
+        command_buffer_allocation_info.level = vk::CommandBufferLevel::ePrimary;
+        command_buffer_allocation_info.commandBufferCount =
+            static_cast< std::uint32_t >( images.size() );
+        composite_command_buffers = device.allocateCommandBuffersUnique(
+            command_buffer_allocation_info );
+
+        composite_graph = graph::render_graph();
+        composite_color = composite_graph.import_image(
+            "color",
+            vk::ImageAspectFlagBits::eColor,
+            graph::usage::undefined,
+            color_final_usage(),
+            vk::PipelineStageFlagBits::eTransfer );
+        composite_upload = composite_graph.import_buffer(
+            "upload", graph::usage::host_write, graph::usage::undefined );
+        composite_graph
+            .add_pass(
+                "composite",
+                [this]( vk::CommandBuffer command_buffer ) {
+                    vk::BufferImageCopy region;
+                    region.bufferOffset = 0u;
+                    region.bufferRowLength = 0u;
+                    region.bufferImageHeight = 0u;
+                    region.imageSubresource.aspectMask =
+                        vk::ImageAspectFlagBits::eColor;
+                    region.imageSubresource.mipLevel = 0u;
+                    region.imageSubresource.baseArrayLayer = 0u;
+                    region.imageSubresource.layerCount = 1u;
+                    region.imageExtent.width = extent.width;
+                    region.imageExtent.height = extent.height;
+                    region.imageExtent.depth = 1u;
+                    command_buffer.copyBufferToImage(
+                        composite_graph.get_buffer( composite_upload ),
+                        composite_graph.get_image( composite_color ),
+                        vk::ImageLayout::eTransferDstOptimal,
+                        region );
+                } )
+            .read( composite_upload, graph::usage::transfer_src )
+            .write( composite_color, graph::usage::transfer_dst );
+        composite_graph.compile( info->memory, device );
+
+        for( std::size_t i = 0u; i < images.size(); ++i )
+        {
+            auto &command_buffer = *composite_command_buffers[ i ];
+            vk::CommandBufferBeginInfo begin_info;
+            begin_info.flags = vk::CommandBufferUsageFlagBits::eSimultaneousUse;
+            command_buffer.begin( begin_info );
+            composite_graph.bind_image( composite_color, images[ i ] );
+            composite_graph.bind_buffer(
+                composite_upload, *upload_buffers[ i ] );
+            composite_graph.execute( command_buffer );
+            command_buffer.end();
+        }
+    }
+
+    static void
+    window_size_callback( GLFWwindow *window, int width, int height )
+    {
+        auto pwindow = static_cast< vulkan_window * >(
+            glfwGetWindowUserPointer( window ) );
+        if( !pwindow ) return;
+        if( pwindow->resize_handler )
+            pwindow->resize_handler( width, height );
+        else
+            pwindow->window_size_changed( width, height );
+    }
+};
+
+std::uint64_t
+submit_batch( timeline::queue_timeline &queue, frame_batch const &batch )
+{
+    vk::SubmitInfo submit_info;
+    submit_info.waitSemaphoreCount =
+        static_cast< std::uint32_t >( batch.wait_semaphores.size() );
+    submit_info.pWaitSemaphores = batch.wait_semaphores.data();
+    submit_info.pWaitDstStageMask = batch.wait_stages.data();
+    submit_info.commandBufferCount =
+        static_cast< std::uint32_t >( batch.command_buffers.size() );
+    submit_info.pCommandBuffers = batch.command_buffers.data();
+    submit_info.signalSemaphoreCount =
+        static_cast< std::uint32_t >( batch.signal_semaphores.size() );
+    submit_info.pSignalSemaphores = batch.signal_semaphores.data();
+    return queue.submit( {submit_info} );
+}
+
+// Renders one frame on every window: a single queue submit for all of them
+// (and one on the compute queue for async post-processing) and a single
+// presentKHR per present queue covering all their swapchains.
+void present_windows(
+    vulkan_device &shared,
+    std::vector< vulkan_window * > const &windows,
+    glm::mat4 const &model )
+{
+    shared.stream_textures();
+    frame_batch batch, compute_batch;
+    std::vector< vulkan_window * > active;
+    for( auto window : windows )
+    {
+        if( !window->begin_frame( model ) ) continue;
+        window->append_to_batch( batch );
+        window->append_to_compute_batch( compute_batch );
+        active.push_back( window );
+    }
+    if( active.empty() ) return;
+
+    timeline::point rendered{&shared.get_graphics_timeline()};
+    rendered.value = submit_batch( *rendered.line, batch );
+    auto post_processed = rendered;
+    if( !compute_batch.command_buffers.empty() )
+    {
+        post_processed.line = &shared.get_compute_timeline();
+        post_processed.value =
+            submit_batch( *post_processed.line, compute_batch );
+    }
+
+    std::vector< vulkan_window * > pending;
+    for( auto window : active )
+    {
+        window->end_frame( rendered, post_processed );
+        if( !window->headless() ) pending.push_back( window );
+    }
+
+    while( !pending.empty() )
+    {
+        auto const queue = pending.front()->get_surface_queue();
+        std::vector< vulkan_window * > group;
+        std::vector< vk::Semaphore > wait_semaphores;
+        std::vector< vk::SwapchainKHR > swapchains;
+        std::vector< std::uint32_t > image_indices;
+        auto const split = std::stable_partition(
+            pending.begin(), pending.end(), [queue]( vulkan_window *w ) {
+                return w->get_surface_queue() == queue;
+            } );
+        for( auto it = pending.begin(); it != split; ++it )
+        {
+            group.push_back( *it );
+            wait_semaphores.push_back(
+                ( *it )->get_render_finished_semaphore() );
+            swapchains.push_back( ( *it )->get_swapchain() );
+            image_indices.push_back( ( *it )->get_image_index() );
+        }
+        pending.erase( pending.begin(), split );
+
+        std::vector< vk::Result > results( group.size(), vk::Result::eSuccess );
+        vk::PresentInfoKHR present_info;
+        present_info.waitSemaphoreCount =
+            static_cast< std::uint32_t >( wait_semaphores.size() );
+        present_info.pWaitSemaphores = wait_semaphores.data();
+        present_info.swapchainCount =
+            static_cast< std::uint32_t >( swapchains.size() );
+        present_info.pSwapchains = swapchains.data();
+        present_info.pImageIndices = image_indices.data();
+        present_info.pResults = results.data();
+        try
+        {
+            queue.presentKHR( present_info );
+        }
+        catch( std::system_error &err )
+        {
+            if( !vulkan_window::is_out_of_date( err ) ) throw;
+        }
+        for( std::size_t i = 0u; i < group.size(); ++i )
+        {
+            group[ i ]->present_result( results[ i ] );
+        }
     }
-    void create_vertex_buffer( void )
-    {
-        vk::DeviceSize size = sizeof( Vertex ) * vertices.size();
+}
 
-        std::tie( vertex_staging_buffer_memory, vertex_staging_buffer ) =
-            create_buffer(
-                physical_device,
-                device,
-                size,
-                vk::BufferUsageFlagBits::eTransferSrc,
-                vk::MemoryPropertyFlagBits::eHostVisible |
-                    vk::MemoryPropertyFlagBits::eHostCoherent );
-        auto data = device.mapMemory( *vertex_staging_buffer_memory, 0u, size );
-        std::memcpy( data, vertices.data(), size );
-        device.unmapMemory( *vertex_staging_buffer_memory );
+// Secondary devices for alternate-frame rendering, see afr_renderer.
+struct afr_config
+{
+    vk::Instance instance = nullptr;
+    std::vector< vk::PhysicalDevice > devices{};
+    std::vector< char const * > layer_names{};
+};
 
-        std::tie( vertex_buffer_memory, vertex_buffer ) = create_buffer(
-            physical_device,
-            device,
-            size,
-            vk::BufferUsageFlagBits::eTransferDst |
-                vk::BufferUsageFlagBits::eVertexBuffer,
-            vk::MemoryPropertyFlagBits::eDeviceLocal );
-        copy_buffer(
-            device,
-            graphics_queue,
-            *command_pool,
-            *vertex_staging_buffer,
-            *vertex_buffer,
-            size );
-    }
-    void create_index_buffer( void )
-    {
-        vk::DeviceSize size = sizeof( indices[ 0 ] ) * indices.size();
-        vk::UniqueBuffer staging_buffer;
-        vk::UniqueDeviceMemory staging_buffer_memory;
-        std::tie( staging_buffer_memory, staging_buffer ) = create_buffer(
-            physical_device,
-            device,
-            size,
-            vk::BufferUsageFlagBits::eTransferSrc,
-            vk::MemoryPropertyFlagBits::eHostVisible |
-                vk::MemoryPropertyFlagBits::eHostCoherent );
+// Alternate-frame rendering: frame n is rendered by device n % device_count.
+// Device 0 owns the swapchain; the others render headless in the presenting
+// window's format and extent, read back without dropping frames, and are
+// composited by uploading their pixels into the swapchain image. Frames are
+// dispatched device_count - 1 ahead so every device works in parallel.
+class afr_renderer
+{
+public:
+    using model_function = std::function< glm::mat4( std::uint64_t ) >;
 
-        auto data = device.mapMemory( *staging_buffer_memory, 0u, size );
-        std::memcpy( data, indices.data(), static_cast< std::size_t >( size ) );
-        device.unmapMemory( *staging_buffer_memory );
+private:
+    struct secondary
+    {
+        vk::UniqueDevice device{};
+        std::unique_ptr< vulkan_device > shared{};
+        std::unique_ptr< vulkan_window > window{};
+    };
+    struct finished_frame
+    {
+        vk::Extent2D extent{};
+        std::vector< std::uint8_t > pixels{};
+    };
 
-        std::tie( index_buffer_memory, index_buffer ) = create_buffer(
-            physical_device,
-            device,
-            size,
-            vk::BufferUsageFlagBits::eTransferDst |
-                vk::BufferUsageFlagBits::eIndexBuffer,
-            vk::MemoryPropertyFlagBits::eDeviceLocal );
+    vulkan_device &primary_shared;
+    vulkan_window &primary;
+    model_function model;
+    std::mutex mutex{};
+    std::condition_variable cond{};
+    std::map< std::uint64_t, finished_frame > finished{};
+    std::vector< secondary > secondaries{};
+    std::uint64_t dispatched = 0u, presented = 0u;
 
-        copy_buffer(
-            device,
-            graphics_queue,
-            *command_pool,
-            *staging_buffer,
-            *index_buffer,
-            size );
+public:
+    afr_renderer(
+        vulkan_device &_primary_shared,
+        vulkan_window &_primary,
+        afr_config const &config,
+        model_function _model )
+        : primary_shared( _primary_shared )
+        , primary( _primary )
+        , model( std::move( _model ) )
+    {
+        secondaries.resize( config.devices.size() );
+        std::uint64_t const device_count = secondaries.size() + 1u;
+        for( std::size_t i = 0u; i < secondaries.size(); ++i )
+        {
+            auto &s = secondaries[ i ];
+            auto const physical_device = config.devices[ i ];
+            std::uint64_t const index = i + 1u;
+            s.shared = std::make_unique< vulkan_device >(
+                config.instance, physical_device );
+            s.shared->set_sample_count(
+                static_cast< std::uint32_t >(
+                    primary_shared.get_sample_count() ) );
+            s.window = std::make_unique< vulkan_window >( *s.shared );
+            s.window->set_extent( primary.get_extent() );
+            s.window->set_format( primary.get_format() );
+            if( primary.get_post_enabled() ) s.window->enable_post();
+            s.window->set_scene_variant( primary.get_scene_variant() );
+            s.window->enable_capture(
+                2u,
+                [this, index, device_count]( capture::frame const &f ) {
+                    receive( f.number * device_count + index, f );
+                },
+                true );
+            auto const queue_family_index = s.window->select_queue_family();
+            s.device = create_device(
+                physical_device, queue_family_index, {}, config.layer_names );
+            s.shared->set_device( *s.device );
+            s.window->set_device();
+            s.shared->initialize();
+            s.window->initialize_presentation();
+            std::cout << "afr: device " << index << ": "
+                      << s.shared->get_info().properties.deviceName
+                      << std::endl;
+        }
     }
-    void create_uniform_buffer( void )
+    afr_renderer( afr_renderer const & ) = delete;
+    afr_renderer( afr_renderer && ) = delete;
+    afr_renderer &operator=( afr_renderer const & ) = delete;
+    afr_renderer &operator=( afr_renderer && ) = delete;
+    ~afr_renderer( void )
     {
-        vk::DeviceSize size = sizeof( UniformBufferObject );
-        std::tie( uniform_buffer_memory, uniform_buffer ) = create_buffer(
-            physical_device,
-            device,
-            size,
-            vk::BufferUsageFlagBits::eUniformBuffer,
-            vk::MemoryPropertyFlagBits::eHostVisible |
-                vk::MemoryPropertyFlagBits::eHostCoherent );
+        for( auto &s : secondaries )
+        {
+            s.device->waitIdle();
+            s.window->flush_capture();
+        }
     }
-    void create_descriptor_pool( void )
+
+    std::vector< vulkan_device * > get_secondary_devices( void ) const
     {
-        vk::DescriptorPoolSize descriptor_pool_size[ 1 ];
-        constexpr std::size_t descriptor_pool_size_size =
-            sizeof( descriptor_pool_size ) /
-            sizeof( descriptor_pool_size[ 0 ] );
-        descriptor_pool_size[ 0 ].type = vk::DescriptorType::eUniformBuffer;
-        descriptor_pool_size[ 0 ].descriptorCount = 1u;
+        std::vector< vulkan_device * > ret;
+        for( auto &s : secondaries )
+            ret.push_back( s.shared.get() );
+        return ret;
+    }
 
-        vk::DescriptorPoolCreateInfo descriptor_pool_info;
-        descriptor_pool_info.flags =
-            vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet;
-        descriptor_pool_info.poolSizeCount =
-            static_cast< std::uint32_t >( descriptor_pool_size_size );
-        descriptor_pool_info.pPoolSizes = descriptor_pool_size;
-        descriptor_pool_info.maxSets = 1u;
-        uniform_descriptor_pool =
-            device.createDescriptorPoolUnique( descriptor_pool_info );
+    void present( void )
+    {
+        std::uint64_t const device_count = secondaries.size() + 1u;
+        for( ; dispatched < presented + device_count; ++dispatched )
+        {
+            auto const index = dispatched % device_count;
+            if( index == 0u ) continue;
+            auto &s = secondaries[ index - 1u ];
+            present_windows( *s.shared, {s.window.get()}, model( dispatched ) );
+        }
+
+        auto const n = presented++;
+        if( n % device_count != 0u )
+        {
+            auto const frame = wait_for( n );
+            // Frames rendered before a resize reached the secondaries are
+            // redrawn on the presenting device instead.
+            if( frame.extent == primary.get_extent() )
+            {
+                primary.set_composite_source( &frame.pixels );
+                present_windows( primary_shared, {&primary}, model( n ) );
+                primary.set_composite_source( nullptr );
+                resize_secondaries();
+                return;
+            }
+        }
+        present_windows( primary_shared, {&primary}, model( n ) );
+        resize_secondaries();
     }
-    void create_descriptor_set( void )
+
+private:
+    void receive( std::uint64_t number, capture::frame const &f )
     {
-        vk::DescriptorSetLayout descriptor_set_layouts[] = {
-            *ubo_descriptor_set_layout};
-        constexpr std::size_t descriptor_set_layouts_size =
-            sizeof( descriptor_set_layouts ) /
-            sizeof( descriptor_set_layouts[ 0 ] );
-        vk::DescriptorSetAllocateInfo descriptor_set_allocate_info;
-        descriptor_set_allocate_info.descriptorPool = *uniform_descriptor_pool;
-        descriptor_set_allocate_info.descriptorSetCount =
-            static_cast< std::uint32_t >( descriptor_set_layouts_size );
-        descriptor_set_allocate_info.pSetLayouts = descriptor_set_layouts;
-        uniform_descriptor_set = std::move( device.allocateDescriptorSetsUnique(
-            descriptor_set_allocate_info )[ 0 ] );
+        finished_frame frame;
+        frame.extent = vk::Extent2D( f.width, f.height );
+        auto const row = static_cast< std::size_t >( f.width ) * 4u;
+        frame.pixels.resize( row * f.height );
+        for( std::uint32_t y = 0u; y < f.height; ++y )
+        {
+            std::memcpy(
+                frame.pixels.data() + row * y, f.data + f.row_pitch * y, row );
+        }
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+            finished.emplace( number, std::move( frame ) );
+        }
+        cond.notify_all();
+    }
+    finished_frame wait_for( std::uint64_t number )
+    {
+        std::unique_lock< std::mutex > lock( mutex );
+        cond.wait( lock, [this, number] { return finished.count( number ); } );
+        auto it = finished.find( number );
+        auto ret = std::move( it->second );
+        finished.erase( it );
+        return ret;
+    }
+    void resize_secondaries( void )
+    {
+        auto const extent = primary.get_extent();
+        for( auto &s : secondaries )
+        {
+            if( s.window->get_extent() == extent ) continue;
+            s.window->flush_capture();
+            s.window->set_extent( extent );
+            s.window->reinitialize_presentation();
+        }
+    }
+};
 
-        vk::DescriptorBufferInfo descriptor_buffer_info;
-        descriptor_buffer_info.buffer = *uniform_buffer;
-        descriptor_buffer_info.offset = 0u;
-        descriptor_buffer_info.range = sizeof( UniformBufferObject );
+// Watches the shader files: GLSL edits are recompiled to SPIR-V, SPIR-V
+// changes rebuild the pipelines of every device in the background. The
+// main loop swaps them in with apply_shaders().
+std::unique_ptr< watch::file_watcher >
+create_shader_watcher( std::vector< vulkan_device * > devices )
+{
+    if( !watch::file_watcher::is_supported() )
+    {
+        std::cerr << "hot reload: not available on this platform"
+                  << std::endl;
+        return nullptr;
+    }
+    std::vector< std::string > files;
+    for( auto const &file : SHADER_FILES )
+    {
+        files.push_back( file.source );
+        files.push_back( file.binary );
+    }
+    // A GLSL edit is compiled and rebuilt in one call; the SPIR-V written
+    // by that compile then shows up as an event of its own (own_writes),
+    // which must not rebuild the pipelines a second time.
+    return std::make_unique< watch::file_watcher >(
+        ".",
+        files,
+        [devices, own_writes = std::set< std::string >()](
+            std::vector< std::string > const &changed ) mutable {
+            bool rebuild = false;
+            for( auto const &name : changed )
+            {
+                for( auto const &file : SHADER_FILES )
+                {
+                    if( name == file.binary && !own_writes.erase( name ) )
+                        rebuild = true;
+                    if( name != file.source ) continue;
+                    auto const command = "glslangValidator -V "s +
+                        file.source + " -o " + file.binary;
+                    if( std::system( command.c_str() ) != 0 )
+                    {
+                        throw std::runtime_error(
+                            "failed to compile "s + file.source );
+                    }
+                    own_writes.insert( file.binary );
+                    rebuild = true;
+                }
+            }
+            if( !rebuild ) return;
+            auto const start = std::chrono::high_resolution_clock::now();
+            for( auto device : devices )
+                device->rebuild_shaders();
+            auto const end = std::chrono::high_resolution_clock::now();
+            std::cout << "hot reload: pipelines rebuilt in "
+                      << std::chrono::duration< double, std::milli >(
+                             end - start )
+                             .count()
+                      << " ms" << std::endl;
+        } );
+}
 
-        vk::WriteDescriptorSet write_descriptor_set;
-        write_descriptor_set.dstSet = *uniform_descriptor_set;
-        write_descriptor_set.dstBinding = 0u;
-        write_descriptor_set.dstArrayElement = 0u;
-        write_descriptor_set.descriptorType =
-            vk::DescriptorType::eUniformBuffer;
-        write_descriptor_set.descriptorCount = 1u;
-        write_descriptor_set.pBufferInfo = &descriptor_buffer_info;
-        device.updateDescriptorSets( write_descriptor_set, nullptr );
+// count cubes on a square grid, all children of the first one so moving
+// the root would move the whole field.
+scene::scene_graph create_instance_scene( std::size_t count )
+{
+    scene::scene_graph graph;
+    auto const side = static_cast< std::size_t >(
+        std::ceil( std::sqrt( static_cast< double >( count ) ) ) );
+    auto const cell = 2.0f / side;
+    auto const corner = -0.5f * cell * ( side - 1u );
+    auto const root = graph.add_node();
+    graph.set_position( root, corner, corner, 0.0f );
+    graph.set_scale( root, 0.8f * cell, 0.8f * cell, 0.8f * cell );
+    for( std::size_t i = 1u; i < count; ++i )
+    {
+        auto const node = graph.add_node( root );
+        graph.set_position(
+            node, 1.25f * ( i % side ), 1.25f * ( i / side ), 0.0f );
     }
-    void create_command_buffer( void )
+    return graph;
+}
+
+// What the main thread hands to the render thread in main_loop().
+struct render_message
+{
+    enum class kind
     {
-        vk::CommandBufferAllocateInfo command_buffer_allocation_info;
-        command_buffer_allocation_info.commandPool = *command_pool;
-        command_buffer_allocation_info.level = vk::CommandBufferLevel::ePrimary;
-        command_buffer_allocation_info.commandBufferCount =
-            static_cast< std::uint32_t >( framebuffers.size() );
-        command_buffers = device.allocateCommandBuffersUnique(
-            command_buffer_allocation_info );
+        frame,
+        resize,
+        quit
+    };
+    kind type = kind::frame;
+    // frame: snapshot of the main thread's frame counter, 0 for none.
+    std::uint64_t frame = 0u;
+    // resize: the window whose surface changed size.
+    vulkan_window *window = nullptr;
+    int width = 0, height = 0;
+};
 
-        for( std::size_t i = 0; i < command_buffers.size(); ++i )
+void print_job_statistics( jobs::job_system &job_system )
+{
+    auto const stats = job_system.collect_statistics();
+    std::cout << "jobs:";
+    for( std::size_t i = 0u; i < stats.utilisation.size(); ++i )
+    {
+        std::cout << " " << i << ": " << 100.0 * stats.utilisation[ i ]
+                  << "% (" << stats.tasks[ i ] << " tasks)";
+    }
+    std::cout << std::endl;
+}
+
+void main_loop(
+    vk::Device device,
+    std::unique_ptr< vulkan_device > shared,
+    std::vector< std::unique_ptr< vulkan_window > > windows,
+    afr_config const &afr,
+    bool hot_reload,
+    startup::profile &profile,
+    bool verbose )
+{
+    // Startup as a task graph: the shaders, then every window's pipelines,
+    // compile while the geometry, then the textures, upload.
+    {
+        jobs::task_graph startup_tasks;
+        auto const objects = startup_tasks.add( [&] {
+            profile.measure(
+                "device objects", [&] { shared->initialize_objects(); } );
+        } );
+        auto const shaders = startup_tasks.add(
+            [&] {
+                profile.measure( "shaders", [&] { shared->load_shaders(); } );
+            },
+            {objects} );
+        for( auto &window : windows )
         {
-            vk::CommandBufferBeginInfo command_buffer_begin_info;
-            command_buffer_begin_info.flags =
-                vk::CommandBufferUsageFlagBits::eSimultaneousUse;
-            command_buffers[ i ]->begin( command_buffer_begin_info );
-
-            vk::RenderPassBeginInfo render_pass_begin_info;
-            render_pass_begin_info.renderPass = *render_pass;
-            render_pass_begin_info.framebuffer = *framebuffers[ i ];
-            render_pass_begin_info.renderArea.offset.x = 0;
-            render_pass_begin_info.renderArea.offset.y = 0;
-            render_pass_begin_info.renderArea.extent = extent;
-            std::array< vk::ClearValue, 2 > clear_value{};
-            clear_value[ 0 ].color = vk::ClearColorValue(
-                std::array< float, 4 >{0.0f, 0.0f, 0.0f, 1.0f} );
-            clear_value[ 1 ].depthStencil =
-                vk::ClearDepthStencilValue( 1.0f, 0 );
-            render_pass_begin_info.clearValueCount =
-                static_cast< std::uint32_t >( clear_value.size() );
-            render_pass_begin_info.pClearValues = clear_value.data();
-            command_buffers[ i ]->beginRenderPass(
-                render_pass_begin_info, vk::SubpassContents::eInline );
-            command_buffers[ i ]->bindPipeline(
-                vk::PipelineBindPoint::eGraphics, *graphics_pipeline );
-            vk::Buffer vertex_buffers[] = {*vertex_buffer};
-            vk::DeviceSize vertex_buffer_offsets[] = {0};
-            command_buffers[ i ]->bindVertexBuffers(
-                0, 1, vertex_buffers, vertex_buffer_offsets );
-            command_buffers[ i ]->bindIndexBuffer(
-                *index_buffer, 0u, vk::IndexType::eUint16 );
-            command_buffers[ i ]->bindDescriptorSets(
-                vk::PipelineBindPoint::eGraphics,
-                *pipeline_layout,
-                0u,
-                *uniform_descriptor_set,
-                nullptr );
-            // command_buffers[ i ]->draw( 3, 1, 0, 0 );
-            command_buffers[ i ]->drawIndexed(
-                static_cast< std::uint32_t >( indices.size() ),
-                1u,
-                0u,
-                0u,
-                0u );
-            command_buffers[ i ]->endRenderPass();
-            command_buffers[ i ]->end();
+            auto const w = window.get();
+            startup_tasks.add(
+                [&profile, w] {
+                    profile.measure(
+                        "pipelines", [w] { w->prepare_pipelines(); } );
+                },
+                {shaders} );
         }
+        auto const geometry = startup_tasks.add(
+            [&] {
+                profile.measure(
+                    "geometry upload", [&] { shared->upload_geometry(); } );
+            },
+            {objects} );
+        startup_tasks.add(
+            [&] {
+                profile.measure(
+                    "texture upload", [&] { shared->upload_textures(); } );
+            },
+            {geometry} );
+        jobs::job_system startup_jobs;
+        startup_jobs.run( startup_tasks );
     }
-    void create_semaphore( void )
+    auto const instance_count = shared->get_instance_count();
+    scene::scene_graph instances;
+    if( instance_count > 1u )
+        instances = create_instance_scene( instance_count );
+    std::vector< vulkan_window * > targets;
+    for( auto &window : windows )
     {
-        vk::SemaphoreCreateInfo semaphore_info;
-        semaphore_image_available =
-            device.createSemaphoreUnique( semaphore_info );
-        semaphore_render_finished =
-            device.createSemaphoreUnique( semaphore_info );
+        profile.measure(
+            "presentation", [&] { window->initialize_presentation(); } );
+        targets.push_back( window.get() );
+    }
+    auto const model = []( std::uint64_t n ) {
+        return glm::rotate(
+            glm::mat4(),
+            n * glm::radians( 90.0f ) / 10000,
+            glm::vec3( 0.0f, 0.0f, 1.0f ) );
+    };
+    std::unique_ptr< afr_renderer > renderer;
+    if( !afr.devices.empty() )
+    {
+        renderer = std::make_unique< afr_renderer >(
+            *shared, *windows.front(), afr, model );
+    }
+    std::vector< vulkan_device * > devices = {shared.get()};
+    if( renderer )
+    {
+        auto const secondary = renderer->get_secondary_devices();
+        devices.insert( devices.end(), secondary.begin(), secondary.end() );
     }
+    std::unique_ptr< watch::file_watcher > watcher;
+    if( hot_reload ) watcher = create_shader_watcher( devices );
 
-    void window_size_changed( int width, int height )
+    constexpr static std::size_t NUM_COUNT = 1000u;
+    std::size_t count = 0u;
+
+    // The per-frame CPU work as a task graph: animation, then the local
+    // matrices in parallel chunks, then the world matrices written into
+    // the instance buffer.
+    std::unique_ptr< jobs::job_system > job_system;
+    jobs::task_graph frame_tasks;
+    if( instance_count > 1u )
     {
-        std::cout << "vulkan_window::window_size_changed" << std::endl;
-        device.waitIdle();
-        reinitialize_presentation();
+        job_system = std::make_unique< jobs::job_system >();
+        auto const animate = frame_tasks.add( [&] {
+            auto const half_angle =
+                count * glm::radians( 90.0f ) / 10000 * 0.5f;
+            for( std::size_t i = 1u; i < instances.size();
+                 i += SPINNING_INSTANCE_STRIDE )
+            {
+                instances.set_rotation(
+                    static_cast< scene::node_id >( i ),
+                    0.0f,
+                    0.0f,
+                    std::sin( half_angle ),
+                    std::cos( half_angle ) );
+            }
+            instances.prepare();
+        } );
+        auto const batches = instances.batch_count();
+        auto const chunks = std::min(
+            batches, job_system->get_worker_count() * FRAME_TASK_SPLIT );
+        std::vector< jobs::task_id > locals;
+        for( std::size_t c = 0u; c < chunks; ++c )
+        {
+            auto const first = batches * c / chunks,
+                       last = batches * ( c + 1u ) / chunks;
+            locals.push_back( frame_tasks.add(
+                [&instances, first, last] {
+                    instances.update_local( first, last );
+                },
+                {animate} ) );
+        }
+        frame_tasks.add(
+            [&] { shared->write_instances( instances ); }, locals );
     }
-    static void
-    window_size_callback( GLFWwindow *window, int width, int height )
+
+    // Rendering runs on its own thread so event polling and slow window
+    // system calls never hold up submission. The main thread sends frame
+    // snapshots and window events through a lock-free queue; the render
+    // thread applies events in order and renders the newest snapshot.
+    spsc::queue< render_message, RENDER_QUEUE_SIZE > messages;
+    std::atomic< bool > render_done{false};
+    std::atomic< std::uint64_t > presented{0u};
+    std::exception_ptr render_error;
+    auto const send = [&]( render_message const &message ) {
+        while( !messages.try_push( message ) && !render_done )
+            std::this_thread::yield();
+    };
+    for( auto window : targets )
     {
-        auto pwindow = static_cast< vulkan_window * >(
-            glfwGetWindowUserPointer( window ) );
-        if( !pwindow ) return;
-        pwindow->window_size_changed( width, height );
+        window->set_resize_handler( [&send, window]( int width, int height ) {
+            render_message message;
+            message.type = render_message::kind::resize;
+            message.window = window;
+            message.width = width;
+            message.height = height;
+            send( message );
+        } );
+    }
+
+    std::thread render_thread( [&] {
+        try
+        {
+            auto start = std::chrono::high_resolution_clock::now();
+            std::uint64_t rendered = 0u;
+            while( true )
+            {
+                render_message message, snapshot;
+                bool quit = false;
+                while( messages.try_pop( message ) )
+                {
+                    if( message.type == render_message::kind::quit )
+                        quit = true;
+                    else if( message.type == render_message::kind::resize )
+                        message.window->window_size_changed(
+                            message.width, message.height );
+                    else
+                        snapshot = message;
+                }
+                if( quit ) break;
+                if( snapshot.frame == 0u )
+                {
+                    std::this_thread::yield();
+                    continue;
+                }
+                count = snapshot.frame;
+
+                rendered++;
+                if( rendered % NUM_COUNT == 0 )
+                {
+                    auto end = std::chrono::high_resolution_clock::now();
+                    std::cout << 1 /
+                            std::chrono::duration< double >( end - start )
+                                .count() *
+                            NUM_COUNT
+                              << "fps" << std::endl;
+                    for( auto window : targets )
+                        window->print_statistics();
+                    if( job_system ) print_job_statistics( *job_system );
+                    start = end;
+                }
+
+                for( auto d : devices )
+                    d->apply_shaders();
+                if( job_system ) job_system->run( frame_tasks );
+                if( renderer )
+                    renderer->present();
+                else
+                    present_windows( *shared, targets, model( count ) );
+                presented = snapshot.frame;
+                // Handed to the presentation engine, not yet on screen.
+                if( rendered == 1u && profile.mark_first_frame() )
+                {
+                    std::cout << "time to first frame: "
+                              << profile.get_time_to_first_frame_ms() << " ms"
+                              << std::endl;
+                    if( verbose ) profile.report( std::clog );
+                }
+            }
+            // Surfaces a capture sink's error (full disk, bad path).
+            for( auto window : targets )
+                window->flush_capture();
+        }
+        catch( ... )
+        {
+            render_error = std::current_exception();
+        }
+        render_done = true;
+    } );
+
+    std::uint64_t frame = 0u;
+    while( !render_done )
+    {
+        bool should_close = false;
+        for( auto window : targets )
+            should_close = should_close || glfwWindowShouldClose( *window );
+        if( should_close ) break;
+        glfwPollEvents();
+
+        render_message snapshot;
+        snapshot.frame = frame + 1u;
+        if( frame - presented < MAX_FRAMES_AHEAD &&
+            messages.try_push( snapshot ) )
+            frame++;
+        else
+            std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
     }
+    render_message quit;
+    quit.type = render_message::kind::quit;
+    send( quit );
+    render_thread.join();
+    for( auto window : targets )
+        window->set_resize_handler( nullptr );
+    if( render_error ) std::rethrow_exception( render_error );
+    watcher.reset();
+    device.waitIdle();
+    renderer.reset();
+    windows.clear();
+    shared.reset();
+}
+
+struct options
+{
+    std::string capture_ppm_prefix;
+    std::string capture_raw_file;
+    std::size_t capture_slots = 3u;
+    std::string optimize_mesh_input, optimize_mesh_output;
+    std::string golden_directory;
+    bool golden_update = false;
+    unsigned int golden_tolerance = 2u;
+    std::size_t window_count = 1u;
+    std::size_t device_count = 1u;
+    std::uint32_t msaa_samples = 1u;
+    bool benchmark_msaa = false;
+    bool post = false;
+    bool depth_prepass = false;
+    bool occlusion_culling = false;
+    bool lod_selection = false;
+    bool hot_reload = false;
+    bool verbose = false;
+    color_mode color = color_mode::vertex;
+    std::uint32_t instance_count = 1u;
+    std::string texture_file{};
+    std::size_t texture_budget_mb = DEFAULT_TEXTURE_BUDGET_MB;
 };
 
-void main_loop( vk::Device device, std::unique_ptr< vulkan_window > window )
+options parse_options( int argc, char **argv )
+{
+    options opt;
+    for( int i = 1; i < argc; ++i )
+    {
+        std::string const arg = argv[ i ];
+        auto const value = [&]() -> std::string {
+            if( i + 1 >= argc )
+            {
+                throw std::runtime_error(
+                    "parse_options: missing value for " + arg );
+            }
+            return argv[ ++i ];
+        };
+        if( arg == "--capture-ppm" )
+            opt.capture_ppm_prefix = value();
+        else if( arg == "--capture-raw" )
+            opt.capture_raw_file = value();
+        else if( arg == "--capture-slots" )
+            opt.capture_slots = std::stoul( value() );
+        else if( arg == "--optimize-mesh" )
+        {
+            opt.optimize_mesh_input = value();
+            opt.optimize_mesh_output = value();
+        }
+        else if( arg == "--golden-check" )
+            opt.golden_directory = value();
+        else if( arg == "--golden-update" )
+        {
+            opt.golden_directory = value();
+            opt.golden_update = true;
+        }
+        else if( arg == "--golden-tolerance" )
+            opt.golden_tolerance =
+                static_cast< unsigned int >( std::stoul( value() ) );
+        else if( arg == "--windows" )
+            opt.window_count = std::max( 1ul, std::stoul( value() ) );
+        else if( arg == "--devices" )
+            opt.device_count = std::max( 1ul, std::stoul( value() ) );
+        else if( arg == "--msaa" )
+            opt.msaa_samples = static_cast< std::uint32_t >(
+                std::max( 1ul, std::stoul( value() ) ) );
+        else if( arg == "--benchmark-msaa" )
+            opt.benchmark_msaa = true;
+        else if( arg == "--post" )
+            opt.post = true;
+        else if( arg == "--depth-prepass" )
+            opt.depth_prepass = true;
+        else if( arg == "--occlusion" )
+            opt.occlusion_culling = true;
+        else if( arg == "--lod" )
+            opt.lod_selection = true;
+        else if( arg == "--hot-reload" )
+            opt.hot_reload = true;
+        else if( arg == "--verbose" )
+            opt.verbose = true;
+        else if( arg == "--instances" )
+            opt.instance_count = static_cast< std::uint32_t >(
+                std::max( 1ul, std::stoul( value() ) ) );
+        else if( arg == "--texture" )
+            opt.texture_file = value();
+        else if( arg == "--texture-budget" )
+            opt.texture_budget_mb = std::stoul( value() );
+        else if( arg == "--color-mode" )
+        {
+            auto const mode = value();
+            if( mode == "vertex" )
+                opt.color = color_mode::vertex;
+            else if( mode == "grayscale" )
+                opt.color = color_mode::grayscale;
+            else if( mode == "inverted" )
+                opt.color = color_mode::inverted;
+            else
+                throw std::runtime_error(
+                    "parse_options: unknown color mode " + mode );
+        }
+        else
+            throw std::runtime_error( "parse_options: unknown option " + arg );
+    }
+    return opt;
+}
+
+// The offline half of the load-time mesh optimisation: reads an OBJ mesh,
+// runs it through mesh::optimize and writes the result back out as OBJ,
+// so imported meshes can ship already in cache and fetch order.
+int run_mesh_optimizer( options const &opt )
+{
+    auto const source = mesh::read_obj( opt.optimize_mesh_input );
+    auto const optimized = mesh::optimize( source.vertices, source.indices );
+    mesh::write_obj(
+        opt.optimize_mesh_output, optimized.vertices, optimized.indices );
+    auto const width =
+        mesh::select_index_width( optimized.vertices.size() );
+    std::cout << "mesh: " << source.vertices.size() << " -> "
+              << optimized.vertices.size() << " vertices, "
+              << optimized.indices.size() / 3u << " triangles ("
+              << ( width == mesh::index_width::u16 ? 16 : 32 )
+              << "-bit indices), ACMR " << optimized.before.acmr << " -> "
+              << optimized.after.acmr << ", ATVR " << optimized.before.atvr
+              << " -> " << optimized.after.atvr << std::endl;
+    return EXIT_SUCCESS;
+}
+
+// Renders the cube offscreen at GOLDEN_ANGLES and compares every frame with
+// <directory>/cube_<n>.ppm, or rewrites those files with --golden-update.
+// Needs no window system, so it also runs on a software ICD such as lavapipe.
+int run_golden_test( options const &opt )
 {
+    std::vector< char const * > extension_names;
+    if( DEBUG_MODE ) extension_names.push_back( "VK_EXT_debug_report" );
+    std::vector< char const * > layer_names;
+    if( DEBUG_MODE )
+        layer_names.push_back( "VK_LAYER_LUNARG_standard_validation" );
+    auto instance =
+        create_instance( extension_names, layer_names, opt.verbose );
+
+    VDeleter< VkDebugReportCallbackEXT > dbg_callback;
+    if( DEBUG_MODE )
+        dbg_callback = create_debug_report( *instance, debug_callback );
+
+    auto devices = instance->enumeratePhysicalDevices();
+    auto device_index = select_best_physical_device_index( devices, true );
+    auto &device = devices[ device_index ];
+    std::cout << "golden: " << device.getProperties().deviceName << std::endl;
+
+    std::size_t failures = 0u;
+    auto const check = [&]( capture::frame const &f ) {
+        auto const filename = opt.golden_directory + "/cube_" +
+            std::to_string( f.number ) + ".ppm";
+        try
+        {
+            if( opt.golden_update )
+            {
+                capture::write_ppm( filename, f );
+                std::cout << "golden: wrote " << filename << std::endl;
+                return;
+            }
+            auto const diff = capture::compare_images(
+                capture::to_image( f ),
+                capture::read_ppm( filename ),
+                opt.golden_tolerance );
+            auto const allowed = static_cast< std::size_t >(
+                f.width * f.height * GOLDEN_MAX_MISMATCH_RATIO );
+            bool const ok =
+                diff.same_size && diff.mismatched_pixels <= allowed;
+            std::cout << "golden: " << filename << ( ok ? " ok" : " FAILED" )
+                      << " (mismatched " << diff.mismatched_pixels
+                      << ", max diff " << diff.max_channel_difference << ")"
+                      << std::endl;
+            if( !ok ) ++failures;
+        }
+        catch( std::exception &e )
+        {
+            std::cerr << "golden: " << filename << ": " << e.what()
+                      << std::endl;
+            ++failures;
+        }
+    };
+
+    // Declared first so it outlives everything created on it, also when an
+    // exception unwinds this function.
+    vk::UniqueDevice ldevice;
+    auto shared = std::make_unique< vulkan_device >( *instance, device );
+    auto window = std::make_unique< vulkan_window >( *shared );
+    window->set_extent( vk::Extent2D( GOLDEN_WIDTH, GOLDEN_HEIGHT ) );
+    window->enable_capture( 1u, check, true );
+    auto queue_family_index = window->select_queue_family();
+    ldevice = create_device( device, queue_family_index, {}, layer_names );
+    shared->set_device( *ldevice );
+    window->set_device();
+    shared->initialize();
     window->initialize_presentation();
-    while( true )
+    for( auto const angle : GOLDEN_ANGLES )
     {
-        if( glfwWindowShouldClose( *window ) ) break;
-        glfwPollEvents();
-        window->present();
+        present_windows(
+            *shared,
+            {window.get()},
+            glm::rotate(
+                glm::mat4(),
+                glm::radians( angle ),
+                glm::vec3( 0.0f, 0.0f, 1.0f ) ) );
+        window->flush_capture();
     }
-    device.waitIdle();
+    ldevice->waitIdle();
+    window.reset();
+    shared.reset();
+
+    return failures == 0u ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Renders BENCHMARK_FRAMES offscreen frames at every sample count the device
+// supports (up to --msaa when given) and reports the GPU-bound frame time.
+int run_msaa_benchmark( options const &opt )
+{
+    std::vector< char const * > extension_names;
+    if( DEBUG_MODE ) extension_names.push_back( "VK_EXT_debug_report" );
+    std::vector< char const * > layer_names;
+    if( DEBUG_MODE )
+        layer_names.push_back( "VK_LAYER_LUNARG_standard_validation" );
+    auto instance =
+        create_instance( extension_names, layer_names, opt.verbose );
+
+    VDeleter< VkDebugReportCallbackEXT > dbg_callback;
+    if( DEBUG_MODE )
+        dbg_callback = create_debug_report( *instance, debug_callback );
+
+    auto devices = instance->enumeratePhysicalDevices();
+    auto device_index = select_best_physical_device_index( devices, true );
+    auto &device = devices[ device_index ];
+    std::cout << "benchmark: " << device.getProperties().deviceName << " "
+              << BENCHMARK_WIDTH << "x" << BENCHMARK_HEIGHT << std::endl;
+
+    auto const max_samples = opt.msaa_samples > 1u ? opt.msaa_samples : 64u;
+    auto const info = device_info::take_snapshot( device );
+    vk::UniqueDevice ldevice;
+    for( std::uint32_t requested = 1u; requested <= max_samples;
+         requested <<= 1u )
+    {
+        auto const samples = select_sample_count( *info, requested );
+        if( static_cast< std::uint32_t >( samples ) != requested ) continue;
+
+        auto shared = std::make_unique< vulkan_device >( *instance, device );
+        shared->set_sample_count( requested );
+        auto window = std::make_unique< vulkan_window >( *shared );
+        window->set_extent( vk::Extent2D( BENCHMARK_WIDTH, BENCHMARK_HEIGHT ) );
+        auto queue_family_index = window->select_queue_family();
+        if( !ldevice )
+        {
+            ldevice =
+                create_device( device, queue_family_index, {}, layer_names );
+        }
+        shared->set_device( *ldevice );
+        window->set_device();
+        shared->initialize();
+        window->initialize_presentation();
+
+        // One untimed frame absorbs first-use costs.
+        present_windows( *shared, {window.get()}, glm::mat4() );
+        shared->wait_idle();
+        auto const start = std::chrono::high_resolution_clock::now();
+        for( std::size_t n = 0u; n < BENCHMARK_FRAMES; ++n )
+        {
+            present_windows(
+                *shared,
+                {window.get()},
+                glm::rotate(
+                    glm::mat4(),
+                    glm::radians( static_cast< float >( n ) ),
+                    glm::vec3( 0.0f, 0.0f, 1.0f ) ) );
+        }
+        shared->wait_idle();
+        auto const end = std::chrono::high_resolution_clock::now();
+        std::cout << "benchmark: " << requested << "x msaa: "
+                  << std::chrono::duration< double, std::milli >( end - start )
+                          .count() /
+                BENCHMARK_FRAMES
+                  << " ms/frame" << std::endl;
+        window.reset();
+        shared.reset();
+    }
+    return EXIT_SUCCESS;
 }
 
-int main() try
+int main( int argc, char **argv ) try
 {
+    startup::profile profile;
+    auto const opt = parse_options( argc, argv );
+    if( !opt.optimize_mesh_input.empty() ) return run_mesh_optimizer( opt );
+    if( !opt.golden_directory.empty() ) return run_golden_test( opt );
+    if( opt.benchmark_msaa ) return run_msaa_benchmark( opt );
+
     glfwInit();
 
     std::uint32_t glfw_extension_count;
@@ -1499,10 +4710,14 @@ int main() try
     for( auto i = 0u; i < glfw_extension_count; ++i )
         extension_names[ i ] = glfw_extension_names[ i ];
     if( DEBUG_MODE ) extension_names.push_back( "VK_EXT_debug_report" );
+    memory::budget_support memory_support;
+    memory_support.enable_instance( extension_names );
     std::vector< char const * > layer_names;
     if( DEBUG_MODE )
         layer_names.push_back( "VK_LAYER_LUNARG_standard_validation" );
-    auto instance = create_instance( extension_names, layer_names );
+    auto instance = profile.measure( "instance", [&] {
+        return create_instance( extension_names, layer_names, opt.verbose );
+    } );
 
     VDeleter< VkDebugReportCallbackEXT > dbg_callback;
     if( DEBUG_MODE )
@@ -1515,18 +4730,107 @@ int main() try
     auto device_index = select_best_physical_device_index( devices );
     auto &device = devices[ device_index ];
 
-    auto window = std::make_unique< vulkan_window >( *instance, device );
-    window->create_window();
-    window->create_surface();
+    // Alternate-frame rendering prefers the other physical devices and wraps
+    // around (a second logical device on the same GPU) when there are too
+    // few, so a single software ICD can exercise the path too.
+    afr_config afr;
+    if( opt.device_count > 1u )
+    {
+        if( opt.window_count > 1u )
+        {
+            throw std::runtime_error(
+                "--devices cannot be combined with --windows" );
+        }
+        if( opt.instance_count > 1u )
+        {
+            throw std::runtime_error(
+                "--devices cannot be combined with --instances" );
+        }
+        if( !opt.texture_file.empty() )
+        {
+            throw std::runtime_error(
+                "--devices cannot be combined with --texture" );
+        }
+        afr.instance = *instance;
+        afr.layer_names = layer_names;
+        std::vector< vk::PhysicalDevice > candidates;
+        for( std::size_t i = 0u; i < devices.size(); ++i )
+        {
+            if( i != device_index ) candidates.push_back( devices[ i ] );
+        }
+        candidates.push_back( device );
+        for( std::size_t i = 0u; i + 1u < opt.device_count; ++i )
+        {
+            afr.devices.push_back( candidates[ i % candidates.size() ] );
+        }
+    }
+
+    auto shared = std::make_unique< vulkan_device >( *instance, device );
+    shared->set_sample_count( opt.msaa_samples );
+    shared->set_instance_count( opt.instance_count );
+    shared->set_scene_texture(
+        opt.texture_file, opt.texture_budget_mb << 20u );
+    std::vector< std::unique_ptr< vulkan_window > > windows;
+    std::set< std::uint32_t > queue_family_index;
+    for( std::size_t i = 0u; i < opt.window_count; ++i )
+    {
+        auto window = std::make_unique< vulkan_window >( *shared );
+        profile.measure( "window", [&] {
+            window->create_window();
+            window->create_surface();
+        } );
+        if( !afr.devices.empty() ) window->enable_composite();
+        if( opt.post ) window->enable_post();
+        if( opt.depth_prepass ) window->enable_depth_prepass();
+        if( opt.occlusion_culling ) window->enable_occlusion_culling();
+        if( opt.lod_selection ) window->enable_lod_selection();
+        window->set_scene_variant( scene_variant( opt.color ) );
+        if( i == 0u && !opt.capture_ppm_prefix.empty() )
+        {
+            window->enable_capture(
+                opt.capture_slots,
+                capture::ppm_sink( opt.capture_ppm_prefix ) );
+        }
+        else if( i == 0u && !opt.capture_raw_file.empty() )
+        {
+            window->enable_capture(
+                opt.capture_slots,
+                capture::raw_sink( opt.capture_raw_file ) );
+        }
+        auto const families = window->select_queue_family();
+        queue_family_index.insert( families.begin(), families.end() );
+        windows.push_back( std::move( window ) );
+    }
 
-    auto queue_family_index = window->select_queue_family();
-    auto ldevice = create_device(
-        device, queue_family_index, device_extension_names, layer_names );
+    timeline::device_support timeline_support;
+    auto const device_next =
+        timeline_support.enable( device, device_extension_names );
+    memory_support.enable( device, device_extension_names );
+    auto ldevice = profile.measure( "device", [&] {
+        return create_device(
+            device,
+            queue_family_index,
+            device_extension_names,
+            layer_names,
+            shared->select_features(),
+            device_next );
+    } );
 
-    window->set_device( *ldevice );
+    shared->set_timeline_semaphores( timeline_support.enabled );
+    shared->set_memory_budget( memory_support.enabled );
+    shared->set_device( *ldevice );
+    for( auto &window : windows )
+        window->set_device();
 
     std::cout << "main_loop start" << std::endl;
-    main_loop( *ldevice, std::move( window ) );
+    main_loop(
+        *ldevice,
+        std::move( shared ),
+        std::move( windows ),
+        afr,
+        opt.hot_reload,
+        profile,
+        opt.verbose );
     std::cout << "main_loop end" << std::endl;
 
     glfwTerminate();
@@ -1534,8 +4838,10 @@ int main() try
 catch( std::exception &e )
 {
     std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
 }
 catch( ... )
 {
     std::cerr << "Error" << std::endl;
+    return EXIT_FAILURE;
 }
@@ -1,3 +1,26 @@
+set -e
+
 CXX="g++"
+GLSLC="glslangValidator"
+# Golden images are rendered with lavapipe so they do not depend on the GPU.
+LAVAPIPE_ICD="${LAVAPIPE_ICD:-/usr/share/vulkan/icd.d/lvp_icd.x86_64.json}"
+
+$GLSLC -V shader.vert -o vert.spv
+$GLSLC -V shader.frag -o frag.spv
+$GLSLC -V post.comp -o post.spv
+$CXX --std=c++1z main.cpp -lglfw -lvulkan -lpthread -g
 
-$CXX --std=c++1z main.cpp -lglfw -lvulkan -g
+# ./make.sh test (or golden) renders the scene on lavapipe and fails unless
+# every frame matches golden/cube_<n>.ppm; ./make.sh golden-update rewrites
+# them. The check is the app's --golden-check mode rather than a separate
+# test binary because it needs the app's own device, pipeline and readback
+# setup, which a second binary would have to duplicate.
+case "$1" in
+test | golden)
+    VK_ICD_FILENAMES="$LAVAPIPE_ICD" ./a.out --golden-check golden
+    ;;
+golden-update)
+    mkdir -p golden
+    VK_ICD_FILENAMES="$LAVAPIPE_ICD" ./a.out --golden-update golden
+    ;;
+esac
@@ -0,0 +1,428 @@
+#pragma once
+
+#include "device_info.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+#include <vulkan/vulkan.hpp>
+
+namespace memory
+{
+
+    // Turns on VK_EXT_memory_budget when the loader and the device have it.
+    // It needs VK_KHR_get_physical_device_properties2 on the instance, so
+    // enable_instance() runs before instance creation and enable() before
+    // device creation.
+    struct budget_support
+    {
+        bool instance_enabled = false;
+        bool enabled = false;
+
+        void enable_instance( std::vector< char const * > &extension_names )
+        {
+#if defined( VK_EXT_memory_budget )
+            auto const name =
+                VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME;
+            for( auto const &e : vk::enumerateInstanceExtensionProperties() )
+            {
+                if( std::string( e.extensionName ) == name )
+                {
+                    extension_names.push_back( name );
+                    instance_enabled = true;
+                    return;
+                }
+            }
+#else
+            (void)extension_names;
+#endif
+        }
+        void enable(
+            vk::PhysicalDevice physical_device,
+            std::vector< char const * > &extension_names )
+        {
+#if defined( VK_EXT_memory_budget )
+            if( !instance_enabled ) return;
+            for( auto const &e :
+                 physical_device.enumerateDeviceExtensionProperties() )
+            {
+                if( std::string( e.extensionName ) ==
+                    VK_EXT_MEMORY_BUDGET_EXTENSION_NAME )
+                {
+                    extension_names.push_back(
+                        VK_EXT_MEMORY_BUDGET_EXTENSION_NAME );
+                    enabled = true;
+                    return;
+                }
+            }
+#else
+            (void)physical_device;
+            (void)extension_names;
+#endif
+        }
+    };
+
+    // Without VK_EXT_memory_budget a heap is assumed to be this share of
+    // its size, leaving room for other processes and the driver.
+    static constexpr vk::DeviceSize FALLBACK_BUDGET_PERCENT = 80u;
+
+    // Device-local memory the host can write directly.
+    static vk::MemoryPropertyFlags const MAPPABLE_DEVICE_LOCAL =
+        vk::MemoryPropertyFlagBits::eDeviceLocal |
+        vk::MemoryPropertyFlagBits::eHostVisible |
+        vk::MemoryPropertyFlagBits::eHostCoherent;
+
+    struct heap_state
+    {
+        vk::DeviceSize size = 0u;
+        // What the process may use: the driver's estimate, or the fallback.
+        vk::DeviceSize budget = 0u;
+        // The driver's view of the process' usage, when it has one.
+        vk::DeviceSize usage = 0u;
+        // Bytes allocated through budget::allocate() and not yet freed.
+        vk::DeviceSize tracked = 0u;
+        bool device_local = false;
+    };
+
+    class budget;
+
+    // Device memory counted against its heap until it is freed.
+    class allocation
+    {
+    private:
+        std::shared_ptr< budget > owner{};
+        vk::UniqueDeviceMemory memory{};
+        std::uint32_t heap = 0u;
+        vk::DeviceSize size = 0u;
+        vk::MemoryPropertyFlags properties{};
+
+    public:
+        allocation( void ) = default;
+        allocation(
+            std::shared_ptr< budget > _owner,
+            vk::UniqueDeviceMemory _memory,
+            std::uint32_t _heap,
+            vk::DeviceSize _size,
+            vk::MemoryPropertyFlags _properties )
+            : owner( std::move( _owner ) )
+            , memory( std::move( _memory ) )
+            , heap( _heap )
+            , size( _size )
+            , properties( _properties )
+        {
+        }
+        allocation( allocation const & ) = delete;
+        allocation &operator=( allocation const & ) = delete;
+        allocation( allocation &&other )
+            : owner( std::move( other.owner ) )
+            , memory( std::move( other.memory ) )
+            , heap( other.heap )
+            , size( other.size )
+            , properties( other.properties )
+        {
+        }
+        allocation &operator=( allocation &&other )
+        {
+            if( this != &other )
+            {
+                reset();
+                owner = std::move( other.owner );
+                memory = std::move( other.memory );
+                heap = other.heap;
+                size = other.size;
+                properties = other.properties;
+            }
+            return *this;
+        }
+        ~allocation( void )
+        {
+            reset();
+        }
+
+        vk::DeviceMemory operator*( void ) const
+        {
+            return *memory;
+        }
+        explicit operator bool( void ) const
+        {
+            return static_cast< bool >( memory );
+        }
+        std::uint32_t get_heap( void ) const
+        {
+            return heap;
+        }
+        vk::DeviceSize get_size( void ) const
+        {
+            return size;
+        }
+        // Of the memory type allocate() settled on.
+        vk::MemoryPropertyFlags get_properties( void ) const
+        {
+            return properties;
+        }
+        bool host_visible( void ) const
+        {
+            return static_cast< bool >(
+                properties & vk::MemoryPropertyFlagBits::eHostVisible );
+        }
+        inline void reset( void );
+    };
+
+    // Per-device view of heap budgets and of what this process allocated
+    // from each heap. allocate() walks the acceptable memory properties in
+    // order of preference and takes the first memory type whose heap still
+    // has room, so device-local memory is used while it lasts and a
+    // resource that may live elsewhere (host memory, say) moves there
+    // instead of running the device heap out of memory. Thread-safe.
+    class budget : public std::enable_shared_from_this< budget >
+    {
+    private:
+        std::shared_ptr< device_info::snapshot const > info{};
+        mutable std::mutex mutex{};
+        std::vector< heap_state > heaps{};
+        bool mappable_device_local = false;
+#if defined( VK_EXT_memory_budget )
+        PFN_vkGetPhysicalDeviceMemoryProperties2KHR get_properties2 = nullptr;
+#endif
+
+    public:
+        // memory_budget: whether VK_EXT_memory_budget is enabled on the
+        // device (see budget_support).
+        budget(
+            std::shared_ptr< device_info::snapshot const > _info,
+            vk::Instance instance,
+            bool memory_budget )
+            : info( std::move( _info ) )
+        {
+            auto const &memory = info->memory;
+            heaps.resize( memory.memoryHeapCount );
+            for( std::uint32_t i = 0u; i < memory.memoryHeapCount; ++i )
+            {
+                heaps[ i ].size = memory.memoryHeaps[ i ].size;
+                heaps[ i ].device_local = static_cast< bool >(
+                    memory.memoryHeaps[ i ].flags &
+                    vk::MemoryHeapFlagBits::eDeviceLocal );
+            }
+            auto const main_heap = get_device_local_heap();
+            for( std::uint32_t i = 0u; i < memory.memoryTypeCount; ++i )
+            {
+                if( memory.memoryTypes[ i ].heapIndex == main_heap &&
+                    ( memory.memoryTypes[ i ].propertyFlags &
+                      MAPPABLE_DEVICE_LOCAL ) == MAPPABLE_DEVICE_LOCAL )
+                    mappable_device_local = true;
+            }
+#if defined( VK_EXT_memory_budget )
+            if( memory_budget )
+            {
+                using get_properties2_t =
+                    PFN_vkGetPhysicalDeviceMemoryProperties2KHR;
+                get_properties2 = reinterpret_cast< get_properties2_t >(
+                    instance.getProcAddr(
+                        "vkGetPhysicalDeviceMemoryProperties2KHR" ) );
+            }
+#else
+            (void)instance;
+            (void)memory_budget;
+#endif
+            refresh();
+        }
+        budget( budget const & ) = delete;
+        budget &operator=( budget const & ) = delete;
+
+        device_info::snapshot const &get_info( void ) const
+        {
+            return *info;
+        }
+        // Whether the main device-local heap can be mapped: resizable BAR,
+        // UMA and software devices. A 256 MiB BAR window on a separate heap
+        // does not count.
+        bool has_mappable_device_local( void ) const
+        {
+            return mappable_device_local;
+        }
+        bool uses_driver_budget( void ) const
+        {
+#if defined( VK_EXT_memory_budget )
+            return get_properties2 != nullptr;
+#else
+            return false;
+#endif
+        }
+
+        // Re-reads the driver's budgets; cheap enough for once per frame.
+        void refresh( void )
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+#if defined( VK_EXT_memory_budget )
+            if( get_properties2 )
+            {
+                VkPhysicalDeviceMemoryBudgetPropertiesEXT budget_properties{};
+                budget_properties.sType =
+                    VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+                VkPhysicalDeviceMemoryProperties2KHR properties{};
+                properties.sType =
+                    VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2_KHR;
+                properties.pNext = &budget_properties;
+                get_properties2(
+                    static_cast< VkPhysicalDevice >( info->physical_device ),
+                    &properties );
+                for( std::size_t i = 0u; i < heaps.size(); ++i )
+                {
+                    heaps[ i ].budget = budget_properties.heapBudget[ i ];
+                    heaps[ i ].usage = budget_properties.heapUsage[ i ];
+                }
+                return;
+            }
+#endif
+            for( auto &h : heaps )
+            {
+                h.budget = h.size / 100u * FALLBACK_BUDGET_PERCENT;
+                h.usage = h.tracked;
+            }
+        }
+
+        std::vector< heap_state > get_heaps( void ) const
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+            return heaps;
+        }
+        // Bytes left in heap's budget; negative once it is exceeded.
+        std::int64_t get_headroom( std::uint32_t heap ) const
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+            return headroom( heaps.at( heap ) );
+        }
+        // The largest device-local heap, where render targets and streamed
+        // textures want to live.
+        std::uint32_t get_device_local_heap( void ) const
+        {
+            std::uint32_t best = 0u;
+            for( std::uint32_t i = 0u; i < heaps.size(); ++i )
+            {
+                if( heaps[ i ].device_local &&
+                    ( !heaps[ best ].device_local ||
+                      heaps[ i ].size > heaps[ best ].size ) )
+                    best = i;
+            }
+            return best;
+        }
+
+        // candidates are acceptable memory properties, most preferred
+        // first. Memory types whose heap has room for requirements.size
+        // are tried first, the rest only if those run out of memory.
+        allocation allocate(
+            vk::Device device,
+            vk::MemoryRequirements const &requirements,
+            std::vector< vk::MemoryPropertyFlags > const &candidates )
+        {
+            auto const order = rank_types( requirements, candidates );
+            if( order.empty() )
+            {
+                throw std::runtime_error(
+                    "budget::allocate: no suitable memory type!" );
+            }
+            for( std::size_t i = 0u; i < order.size(); ++i )
+            {
+                vk::MemoryAllocateInfo memory_allocate_info;
+                memory_allocate_info.allocationSize = requirements.size;
+                memory_allocate_info.memoryTypeIndex = order[ i ];
+                vk::UniqueDeviceMemory memory;
+                try
+                {
+                    memory =
+                        device.allocateMemoryUnique( memory_allocate_info );
+                }
+                catch( std::system_error const &error )
+                {
+                    if( i + 1u == order.size() ||
+                        !is_out_of_memory( error.code() ) )
+                        throw;
+                    continue;
+                }
+                auto const &type = info->memory.memoryTypes[ order[ i ] ];
+                auto const heap = type.heapIndex;
+                {
+                    std::lock_guard< std::mutex > lock( mutex );
+                    heaps[ heap ].tracked += requirements.size;
+                    if( !uses_driver_budget() )
+                        heaps[ heap ].usage = heaps[ heap ].tracked;
+                }
+                return allocation(
+                    shared_from_this(),
+                    std::move( memory ),
+                    heap,
+                    requirements.size,
+                    type.propertyFlags );
+            }
+            throw std::runtime_error( "budget::allocate: error!" );
+        }
+
+    private:
+        friend class allocation;
+
+        void release( std::uint32_t heap, vk::DeviceSize size )
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+            heaps[ heap ].tracked -= std::min( size, heaps[ heap ].tracked );
+            if( !uses_driver_budget() )
+                heaps[ heap ].usage = heaps[ heap ].tracked;
+        }
+        static std::int64_t headroom( heap_state const &h )
+        {
+            return static_cast< std::int64_t >( h.budget ) -
+                static_cast< std::int64_t >( std::max( h.usage, h.tracked ) );
+        }
+        static bool is_out_of_memory( std::error_code const &code )
+        {
+            return std::string( code.category().name() ) == "vk::Result" &&
+                ( vk::Result( code.value() ) ==
+                      vk::Result::eErrorOutOfDeviceMemory ||
+                  vk::Result( code.value() ) ==
+                      vk::Result::eErrorOutOfHostMemory );
+        }
+        // Memory type indices to try: by candidate, types with room first.
+        std::vector< std::uint32_t > rank_types(
+            vk::MemoryRequirements const &requirements,
+            std::vector< vk::MemoryPropertyFlags > const &candidates ) const
+        {
+            auto const &memory = info->memory;
+            std::vector< std::uint32_t > with_room, without_room;
+            std::lock_guard< std::mutex > lock( mutex );
+            for( auto const &properties : candidates )
+            {
+                for( std::uint32_t i = 0u; i < memory.memoryTypeCount; ++i )
+                {
+                    if( !( requirements.memoryTypeBits & ( 1u << i ) ) ||
+                        ( memory.memoryTypes[ i ].propertyFlags &
+                          properties ) != properties ||
+                        std::count( with_room.begin(), with_room.end(), i ) ||
+                        std::count(
+                            without_room.begin(), without_room.end(), i ) )
+                        continue;
+                    auto const &h = heaps[ memory.memoryTypes[ i ].heapIndex ];
+                    if( headroom( h ) >=
+                        static_cast< std::int64_t >( requirements.size ) )
+                        with_room.push_back( i );
+                    else
+                        without_room.push_back( i );
+                }
+            }
+            with_room.insert(
+                with_room.end(), without_room.begin(), without_room.end() );
+            return with_room;
+        }
+    };
+
+    inline void allocation::reset( void )
+    {
+        if( owner ) owner->release( heap, size );
+        memory = vk::UniqueDeviceMemory();
+        owner.reset();
+    }
+
+} // namespace memory
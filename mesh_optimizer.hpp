@@ -0,0 +1,603 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace mesh
+{
+
+    constexpr std::uint32_t INVALID_VERTEX =
+        std::numeric_limits< std::uint32_t >::max();
+
+    struct cache_statistics
+    {
+        std::size_t transformed = 0u;
+        double acmr = 0.0; // transformed vertices per triangle
+        double atvr = 0.0; // transformed vertices per referenced vertex
+    };
+
+    // Simulates a FIFO post-transform cache of cache_size entries.
+    inline cache_statistics analyze_vertex_cache(
+        std::vector< std::uint32_t > const &indices,
+        std::size_t vertex_count,
+        std::size_t cache_size = 16u )
+    {
+        cache_statistics ret;
+        std::vector< std::size_t > timestamp( vertex_count, 0u );
+        std::vector< bool > referenced( vertex_count, false );
+        std::size_t referenced_count = 0u;
+        std::size_t time = cache_size + 1u;
+        for( auto const index : indices )
+        {
+            if( !referenced[ index ] )
+            {
+                referenced[ index ] = true;
+                ++referenced_count;
+            }
+            if( time - timestamp[ index ] > cache_size )
+            {
+                timestamp[ index ] = time++;
+                ++ret.transformed;
+            }
+        }
+        if( !indices.empty() )
+        {
+            ret.acmr = static_cast< double >( ret.transformed ) /
+                ( indices.size() / 3u );
+            ret.atvr =
+                static_cast< double >( ret.transformed ) / referenced_count;
+        }
+        return ret;
+    }
+
+    // Merges bitwise-identical vertices and rewrites indices accordingly.
+    template < typename V >
+    void remove_duplicate_vertices(
+        std::vector< V > &vertices, std::vector< std::uint32_t > &indices )
+    {
+        static_assert(
+            std::is_trivially_copyable< V >::value,
+            "remove_duplicate_vertices: vertex must be trivially copyable" );
+        auto const hash = [&vertices]( std::uint32_t i ) {
+            auto const bytes =
+                reinterpret_cast< unsigned char const * >( &vertices[ i ] );
+            std::size_t h = 14695981039346656037ull;
+            for( std::size_t b = 0u; b < sizeof( V ); ++b )
+            {
+                h = ( h ^ bytes[ b ] ) * 1099511628211ull;
+            }
+            return h;
+        };
+        auto const equal = [&vertices]( std::uint32_t a, std::uint32_t b ) {
+            return std::memcmp( &vertices[ a ], &vertices[ b ], sizeof( V ) ) ==
+                0;
+        };
+        std::unordered_set< std::uint32_t, decltype( hash ), decltype( equal ) >
+            unique( vertices.size(), hash, equal );
+        std::vector< std::uint32_t > remap( vertices.size() );
+        for( std::uint32_t i = 0u; i < vertices.size(); ++i )
+        {
+            remap[ i ] = *unique.insert( i ).first;
+        }
+        for( auto &index : indices )
+            index = remap[ index ];
+    }
+
+    namespace detail
+    {
+        constexpr std::size_t FORSYTH_CACHE_SIZE = 32u;
+
+        inline float forsyth_vertex_score(
+            std::size_t cache_position, std::size_t remaining_triangles )
+        {
+            if( remaining_triangles == 0u ) return -1.0f;
+            float score = 0.0f;
+            if( cache_position < 3u )
+            {
+                score = 0.75f;
+            }
+            else if( cache_position < FORSYTH_CACHE_SIZE )
+            {
+                auto const scaler = 1.0f / ( FORSYTH_CACHE_SIZE - 3u );
+                score = std::pow(
+                    1.0f - ( cache_position - 3u ) * scaler, 1.5f );
+            }
+            return score +
+                2.0f / std::sqrt( static_cast< float >( remaining_triangles ) );
+        }
+    }
+
+    // Reorders triangles for post-transform cache hits (Tom Forsyth's
+    // "Linear-Speed Vertex Cache Optimisation").
+    inline std::vector< std::uint32_t > optimize_vertex_cache(
+        std::vector< std::uint32_t > const &indices, std::size_t vertex_count )
+    {
+        using detail::FORSYTH_CACHE_SIZE;
+        auto const triangle_count = indices.size() / 3u;
+
+        std::vector< std::size_t > remaining( vertex_count, 0u );
+        for( auto const index : indices )
+            ++remaining[ index ];
+        std::vector< std::size_t > adjacency_offset( vertex_count + 1u, 0u );
+        for( std::size_t v = 0u; v < vertex_count; ++v )
+        {
+            adjacency_offset[ v + 1u ] = adjacency_offset[ v ] + remaining[ v ];
+        }
+        std::vector< std::uint32_t > adjacency( indices.size() );
+        {
+            auto fill = adjacency_offset;
+            for( std::size_t i = 0u; i < indices.size(); ++i )
+            {
+                adjacency[ fill[ indices[ i ] ]++ ] =
+                    static_cast< std::uint32_t >( i / 3u );
+            }
+        }
+
+        std::vector< float > vertex_score( vertex_count );
+        for( std::size_t v = 0u; v < vertex_count; ++v )
+        {
+            vertex_score[ v ] = detail::forsyth_vertex_score(
+                FORSYTH_CACHE_SIZE, remaining[ v ] );
+        }
+        std::vector< float > triangle_score( triangle_count );
+        std::vector< bool > emitted( triangle_count, false );
+        for( std::size_t t = 0u; t < triangle_count; ++t )
+        {
+            triangle_score[ t ] = vertex_score[ indices[ t * 3u ] ] +
+                vertex_score[ indices[ t * 3u + 1u ] ] +
+                vertex_score[ indices[ t * 3u + 2u ] ];
+        }
+
+        std::vector< std::uint32_t > ret;
+        ret.reserve( indices.size() );
+        std::vector< std::uint32_t > cache, next_cache;
+        std::size_t scan_cursor = 0u;
+        std::size_t best = triangle_count;
+        while( ret.size() < indices.size() )
+        {
+            if( best == triangle_count )
+            {
+                float best_score = -1.0f;
+                for( std::size_t t = scan_cursor; t < triangle_count; ++t )
+                {
+                    if( !emitted[ t ] && triangle_score[ t ] > best_score )
+                    {
+                        best_score = triangle_score[ t ];
+                        best = t;
+                    }
+                }
+                while( scan_cursor < triangle_count && emitted[ scan_cursor ] )
+                    ++scan_cursor;
+            }
+
+            emitted[ best ] = true;
+            next_cache.clear();
+            for( std::size_t k = 0u; k < 3u; ++k )
+            {
+                auto const v = indices[ best * 3u + k ];
+                ret.push_back( v );
+                next_cache.push_back( v );
+                auto const begin = adjacency.begin() + adjacency_offset[ v ];
+                auto const end = begin + remaining[ v ];
+                auto const triangle = static_cast< std::uint32_t >( best );
+                std::iter_swap( std::find( begin, end, triangle ), end - 1 );
+                --remaining[ v ];
+            }
+            for( auto const v : cache )
+            {
+                if( std::find( next_cache.begin(), next_cache.end(), v ) ==
+                    next_cache.end() )
+                {
+                    next_cache.push_back( v );
+                }
+            }
+            for( std::size_t i = 0u; i < next_cache.size(); ++i )
+            {
+                auto const v = next_cache[ i ];
+                vertex_score[ v ] = detail::forsyth_vertex_score(
+                    std::min( i, FORSYTH_CACHE_SIZE ), remaining[ v ] );
+            }
+
+            best = triangle_count;
+            float best_score = -1.0f;
+            for( auto const v : next_cache )
+            {
+                for( std::size_t a = 0u; a < remaining[ v ]; ++a )
+                {
+                    auto const t = adjacency[ adjacency_offset[ v ] + a ];
+                    triangle_score[ t ] = vertex_score[ indices[ t * 3u ] ] +
+                        vertex_score[ indices[ t * 3u + 1u ] ] +
+                        vertex_score[ indices[ t * 3u + 2u ] ];
+                    if( triangle_score[ t ] > best_score )
+                    {
+                        best_score = triangle_score[ t ];
+                        best = t;
+                    }
+                }
+            }
+            if( next_cache.size() > FORSYTH_CACHE_SIZE )
+            {
+                next_cache.resize( FORSYTH_CACHE_SIZE );
+            }
+            std::swap( cache, next_cache );
+        }
+        return ret;
+    }
+
+    // Renumbers vertices in order of first use and drops unreferenced ones,
+    // so vertex fetch walks memory roughly linearly.
+    template < typename V >
+    void optimize_vertex_fetch(
+        std::vector< V > &vertices, std::vector< std::uint32_t > &indices )
+    {
+        std::vector< std::uint32_t > remap( vertices.size(), INVALID_VERTEX );
+        std::vector< V > reordered;
+        reordered.reserve( vertices.size() );
+        for( auto &index : indices )
+        {
+            if( remap[ index ] == INVALID_VERTEX )
+            {
+                remap[ index ] =
+                    static_cast< std::uint32_t >( reordered.size() );
+                reordered.push_back( vertices[ index ] );
+            }
+            index = remap[ index ];
+        }
+        vertices = std::move( reordered );
+    }
+
+    enum class index_width
+    {
+        u16,
+        u32
+    };
+
+    struct packed_indices
+    {
+        index_width width = index_width::u16;
+        std::size_t count = 0u;
+        std::vector< std::uint8_t > data{};
+    };
+
+    // 16-bit indices whenever every vertex fits below the primitive restart
+    // value 0xffff, 32-bit otherwise.
+    inline index_width select_index_width( std::size_t vertex_count )
+    {
+        return vertex_count < 0xffffu ? index_width::u16 : index_width::u32;
+    }
+    inline std::size_t index_size( index_width width )
+    {
+        return width == index_width::u16 ? sizeof( std::uint16_t )
+                                         : sizeof( std::uint32_t );
+    }
+
+    inline packed_indices pack_indices(
+        std::vector< std::uint32_t > const &indices, index_width width )
+    {
+        packed_indices ret;
+        ret.width = width;
+        ret.count = indices.size();
+        if( width == index_width::u16 )
+        {
+            ret.data.resize( indices.size() * sizeof( std::uint16_t ) );
+            for( std::size_t i = 0u; i < indices.size(); ++i )
+            {
+                if( indices[ i ] >= 0xffffu )
+                {
+                    throw std::runtime_error(
+                        "mesh::pack_indices: index does not fit!" );
+                }
+                auto const index = static_cast< std::uint16_t >( indices[ i ] );
+                std::memcpy(
+                    ret.data.data() + i * sizeof( index ),
+                    &index,
+                    sizeof( index ) );
+            }
+        }
+        else
+        {
+            ret.data.resize( indices.size() * sizeof( std::uint32_t ) );
+            std::memcpy( ret.data.data(), indices.data(), ret.data.size() );
+        }
+        return ret;
+    }
+    inline packed_indices pack_indices(
+        std::vector< std::uint32_t > const &indices, std::size_t vertex_count )
+    {
+        return pack_indices( indices, select_index_width( vertex_count ) );
+    }
+
+    template < typename V >
+    struct optimized_mesh
+    {
+        std::vector< V > vertices{};
+        std::vector< std::uint32_t > indices{};
+        cache_statistics before{}, after{};
+    };
+
+    template < typename V, typename I >
+    optimized_mesh< V > optimize(
+        std::vector< V > vertices,
+        std::vector< I > const &source_indices,
+        std::size_t cache_size = 16u )
+    {
+        if( source_indices.size() % 3u != 0u )
+        {
+            throw std::runtime_error( "mesh::optimize: not a triangle list" );
+        }
+        optimized_mesh< V > ret;
+        ret.indices.assign( source_indices.begin(), source_indices.end() );
+        for( auto const index : ret.indices )
+        {
+            if( index >= vertices.size() )
+            {
+                throw std::runtime_error(
+                    "mesh::optimize: index out of range" );
+            }
+        }
+        ret.before =
+            analyze_vertex_cache( ret.indices, vertices.size(), cache_size );
+        remove_duplicate_vertices( vertices, ret.indices );
+        ret.indices = optimize_vertex_cache( ret.indices, vertices.size() );
+        optimize_vertex_fetch( vertices, ret.indices );
+        ret.vertices = std::move( vertices );
+        ret.after = analyze_vertex_cache(
+            ret.indices, ret.vertices.size(), cache_size );
+        return ret;
+    }
+
+    // One level of detail: a range of a shared index list and the largest
+    // distance, in mesh units, its surface may be off from the full mesh.
+    struct lod_level
+    {
+        std::uint32_t first_index = 0u;
+        std::uint32_t index_count = 0u;
+        float error = 0.0f;
+    };
+
+    // Vertex clustering: snaps positions to a grid with cells per axis
+    // across the mesh bounds and replaces every vertex by the first one of
+    // its cell. Triangles that collapse or turn into duplicates are
+    // dropped. The result indexes the same vertices; position( v ) returns
+    // the std::array< float, 3 > position of vertex v.
+    template < typename V, typename P >
+    std::vector< std::uint32_t > simplify_clustered(
+        std::vector< V > const &vertices,
+        std::vector< std::uint32_t > const &indices,
+        std::uint32_t cells,
+        P const &position )
+    {
+        std::array< float, 3 > lo, hi;
+        lo.fill( std::numeric_limits< float >::max() );
+        hi.fill( std::numeric_limits< float >::lowest() );
+        for( auto const &v : vertices )
+        {
+            auto const p = position( v );
+            for( std::size_t c = 0u; c < 3u; ++c )
+            {
+                lo[ c ] = std::min( lo[ c ], p[ c ] );
+                hi[ c ] = std::max( hi[ c ], p[ c ] );
+            }
+        }
+        std::unordered_map< std::uint64_t, std::uint32_t > representative;
+        std::vector< std::uint32_t > remap( vertices.size() );
+        for( std::uint32_t i = 0u; i < vertices.size(); ++i )
+        {
+            auto const p = position( vertices[ i ] );
+            std::uint64_t key = 0u;
+            for( std::size_t c = 0u; c < 3u; ++c )
+            {
+                auto const extent = hi[ c ] - lo[ c ];
+                auto const cell = extent > 0.0f
+                    ? std::min(
+                          cells - 1u,
+                          static_cast< std::uint32_t >(
+                              ( p[ c ] - lo[ c ] ) / extent * cells ) )
+                    : 0u;
+                key = key << 21u | cell;
+            }
+            remap[ i ] = representative.emplace( key, i ).first->second;
+        }
+
+        std::vector< std::uint32_t > ret;
+        std::unordered_set< std::uint64_t > seen;
+        for( std::size_t t = 0u; t + 2u < indices.size(); t += 3u )
+        {
+            std::array< std::uint32_t, 3 > const v = {
+                {remap[ indices[ t ] ],
+                 remap[ indices[ t + 1u ] ],
+                 remap[ indices[ t + 2u ] ]}};
+            if( v[ 0 ] == v[ 1 ] || v[ 1 ] == v[ 2 ] || v[ 2 ] == v[ 0 ] )
+                continue;
+            // Same triangle, same winding, whichever vertex comes first.
+            auto const first = static_cast< std::size_t >(
+                std::min_element( v.begin(), v.end() ) - v.begin() );
+            std::uint64_t key = 0u;
+            for( std::size_t k = 0u; k < 3u; ++k )
+            {
+                key = key * 1099511628211ull ^ v[ ( first + k ) % 3u ];
+            }
+            if( !seen.insert( key ).second ) continue;
+            ret.insert( ret.end(), v.begin(), v.end() );
+        }
+        return ret;
+    }
+
+    // Appends ever coarser simplifications of indices (level 0) to it,
+    // halving the grid cells until a level saves a quarter of the
+    // triangles of the one before. Every level indexes the same
+    // vertices and is reordered for the vertex cache.
+    template < typename V, typename P >
+    std::vector< lod_level > build_lod_chain(
+        std::vector< V > const &vertices,
+        std::vector< std::uint32_t > &indices,
+        P const &position,
+        std::size_t max_levels = 4u,
+        std::uint32_t first_cells = 64u )
+    {
+        float extent = 0.0f;
+        if( !vertices.empty() )
+        {
+            auto lo = position( vertices.front() ), hi = lo;
+            for( auto const &v : vertices )
+            {
+                auto const p = position( v );
+                for( std::size_t c = 0u; c < 3u; ++c )
+                {
+                    lo[ c ] = std::min( lo[ c ], p[ c ] );
+                    hi[ c ] = std::max( hi[ c ], p[ c ] );
+                }
+            }
+            for( std::size_t c = 0u; c < 3u; ++c )
+                extent = std::max( extent, hi[ c ] - lo[ c ] );
+        }
+
+        std::vector< lod_level > levels( 1u );
+        levels[ 0 ].index_count =
+            static_cast< std::uint32_t >( indices.size() );
+        auto cells = first_cells;
+        while( levels.size() < max_levels && cells > 0u )
+        {
+            auto const &previous = levels.back();
+            std::vector< std::uint32_t > const source(
+                indices.begin() + previous.first_index,
+                indices.begin() + previous.first_index + previous.index_count );
+            auto simplified =
+                simplify_clustered( vertices, source, cells, position );
+            if( simplified.empty() ) break;
+            if( simplified.size() * 4u > source.size() * 3u )
+            {
+                cells /= 2u;
+                continue;
+            }
+            simplified = optimize_vertex_cache( simplified, vertices.size() );
+            lod_level level;
+            level.first_index = static_cast< std::uint32_t >( indices.size() );
+            level.index_count =
+                static_cast< std::uint32_t >( simplified.size() );
+            // A vertex moves at most a cell diagonal onto its representative.
+            level.error = extent / cells * std::sqrt( 3.0f );
+            indices.insert(
+                indices.end(), simplified.begin(), simplified.end() );
+            levels.push_back( level );
+            cells /= 2u;
+        }
+        return levels;
+    }
+
+    // The coarsest of levels whose error stays within max_pixels on screen,
+    // pixels_per_unit being the projected size of one mesh unit. Also the
+    // shape of the per-instance selection a culling shader would run.
+    inline std::size_t select_lod(
+        std::vector< lod_level > const &levels,
+        float pixels_per_unit,
+        float max_pixels = 1.0f )
+    {
+        std::size_t ret = 0u;
+        for( std::size_t i = 1u; i < levels.size(); ++i )
+        {
+            if( levels[ i ].error * pixels_per_unit > max_pixels ) break;
+            ret = i;
+        }
+        return ret;
+    }
+
+    // Positions and faces of a Wavefront OBJ file, the interchange format
+    // of the offline optimiser. Other attributes are not carried over.
+    using obj_vertex = std::array< float, 3 >;
+
+    struct obj_mesh
+    {
+        std::vector< obj_vertex > vertices{};
+        std::vector< std::uint32_t > indices{};
+    };
+
+    // Polygons are split into triangle fans; a/b/c references keep only
+    // the position index, and negative indices count back from the end.
+    inline obj_mesh read_obj( std::string const &filename )
+    {
+        std::ifstream file( filename );
+        if( !file.is_open() )
+        {
+            throw std::runtime_error( "read_obj: failed to open file!" );
+        }
+        obj_mesh ret;
+        std::string line;
+        while( std::getline( file, line ) )
+        {
+            std::istringstream words( line );
+            std::string keyword;
+            words >> keyword;
+            if( keyword == "v" )
+            {
+                obj_vertex v;
+                words >> v[ 0 ] >> v[ 1 ] >> v[ 2 ];
+                if( !words )
+                    throw std::runtime_error( "read_obj: bad vertex!" );
+                ret.vertices.push_back( v );
+            }
+            else if( keyword == "f" )
+            {
+                std::vector< std::uint32_t > face;
+                std::string corner;
+                while( words >> corner )
+                {
+                    auto const n = std::stol( corner );
+                    auto const count =
+                        static_cast< long >( ret.vertices.size() );
+                    auto const index = n < 0 ? count + n : n - 1;
+                    if( index < 0 || index >= count )
+                    {
+                        throw std::runtime_error(
+                            "read_obj: index out of range!" );
+                    }
+                    face.push_back( static_cast< std::uint32_t >( index ) );
+                }
+                if( face.size() < 3u )
+                    throw std::runtime_error( "read_obj: bad face!" );
+                for( std::size_t i = 2u; i < face.size(); ++i )
+                {
+                    ret.indices.push_back( face[ 0 ] );
+                    ret.indices.push_back( face[ i - 1u ] );
+                    ret.indices.push_back( face[ i ] );
+                }
+            }
+        }
+        return ret;
+    }
+
+    inline void write_obj(
+        std::string const &filename,
+        std::vector< obj_vertex > const &vertices,
+        std::vector< std::uint32_t > const &indices )
+    {
+        std::ofstream file( filename, std::ios::trunc );
+        if( !file.is_open() )
+        {
+            throw std::runtime_error( "write_obj: failed to open file!" );
+        }
+        file.precision( std::numeric_limits< float >::max_digits10 );
+        for( auto const &v : vertices )
+            file << "v " << v[ 0 ] << ' ' << v[ 1 ] << ' ' << v[ 2 ] << '\n';
+        for( std::size_t i = 0u; i + 2u < indices.size(); i += 3u )
+        {
+            file << "f " << indices[ i ] + 1u << ' ' << indices[ i + 1u ] + 1u
+                 << ' ' << indices[ i + 2u ] + 1u << '\n';
+        }
+        if( !file )
+            throw std::runtime_error( "write_obj: failed to write file!" );
+    }
+
+} // namespace mesh
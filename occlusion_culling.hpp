@@ -0,0 +1,213 @@
+#pragma once
+
+#include "memory_budget.hpp"
+#include "queue_timeline.hpp"
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include <vulkan/vulkan.hpp>
+
+namespace occlusion
+{
+
+    // Triangle list over the corners of a box, corner i being at the
+    // maximum in x if bit 0 of i is set, in y for bit 1 and in z for bit 2.
+    // Proxies are drawn without culling, so the winding does not matter.
+    constexpr std::array< std::uint16_t, 36 > BOX_INDICES = {
+        {0, 1, 3, 0, 3, 2, 4, 6, 7, 4, 7, 5, 0, 4, 5, 0, 5, 1,
+         2, 3, 7, 2, 7, 6, 0, 2, 6, 0, 6, 4, 1, 5, 7, 1, 7, 3}};
+
+    // Occlusion culling with one frame slot of latency per swapchain image:
+    // each slot has a query pool with one query per object and a
+    // host-visible indirect buffer. The slot's command buffer draws the
+    // objects through the indirect buffer, then every object's bounding
+    // box proxy inside its query. Before the slot runs again, update()
+    // reads the queries of its last run and sets instanceCount to 0 for
+    // objects no sample of whose proxy passed the depth test. Objects
+    // start out visible. A proxy needs the camera outside its box.
+    // Without queries it is just a per-object indirect draw list whose
+    // index ranges the host rewrites per slot, e.g. for LOD selection.
+    class culler
+    {
+    private:
+        struct slot
+        {
+            vk::UniqueQueryPool queries{};
+            memory::allocation draws_memory{};
+            vk::UniqueBuffer draws{};
+            vk::DrawIndexedIndirectCommand *mapped = nullptr;
+            timeline::point done{};
+            bool pending = false;
+        };
+
+        vk::Device device = nullptr;
+        std::uint32_t object_count = 0u;
+        bool queries = true;
+        std::vector< slot > slots{};
+        std::vector< std::uint32_t > results{};
+        std::size_t visible = 0u;
+
+    public:
+        // draw is what every object draws, with firstInstance set to the
+        // object's index.
+        culler(
+            memory::budget &memory_budget,
+            vk::Device _device,
+            std::size_t slot_count,
+            std::uint32_t _object_count,
+            vk::DrawIndexedIndirectCommand const &draw,
+            std::vector< vk::MemoryPropertyFlags > const &memory_candidates,
+            bool _queries = true )
+            : device( _device )
+            , object_count( _object_count )
+            , queries( _queries )
+            , slots( slot_count )
+            , results( _object_count )
+            , visible( _object_count )
+        {
+            if( object_count == 0u )
+                throw std::runtime_error( "culler: no objects!" );
+            vk::QueryPoolCreateInfo query_pool_info;
+            query_pool_info.queryType = vk::QueryType::eOcclusion;
+            query_pool_info.queryCount = object_count;
+            auto const size =
+                sizeof( vk::DrawIndexedIndirectCommand ) * object_count;
+            for( auto &s : slots )
+            {
+                if( queries )
+                    s.queries = device.createQueryPoolUnique( query_pool_info );
+
+                vk::BufferCreateInfo buffer_info;
+                buffer_info.size = size;
+                buffer_info.usage = vk::BufferUsageFlagBits::eIndirectBuffer;
+                buffer_info.sharingMode = vk::SharingMode::eExclusive;
+                s.draws = device.createBufferUnique( buffer_info );
+                s.draws_memory = memory_budget.allocate(
+                    device,
+                    device.getBufferMemoryRequirements( *s.draws ),
+                    memory_candidates );
+                if( !s.draws_memory.host_visible() )
+                {
+                    throw std::runtime_error(
+                        "culler: indirect buffer is not host visible!" );
+                }
+                device.bindBufferMemory( *s.draws, *s.draws_memory, 0u );
+                s.mapped = static_cast< vk::DrawIndexedIndirectCommand * >(
+                    device.mapMemory( *s.draws_memory, 0u, size ) );
+                for( std::uint32_t i = 0u; i < object_count; ++i )
+                {
+                    s.mapped[ i ] = draw;
+                    s.mapped[ i ].firstInstance = i;
+                }
+            }
+        }
+        culler( culler const & ) = delete;
+        culler &operator=( culler const & ) = delete;
+
+        // Host side, before slot i is submitted again. Leaves the slot's
+        // draws alone and returns false while its last run has not
+        // completed; only then may set_indices() touch the slot.
+        bool update( std::size_t i )
+        {
+            auto &s = slots.at( i );
+            if( !s.pending ) return true;
+            if( !s.done.line || s.done.value > s.done.line->get_completed() )
+                return false;
+            s.pending = false;
+            if( !queries ) return true;
+            auto const result = device.getQueryPoolResults< std::uint32_t >(
+                *s.queries,
+                0u,
+                object_count,
+                results,
+                sizeof( std::uint32_t ),
+                vk::QueryResultFlags() );
+            if( result != vk::Result::eSuccess ) return true;
+            visible = 0u;
+            for( std::uint32_t o = 0u; o < object_count; ++o )
+            {
+                s.mapped[ o ].instanceCount = results[ o ] != 0u ? 1u : 0u;
+                visible += s.mapped[ o ].instanceCount;
+            }
+            return true;
+        }
+        // Points object's draw in slot i at another index range.
+        void set_indices(
+            std::size_t i,
+            std::uint32_t object,
+            std::uint32_t first_index,
+            std::uint32_t index_count )
+        {
+            auto &draw = slots.at( i ).mapped[ object ];
+            draw.firstIndex = first_index;
+            draw.indexCount = index_count;
+        }
+        // The submission that ran slot i's command buffer.
+        void set_done( std::size_t i, timeline::point done )
+        {
+            slots.at( i ).done = done;
+            slots.at( i ).pending = true;
+        }
+        // Objects drawn by the slot update() last read back.
+        std::size_t get_visible( void ) const
+        {
+            return visible;
+        }
+        std::uint32_t get_object_count( void ) const
+        {
+            return object_count;
+        }
+
+        // Outside the render pass, before record_draws().
+        void record_reset( vk::CommandBuffer command_buffer, std::size_t i )
+        {
+            if( !queries ) return;
+            command_buffer.resetQueryPool(
+                *slots.at( i ).queries, 0u, object_count );
+        }
+        // Draws the objects of slot i with the bound pipeline and buffers.
+        // Without multi_draw_indirect every object is its own indirect
+        // draw.
+        void record_draws(
+            vk::CommandBuffer command_buffer,
+            std::size_t i,
+            bool multi_draw_indirect ) const
+        {
+            auto const stride = static_cast< std::uint32_t >(
+                sizeof( vk::DrawIndexedIndirectCommand ) );
+            auto const buffer = *slots.at( i ).draws;
+            if( multi_draw_indirect )
+            {
+                command_buffer.drawIndexedIndirect(
+                    buffer, 0u, object_count, stride );
+                return;
+            }
+            for( std::uint32_t o = 0u; o < object_count; ++o )
+            {
+                command_buffer.drawIndexedIndirect(
+                    buffer, vk::DeviceSize( o ) * stride, 1u, stride );
+            }
+        }
+        // Wraps draw_proxy( object ) for every object in its query; call
+        // after the occluders are drawn, with the proxy pipeline bound.
+        template < typename F >
+        void record_queries(
+            vk::CommandBuffer command_buffer,
+            std::size_t i,
+            F const &draw_proxy ) const
+        {
+            if( !queries ) return;
+            auto const pool = *slots.at( i ).queries;
+            for( std::uint32_t o = 0u; o < object_count; ++o )
+            {
+                command_buffer.beginQuery(
+                    pool, o, vk::QueryControlFlags() );
+                draw_proxy( o );
+                command_buffer.endQuery( pool, o );
+            }
+        }
+    };
+
+} // namespace occlusion
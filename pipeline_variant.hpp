@@ -0,0 +1,99 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vulkan/vulkan.hpp>
+
+namespace variant
+{
+
+    // The specialization constants of one pipeline variant: constant_id i
+    // takes values[ i ] for i < count. Every constant is 32 bits wide (a
+    // uint, int, bool or the bits of a float), so variants can be spelled
+    // as constexpr values next to the shaders that read them.
+    struct constants
+    {
+        static constexpr std::uint32_t MAX_CONSTANTS = 8u;
+
+        std::array< std::uint32_t, MAX_CONSTANTS > values{};
+        std::uint32_t count = 0u;
+
+        constexpr constants set( std::uint32_t id, std::uint32_t value ) const
+        {
+            if( id >= MAX_CONSTANTS )
+            {
+                throw std::out_of_range( "constants::set: id out of range" );
+            }
+            constants ret = *this;
+            ret.values[ id ] = value;
+            if( id >= ret.count ) ret.count = id + 1u;
+            return ret;
+        }
+
+        // FNV-1a over the used constants.
+        constexpr std::uint64_t hash( void ) const
+        {
+            std::uint64_t h = 14695981039346656037ull;
+            h = ( h ^ count ) * 1099511628211ull;
+            for( std::uint32_t i = 0u; i < count; ++i )
+            {
+                h = ( h ^ values[ i ] ) * 1099511628211ull;
+            }
+            return h;
+        }
+
+        constexpr bool operator==( constants const &other ) const
+        {
+            if( count != other.count ) return false;
+            for( std::uint32_t i = 0u; i < count; ++i )
+            {
+                if( values[ i ] != other.values[ i ] ) return false;
+            }
+            return true;
+        }
+        constexpr bool operator!=( constants const &other ) const
+        {
+            return !( *this == other );
+        }
+    };
+
+    struct constants_hash
+    {
+        std::size_t operator()( constants const &c ) const
+        {
+            return static_cast< std::size_t >( c.hash() );
+        }
+    };
+
+    inline std::uint32_t float_bits( float value )
+    {
+        std::uint32_t ret;
+        std::memcpy( &ret, &value, sizeof( ret ) );
+        return ret;
+    }
+
+    // A VkSpecializationInfo for c, pointing into c and entries; both must
+    // outlive the pipeline creation.
+    inline vk::SpecializationInfo make_specialization_info(
+        constants const &c,
+        std::array< vk::SpecializationMapEntry, constants::MAX_CONSTANTS >
+            &entries )
+    {
+        for( std::uint32_t i = 0u; i < c.count; ++i )
+        {
+            entries[ i ].constantID = i;
+            entries[ i ].offset =
+                static_cast< std::uint32_t >( i * sizeof( std::uint32_t ) );
+            entries[ i ].size = sizeof( std::uint32_t );
+        }
+        vk::SpecializationInfo ret;
+        ret.mapEntryCount = c.count;
+        ret.pMapEntries = entries.data();
+        ret.dataSize = c.count * sizeof( std::uint32_t );
+        ret.pData = c.values.data();
+        return ret;
+    }
+
+} // namespace variant
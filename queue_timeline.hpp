@@ -0,0 +1,321 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <vulkan/vulkan.hpp>
+
+namespace timeline
+{
+
+    // Turns on VK_KHR_timeline_semaphore for device creation when both the
+    // Vulkan headers and the physical device know it.
+    struct device_support
+    {
+        bool enabled = false;
+#if defined( VK_KHR_timeline_semaphore )
+        VkPhysicalDeviceTimelineSemaphoreFeaturesKHR features{};
+#endif
+
+        // Adds the extension to extension_names and returns what
+        // VkDeviceCreateInfo::pNext has to point at, or nullptr.
+        void const *enable(
+            vk::PhysicalDevice physical_device,
+            std::vector< char const * > &extension_names )
+        {
+#if defined( VK_KHR_timeline_semaphore )
+            for( auto const &e :
+                 physical_device.enumerateDeviceExtensionProperties() )
+            {
+                if( std::string( e.extensionName ) !=
+                    VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME )
+                {
+                    continue;
+                }
+                extension_names.push_back(
+                    VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME );
+                features.sType =
+                    VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR;
+                features.timelineSemaphore = VK_TRUE;
+                enabled = true;
+                return &features;
+            }
+#else
+            (void)physical_device;
+            (void)extension_names;
+#endif
+            return nullptr;
+        }
+    };
+
+    // Every submission to one queue gets the next value of a monotonic
+    // counter, and CPU waits name the value they need ("wait until N")
+    // instead of idling the queue or the device. Backed by a timeline
+    // semaphore when the device has them and by a pool of fences
+    // otherwise. Thread-safe, so e.g. a capture thread can wait on values
+    // the render thread submits.
+    class queue_timeline
+    {
+    private:
+        using shared_fence = std::shared_ptr< vk::UniqueFence >;
+
+        vk::Device device = nullptr;
+        vk::Queue queue = nullptr;
+        mutable std::mutex mutex{};
+        std::uint64_t submitted = 0u, completed = 0u;
+        // Fence backend: one fence per submission still in flight, oldest
+        // first. A fence goes back to the pool once no waiter holds it.
+        std::deque< std::pair< std::uint64_t, shared_fence > > pending{};
+        std::vector< shared_fence > free_fences{};
+#if defined( VK_KHR_timeline_semaphore )
+        vk::UniqueSemaphore semaphore{};
+        PFN_vkGetSemaphoreCounterValueKHR get_counter_value = nullptr;
+        PFN_vkWaitSemaphoresKHR wait_semaphores = nullptr;
+#endif
+
+    public:
+        queue_timeline(
+            vk::Device _device, vk::Queue _queue, bool timeline_semaphore )
+            : device( _device )
+            , queue( _queue )
+        {
+#if defined( VK_KHR_timeline_semaphore )
+            if( timeline_semaphore )
+            {
+                get_counter_value =
+                    reinterpret_cast< PFN_vkGetSemaphoreCounterValueKHR >(
+                        device.getProcAddr(
+                            "vkGetSemaphoreCounterValueKHR" ) );
+                wait_semaphores = reinterpret_cast< PFN_vkWaitSemaphoresKHR >(
+                    device.getProcAddr( "vkWaitSemaphoresKHR" ) );
+                if( !get_counter_value || !wait_semaphores )
+                {
+                    throw std::runtime_error(
+                        "queue_timeline: timeline semaphores unavailable!" );
+                }
+                VkSemaphoreTypeCreateInfoKHR type_info{};
+                type_info.sType =
+                    VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR;
+                type_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE_KHR;
+                type_info.initialValue = 0u;
+                vk::SemaphoreCreateInfo semaphore_info;
+                semaphore_info.pNext = &type_info;
+                semaphore = device.createSemaphoreUnique( semaphore_info );
+            }
+#else
+            (void)timeline_semaphore;
+#endif
+        }
+        queue_timeline( queue_timeline const & ) = delete;
+        queue_timeline( queue_timeline && ) = delete;
+        queue_timeline &operator=( queue_timeline const & ) = delete;
+        queue_timeline &operator=( queue_timeline && ) = delete;
+        ~queue_timeline( void ) = default;
+
+        vk::Queue get_queue( void ) const
+        {
+            return queue;
+        }
+        bool uses_semaphore( void ) const
+        {
+#if defined( VK_KHR_timeline_semaphore )
+            return static_cast< bool >( semaphore );
+#else
+            return false;
+#endif
+        }
+
+        // Submits infos as one batch and returns its value. The value is
+        // signalled once the whole batch has completed.
+        std::uint64_t submit( std::vector< vk::SubmitInfo > infos )
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+            auto const value = submitted + 1u;
+#if defined( VK_KHR_timeline_semaphore )
+            if( semaphore )
+            {
+                submit_semaphore( infos, value );
+                submitted = value;
+                return value;
+            }
+#endif
+            shared_fence fence;
+            if( free_fences.empty() )
+            {
+                fence = std::make_shared< vk::UniqueFence >(
+                    device.createFenceUnique( vk::FenceCreateInfo() ) );
+            }
+            else
+            {
+                fence = std::move( free_fences.back() );
+                free_fences.pop_back();
+                device.resetFences( **fence );
+            }
+            queue.submit( infos, **fence );
+            pending.emplace_back( value, std::move( fence ) );
+            submitted = value;
+            return value;
+        }
+        std::uint64_t get_submitted( void ) const
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+            return submitted;
+        }
+        // Polls without blocking.
+        std::uint64_t get_completed( void )
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+            return poll();
+        }
+
+        // Blocks until value has completed; values never submitted count
+        // as completed.
+        void wait( std::uint64_t value )
+        {
+            std::unique_lock< std::mutex > lock( mutex );
+            value = std::min( value, submitted );
+            if( value <= poll() ) return;
+#if defined( VK_KHR_timeline_semaphore )
+            if( semaphore )
+            {
+                lock.unlock();
+                auto const handle = static_cast< VkSemaphore >( *semaphore );
+                VkSemaphoreWaitInfoKHR wait_info{};
+                wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR;
+                wait_info.semaphoreCount = 1u;
+                wait_info.pSemaphores = &handle;
+                wait_info.pValues = &value;
+                check( wait_semaphores(
+                    static_cast< VkDevice >( device ),
+                    &wait_info,
+                    std::numeric_limits< std::uint64_t >::max() ) );
+                return;
+            }
+#endif
+            // Fences on one queue signal in submission order, so the
+            // first one at or past value covers everything before it.
+            auto const it = std::find_if(
+                pending.begin(),
+                pending.end(),
+                [value]( std::pair< std::uint64_t, shared_fence > const &p ) {
+                    return p.first >= value;
+                } );
+            auto const fence = it->second;
+            lock.unlock();
+            device.waitForFences(
+                **fence, VK_TRUE, std::numeric_limits< std::uint64_t >::max() );
+        }
+        void wait_idle( void )
+        {
+            wait( get_submitted() );
+        }
+
+    private:
+        // Caller holds mutex.
+        std::uint64_t poll( void )
+        {
+#if defined( VK_KHR_timeline_semaphore )
+            if( semaphore )
+            {
+                std::uint64_t value = 0u;
+                check( get_counter_value(
+                    static_cast< VkDevice >( device ),
+                    static_cast< VkSemaphore >( *semaphore ),
+                    &value ) );
+                completed = std::max( completed, value );
+                return completed;
+            }
+#endif
+            while( !pending.empty() &&
+                   device.getFenceStatus( **pending.front().second ) ==
+                       vk::Result::eSuccess )
+            {
+                completed = pending.front().first;
+                auto &fence = pending.front().second;
+                if( fence.use_count() == 1 )
+                    free_fences.push_back( std::move( fence ) );
+                pending.pop_front();
+            }
+            return completed;
+        }
+
+#if defined( VK_KHR_timeline_semaphore )
+        // Adds the signal of value to the last batch. Binary semaphores
+        // in the same batches get placeholder values, as required once a
+        // VkTimelineSemaphoreSubmitInfo is chained.
+        void submit_semaphore(
+            std::vector< vk::SubmitInfo > &infos, std::uint64_t value )
+        {
+            if( infos.empty() ) infos.emplace_back();
+            std::vector< VkTimelineSemaphoreSubmitInfoKHR > timeline_infos(
+                infos.size() );
+            std::vector< std::vector< std::uint64_t > > wait_values(
+                infos.size() ),
+                signal_values( infos.size() );
+            std::vector< std::vector< vk::Semaphore > > signals(
+                infos.size() );
+            for( std::size_t i = 0u; i < infos.size(); ++i )
+            {
+                auto &info = infos[ i ];
+                signals[ i ].assign(
+                    info.pSignalSemaphores,
+                    info.pSignalSemaphores + info.signalSemaphoreCount );
+                wait_values[ i ].assign( info.waitSemaphoreCount, 0u );
+                signal_values[ i ].assign( signals[ i ].size(), 0u );
+                if( i + 1u == infos.size() )
+                {
+                    signals[ i ].push_back( *semaphore );
+                    signal_values[ i ].push_back( value );
+                }
+                auto &t = timeline_infos[ i ];
+                t.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR;
+                t.pNext = info.pNext;
+                t.waitSemaphoreValueCount =
+                    static_cast< std::uint32_t >( wait_values[ i ].size() );
+                t.pWaitSemaphoreValues = wait_values[ i ].data();
+                t.signalSemaphoreValueCount =
+                    static_cast< std::uint32_t >( signal_values[ i ].size() );
+                t.pSignalSemaphoreValues = signal_values[ i ].data();
+                info.pNext = &t;
+                info.signalSemaphoreCount =
+                    static_cast< std::uint32_t >( signals[ i ].size() );
+                info.pSignalSemaphores = signals[ i ].data();
+            }
+            queue.submit( infos, nullptr );
+        }
+        static void check( VkResult result )
+        {
+            if( result != VK_SUCCESS )
+            {
+                throw std::runtime_error( "queue_timeline: wait failed!" );
+            }
+        }
+#endif
+    };
+
+    // A value on a particular timeline, e.g. when an image or a readback
+    // buffer is free again.
+    struct point
+    {
+        queue_timeline *line = nullptr;
+        std::uint64_t value = 0u;
+
+        void wait( void ) const
+        {
+            if( line ) line->wait( value );
+        }
+        // Polls without blocking.
+        bool is_complete( void ) const
+        {
+            return !line || value <= line->get_completed();
+        }
+    };
+
+} // namespace timeline
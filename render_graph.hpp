@@ -0,0 +1,709 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <vulkan/vulkan.hpp>
+
+namespace graph
+{
+
+    // How a pass touches a resource. Every usage maps to exactly one
+    // stage/access/layout triple, which is all barrier derivation needs.
+    enum class usage
+    {
+        undefined,
+        host_write,
+        host_read,
+        transfer_src,
+        transfer_dst,
+        color_attachment,
+        depth_attachment,
+        shader_read,
+        compute_read,
+        compute_write,
+        present
+    };
+
+    struct access_info
+    {
+        vk::PipelineStageFlags stages{};
+        vk::AccessFlags access{};
+        vk::ImageLayout layout = vk::ImageLayout::eUndefined;
+        bool write = false;
+    };
+
+    inline access_info get_access_info( usage u )
+    {
+        using stage = vk::PipelineStageFlagBits;
+        using access = vk::AccessFlagBits;
+        using layout = vk::ImageLayout;
+        switch( u )
+        {
+        case usage::undefined:
+            return {{}, {}, layout::eUndefined, false};
+        case usage::host_write:
+            return {stage::eHost, access::eHostWrite, layout::eGeneral, true};
+        case usage::host_read:
+            return {stage::eHost, access::eHostRead, layout::eGeneral, false};
+        case usage::transfer_src:
+            return {stage::eTransfer,
+                    access::eTransferRead,
+                    layout::eTransferSrcOptimal,
+                    false};
+        case usage::transfer_dst:
+            return {stage::eTransfer,
+                    access::eTransferWrite,
+                    layout::eTransferDstOptimal,
+                    true};
+        case usage::color_attachment:
+            return {stage::eColorAttachmentOutput,
+                    access::eColorAttachmentRead |
+                        access::eColorAttachmentWrite,
+                    layout::eColorAttachmentOptimal,
+                    true};
+        case usage::depth_attachment:
+            return {stage::eEarlyFragmentTests | stage::eLateFragmentTests,
+                    access::eDepthStencilAttachmentRead |
+                        access::eDepthStencilAttachmentWrite,
+                    layout::eDepthStencilAttachmentOptimal,
+                    true};
+        case usage::shader_read:
+            return {stage::eFragmentShader,
+                    access::eShaderRead,
+                    layout::eShaderReadOnlyOptimal,
+                    false};
+        case usage::compute_read:
+            return {stage::eComputeShader,
+                    access::eShaderRead,
+                    layout::eShaderReadOnlyOptimal,
+                    false};
+        case usage::compute_write:
+            return {stage::eComputeShader,
+                    access::eShaderWrite,
+                    layout::eGeneral,
+                    true};
+        case usage::present:
+            return {stage::eBottomOfPipe, {}, layout::ePresentSrcKHR, false};
+        }
+        throw std::runtime_error( "graph::get_access_info: unknown usage!" );
+    }
+
+    // Stage/access implied by an image layout, for one-off transitions
+    // outside a graph. Layouts without a usage of their own get a full
+    // (slow but correct) dependency instead of an error.
+    inline access_info get_layout_access_info( vk::ImageLayout layout )
+    {
+        switch( layout )
+        {
+        case vk::ImageLayout::eUndefined:
+            return get_access_info( usage::undefined );
+        case vk::ImageLayout::eTransferSrcOptimal:
+            return get_access_info( usage::transfer_src );
+        case vk::ImageLayout::eTransferDstOptimal:
+            return get_access_info( usage::transfer_dst );
+        case vk::ImageLayout::eColorAttachmentOptimal:
+            return get_access_info( usage::color_attachment );
+        case vk::ImageLayout::eDepthStencilAttachmentOptimal:
+            return get_access_info( usage::depth_attachment );
+        case vk::ImageLayout::eShaderReadOnlyOptimal:
+            return get_access_info( usage::shader_read );
+        case vk::ImageLayout::ePresentSrcKHR:
+            return get_access_info( usage::present );
+        default:
+            return {vk::PipelineStageFlagBits::eAllCommands,
+                    vk::AccessFlagBits::eMemoryRead |
+                        vk::AccessFlagBits::eMemoryWrite,
+                    layout,
+                    true};
+        }
+    }
+
+    using resource_id = std::size_t;
+    constexpr resource_id INVALID_RESOURCE =
+        std::numeric_limits< resource_id >::max();
+
+    struct image_desc
+    {
+        vk::Format format = vk::Format::eUndefined;
+        vk::Extent2D extent{};
+        vk::ImageUsageFlags usage{};
+        vk::ImageAspectFlags aspect{};
+        vk::SampleCountFlagBits samples = vk::SampleCountFlagBits::e1;
+    };
+
+    // A frame described as passes that declare what they read and write.
+    // compile() culls passes whose results nobody consumes, places
+    // transient images with disjoint lifetimes in the same memory and
+    // derives one batched pipelineBarrier per pass from the declared
+    // usages; execute() replays that plan into a command buffer. Imported
+    // resources (swapchain images, readback buffers...) are rebound with
+    // bind_image()/bind_buffer() before each execute().
+    class render_graph
+    {
+    private:
+        struct resource
+        {
+            std::string name{};
+            bool image = true;
+            bool transient = false;
+            vk::ImageAspectFlags aspect{};
+            usage initial = usage::undefined, final = usage::undefined;
+            vk::PipelineStageFlags wait_stages{};
+            image_desc desc{};
+            vk::Image bound_image = nullptr;
+            vk::Buffer bound_buffer = nullptr;
+            vk::UniqueImage owned_image{};
+            vk::UniqueImageView owned_view{};
+            resource_id alias_previous = INVALID_RESOURCE;
+        };
+        struct access
+        {
+            resource_id resource;
+            usage use;
+        };
+        struct pass
+        {
+            std::string name{};
+            std::vector< access > accesses{};
+            std::function< void( vk::CommandBuffer ) > record{};
+            bool side_effect = false;
+        };
+        struct barrier
+        {
+            resource_id resource;
+            vk::AccessFlags src_access, dst_access;
+            vk::ImageLayout old_layout, new_layout;
+        };
+        struct barrier_batch
+        {
+            vk::PipelineStageFlags src_stages{}, dst_stages{};
+            std::vector< barrier > barriers{};
+        };
+        struct step
+        {
+            std::size_t pass;
+            barrier_batch before{};
+        };
+        struct resource_state
+        {
+            vk::PipelineStageFlags write_stages{}, read_stages{},
+                visible_stages{};
+            vk::AccessFlags write_access{}, visible_access{};
+            vk::ImageLayout layout = vk::ImageLayout::eUndefined;
+            bool started = false;
+        };
+
+        // Declared first so aliased images are destroyed before their memory.
+        std::vector< vk::UniqueDeviceMemory > memory_blocks{};
+        std::vector< resource > resources{};
+        std::vector< pass > passes{};
+        std::vector< step > steps{};
+        barrier_batch final_barriers{};
+        vk::DeviceSize transient_memory = 0u;
+        bool compiled = false;
+
+    public:
+        class pass_builder
+        {
+        private:
+            render_graph *graph;
+            std::size_t index;
+
+        public:
+            pass_builder( render_graph *_graph, std::size_t _index )
+                : graph( _graph )
+                , index( _index )
+            {
+            }
+            pass_builder &read( resource_id id, usage use )
+            {
+                graph->passes[ index ].accesses.push_back( {id, use} );
+                return *this;
+            }
+            pass_builder &write( resource_id id, usage use )
+            {
+                if( !get_access_info( use ).write )
+                {
+                    throw std::runtime_error(
+                        "render_graph::write: usage does not write!" );
+                }
+                graph->passes[ index ].accesses.push_back( {id, use} );
+                return *this;
+            }
+            // Keeps the pass alive even if nothing reads its results.
+            pass_builder &side_effect( void )
+            {
+                graph->passes[ index ].side_effect = true;
+                return *this;
+            }
+        };
+
+        // wait_stages are the stages a submit waits on before the image is
+        // available (swapchain acquire), so the first transition chains
+        // with the semaphore wait instead of racing it.
+        resource_id import_image(
+            std::string name,
+            vk::ImageAspectFlags aspect,
+            usage initial,
+            usage final,
+            vk::PipelineStageFlags wait_stages = {} )
+        {
+            resource r;
+            r.name = std::move( name );
+            r.aspect = aspect;
+            r.initial = initial;
+            r.final = final;
+            r.wait_stages = wait_stages;
+            return add_resource( std::move( r ) );
+        }
+        resource_id
+        import_buffer( std::string name, usage initial, usage final )
+        {
+            resource r;
+            r.name = std::move( name );
+            r.image = false;
+            r.initial = initial;
+            r.final = final;
+            return add_resource( std::move( r ) );
+        }
+        // Owned by the graph, created in compile() and discarded (undefined
+        // contents) at the start of every execute().
+        resource_id create_image( std::string name, image_desc const &desc )
+        {
+            resource r;
+            r.name = std::move( name );
+            r.transient = true;
+            r.aspect = desc.aspect;
+            r.desc = desc;
+            return add_resource( std::move( r ) );
+        }
+        void bind_image( resource_id id, vk::Image image )
+        {
+            resources.at( id ).bound_image = image;
+        }
+        void bind_buffer( resource_id id, vk::Buffer buffer )
+        {
+            resources.at( id ).bound_buffer = buffer;
+        }
+        vk::Image get_image( resource_id id ) const
+        {
+            auto const &r = resources.at( id );
+            return r.owned_image ? *r.owned_image : r.bound_image;
+        }
+        vk::Buffer get_buffer( resource_id id ) const
+        {
+            return resources.at( id ).bound_buffer;
+        }
+        vk::ImageView get_image_view( resource_id id ) const
+        {
+            return *resources.at( id ).owned_view;
+        }
+
+        pass_builder add_pass(
+            std::string name,
+            std::function< void( vk::CommandBuffer ) > record )
+        {
+            if( compiled )
+            {
+                throw std::runtime_error(
+                    "render_graph::add_pass: already compiled!" );
+            }
+            pass p;
+            p.name = std::move( name );
+            p.record = std::move( record );
+            passes.push_back( std::move( p ) );
+            return pass_builder( this, passes.size() - 1u );
+        }
+
+        // memory_properties are the device's, passed in so recompiling on
+        // resize does not query them again.
+        void compile(
+            vk::PhysicalDeviceMemoryProperties const &memory_properties,
+            vk::Device device )
+        {
+            if( compiled )
+            {
+                throw std::runtime_error(
+                    "render_graph::compile: already compiled!" );
+            }
+            cull();
+            allocate_transients( memory_properties, device );
+            derive_barriers();
+            compiled = true;
+        }
+
+        void execute( vk::CommandBuffer command_buffer ) const
+        {
+            if( !compiled )
+            {
+                throw std::runtime_error(
+                    "render_graph::execute: not compiled!" );
+            }
+            for( auto const &s : steps )
+            {
+                emit( command_buffer, s.before );
+                passes[ s.pass ].record( command_buffer );
+            }
+            emit( command_buffer, final_barriers );
+        }
+
+        std::size_t live_pass_count( void ) const
+        {
+            return steps.size();
+        }
+        std::size_t barrier_count( void ) const
+        {
+            std::size_t ret = final_barriers.barriers.size();
+            for( auto const &s : steps )
+                ret += s.before.barriers.size();
+            return ret;
+        }
+        vk::DeviceSize transient_memory_size( void ) const
+        {
+            return transient_memory;
+        }
+
+    private:
+        resource_id add_resource( resource r )
+        {
+            if( compiled )
+            {
+                throw std::runtime_error(
+                    "render_graph::add_resource: already compiled!" );
+            }
+            resources.push_back( std::move( r ) );
+            return resources.size() - 1u;
+        }
+
+        // Walks the passes backwards from the imported resources: a pass
+        // survives when it writes something that is still needed, and then
+        // everything it reads becomes needed.
+        void cull( void )
+        {
+            std::vector< bool > needed( resources.size(), false );
+            for( std::size_t i = 0u; i < resources.size(); ++i )
+                needed[ i ] = !resources[ i ].transient;
+            std::vector< std::size_t > live;
+            for( std::size_t p = passes.size(); p-- > 0u; )
+            {
+                bool alive = passes[ p ].side_effect;
+                for( auto const &a : passes[ p ].accesses )
+                {
+                    alive = alive ||
+                        ( get_access_info( a.use ).write &&
+                          needed[ a.resource ] );
+                }
+                if( !alive ) continue;
+                live.push_back( p );
+                for( auto const &a : passes[ p ].accesses )
+                    needed[ a.resource ] = true;
+            }
+            std::reverse( live.begin(), live.end() );
+            steps.clear();
+            for( auto const p : live )
+            {
+                step s;
+                s.pass = p;
+                steps.push_back( std::move( s ) );
+            }
+        }
+
+        // Transient images whose live ranges do not overlap share one
+        // allocation; the first use of a reused block waits on the stages
+        // of the image that used it before.
+        void allocate_transients(
+            vk::PhysicalDeviceMemoryProperties const &memory_properties,
+            vk::Device device )
+        {
+            constexpr auto npos = std::numeric_limits< std::size_t >::max();
+            std::vector< std::size_t > first( resources.size(), npos ),
+                last( resources.size(), npos );
+            for( std::size_t i = 0u; i < steps.size(); ++i )
+            {
+                for( auto const &a : passes[ steps[ i ].pass ].accesses )
+                {
+                    if( first[ a.resource ] == npos ) first[ a.resource ] = i;
+                    last[ a.resource ] = i;
+                }
+            }
+            std::vector< resource_id > order;
+            for( resource_id id = 0u; id < resources.size(); ++id )
+            {
+                if( resources[ id ].transient && first[ id ] != npos )
+                    order.push_back( id );
+            }
+            std::sort(
+                order.begin(), order.end(), [&first]( auto a, auto b ) {
+                    return first[ a ] < first[ b ];
+                } );
+
+            struct block
+            {
+                vk::DeviceSize size = 0u;
+                std::uint32_t type_bits = ~0u;
+                std::size_t last_use = 0u;
+                resource_id last_resource = INVALID_RESOURCE;
+            };
+            std::vector< block > blocks;
+            std::vector< std::size_t > placement( resources.size(), npos );
+            for( auto const id : order )
+            {
+                auto &r = resources[ id ];
+                vk::ImageCreateInfo image_info;
+                image_info.imageType = vk::ImageType::e2D;
+                image_info.extent.width = r.desc.extent.width;
+                image_info.extent.height = r.desc.extent.height;
+                image_info.extent.depth = 1u;
+                image_info.mipLevels = 1u;
+                image_info.arrayLayers = 1u;
+                image_info.format = r.desc.format;
+                image_info.tiling = vk::ImageTiling::eOptimal;
+                image_info.initialLayout = vk::ImageLayout::eUndefined;
+                image_info.usage = r.desc.usage;
+                image_info.samples = r.desc.samples;
+                image_info.sharingMode = vk::SharingMode::eExclusive;
+                r.owned_image = device.createImageUnique( image_info );
+                auto const requirements =
+                    device.getImageMemoryRequirements( *r.owned_image );
+
+                auto it = std::find_if(
+                    blocks.begin(), blocks.end(), [&]( block const &b ) {
+                        return b.last_use < first[ id ] &&
+                            ( b.type_bits & requirements.memoryTypeBits );
+                    } );
+                if( it == blocks.end() )
+                {
+                    blocks.push_back( block() );
+                    it = blocks.end() - 1;
+                }
+                r.alias_previous = it->last_resource;
+                // Offset 0 satisfies any alignment.
+                it->size = std::max( it->size, requirements.size );
+                it->type_bits &= requirements.memoryTypeBits;
+                it->last_use = last[ id ];
+                it->last_resource = id;
+                placement[ id ] =
+                    static_cast< std::size_t >( it - blocks.begin() );
+            }
+
+            memory_blocks.clear();
+            transient_memory = 0u;
+            for( auto const &b : blocks )
+            {
+                vk::MemoryAllocateInfo memory_allocate_info;
+                memory_allocate_info.allocationSize = b.size;
+                memory_allocate_info.memoryTypeIndex = select_memory_type(
+                    memory_properties,
+                    b.type_bits,
+                    vk::MemoryPropertyFlagBits::eDeviceLocal );
+                memory_blocks.push_back(
+                    device.allocateMemoryUnique( memory_allocate_info ) );
+                transient_memory += b.size;
+            }
+            for( auto const id : order )
+            {
+                auto &r = resources[ id ];
+                device.bindImageMemory(
+                    *r.owned_image, *memory_blocks[ placement[ id ] ], 0u );
+
+                vk::ImageViewCreateInfo view_info;
+                view_info.image = *r.owned_image;
+                view_info.viewType = vk::ImageViewType::e2D;
+                view_info.format = r.desc.format;
+                view_info.subresourceRange.aspectMask = r.aspect;
+                view_info.subresourceRange.baseMipLevel = 0u;
+                view_info.subresourceRange.levelCount = 1u;
+                view_info.subresourceRange.baseArrayLayer = 0u;
+                view_info.subresourceRange.layerCount = 1u;
+                r.owned_view = device.createImageViewUnique( view_info );
+            }
+        }
+
+        static std::uint32_t select_memory_type(
+            vk::PhysicalDeviceMemoryProperties const &memory_properties,
+            std::uint32_t type_bits,
+            vk::MemoryPropertyFlags preferred )
+        {
+            for( std::uint32_t i = 0u; i < memory_properties.memoryTypeCount;
+                 ++i )
+            {
+                if( ( type_bits & ( 1u << i ) ) &&
+                    ( memory_properties.memoryTypes[ i ].propertyFlags &
+                      preferred ) == preferred )
+                {
+                    return i;
+                }
+            }
+            for( std::uint32_t i = 0u; i < memory_properties.memoryTypeCount;
+                 ++i )
+            {
+                if( type_bits & ( 1u << i ) ) return i;
+            }
+            throw std::runtime_error(
+                "render_graph: no memory type for transient image!" );
+        }
+
+        // Adds the barrier (if any) that makes `use` of resource `id` safe
+        // after everything recorded so far, and advances its state. A final
+        // usage that keeps the layout and writes needs nothing here: the
+        // next graph synchronises against it as its initial usage.
+        void transition(
+            std::vector< resource_state > &state,
+            barrier_batch &batch,
+            resource_id id,
+            usage use,
+            bool final = false )
+        {
+            auto const &r = resources[ id ];
+            auto &s = state[ id ];
+            if( !s.started )
+            {
+                s.started = true;
+                if( r.transient )
+                {
+                    if( r.alias_previous != INVALID_RESOURCE )
+                    {
+                        auto const &p = state[ r.alias_previous ];
+                        s.write_stages = p.write_stages | p.read_stages;
+                        s.write_access = p.write_access;
+                    }
+                }
+                else
+                {
+                    auto const initial = get_access_info( r.initial );
+                    s.layout = initial.layout;
+                    if( initial.write )
+                    {
+                        s.write_stages = initial.stages | r.wait_stages;
+                        s.write_access = initial.access;
+                    }
+                    else
+                    {
+                        s.read_stages = initial.stages | r.wait_stages;
+                    }
+                }
+            }
+
+            auto const info = get_access_info( use );
+            bool const layout_change = r.image && s.layout != info.layout;
+            bool needed = false;
+            vk::PipelineStageFlags src_stages{};
+            if( layout_change || info.write )
+            {
+                src_stages = s.write_stages | s.read_stages;
+                needed = layout_change || ( !final && src_stages );
+            }
+            else
+            {
+                src_stages = s.write_stages;
+                needed = src_stages &&
+                    ( ( s.visible_stages & info.stages ) != info.stages ||
+                      ( s.visible_access & info.access ) != info.access );
+            }
+            if( needed )
+            {
+                batch.src_stages |= src_stages;
+                batch.dst_stages |= info.stages;
+                batch.barriers.push_back(
+                    {id,
+                     s.write_access,
+                     info.access,
+                     r.image ? s.layout : vk::ImageLayout::eUndefined,
+                     r.image ? info.layout : vk::ImageLayout::eUndefined} );
+            }
+
+            if( info.write )
+            {
+                s.write_stages = info.stages;
+                s.write_access = info.access;
+                s.read_stages = vk::PipelineStageFlags{};
+                s.visible_stages = vk::PipelineStageFlags{};
+                s.visible_access = vk::AccessFlags{};
+            }
+            else
+            {
+                s.read_stages |= info.stages;
+                s.visible_stages |= info.stages;
+                s.visible_access |= info.access;
+            }
+            if( r.image ) s.layout = info.layout;
+        }
+
+        void derive_barriers( void )
+        {
+            std::vector< resource_state > state( resources.size() );
+            for( auto &s : steps )
+            {
+                for( auto const &a : passes[ s.pass ].accesses )
+                    transition( state, s.before, a.resource, a.use );
+            }
+            final_barriers = barrier_batch();
+            for( resource_id id = 0u; id < resources.size(); ++id )
+            {
+                auto const &r = resources[ id ];
+                if( r.transient || r.final == usage::undefined ) continue;
+                transition( state, final_barriers, id, r.final, true );
+            }
+        }
+
+        void emit(
+            vk::CommandBuffer command_buffer, barrier_batch const &batch ) const
+        {
+            if( batch.barriers.empty() ) return;
+            std::vector< vk::ImageMemoryBarrier > image_barriers;
+            std::vector< vk::BufferMemoryBarrier > buffer_barriers;
+            for( auto const &b : batch.barriers )
+            {
+                auto const &r = resources[ b.resource ];
+                if( r.image )
+                {
+                    vk::ImageMemoryBarrier image_barrier;
+                    image_barrier.srcAccessMask = b.src_access;
+                    image_barrier.dstAccessMask = b.dst_access;
+                    image_barrier.oldLayout = b.old_layout;
+                    image_barrier.newLayout = b.new_layout;
+                    image_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+                    image_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+                    image_barrier.image = get_image( b.resource );
+                    image_barrier.subresourceRange.aspectMask = r.aspect;
+                    image_barrier.subresourceRange.baseMipLevel = 0u;
+                    image_barrier.subresourceRange.levelCount =
+                        VK_REMAINING_MIP_LEVELS;
+                    image_barrier.subresourceRange.baseArrayLayer = 0u;
+                    image_barrier.subresourceRange.layerCount =
+                        VK_REMAINING_ARRAY_LAYERS;
+                    image_barriers.push_back( image_barrier );
+                }
+                else
+                {
+                    vk::BufferMemoryBarrier buffer_barrier;
+                    buffer_barrier.srcAccessMask = b.src_access;
+                    buffer_barrier.dstAccessMask = b.dst_access;
+                    buffer_barrier.srcQueueFamilyIndex =
+                        VK_QUEUE_FAMILY_IGNORED;
+                    buffer_barrier.dstQueueFamilyIndex =
+                        VK_QUEUE_FAMILY_IGNORED;
+                    buffer_barrier.buffer = r.bound_buffer;
+                    buffer_barrier.offset = 0u;
+                    buffer_barrier.size = VK_WHOLE_SIZE;
+                    buffer_barriers.push_back( buffer_barrier );
+                }
+            }
+            command_buffer.pipelineBarrier(
+                batch.src_stages ? batch.src_stages
+                                 : vk::PipelineStageFlagBits::eTopOfPipe,
+                batch.dst_stages ? batch.dst_stages
+                                 : vk::PipelineStageFlagBits::eBottomOfPipe,
+                vk::DependencyFlags{},
+                nullptr,
+                buffer_barriers,
+                image_barriers );
+        }
+    };
+
+} // namespace graph
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+#include <vulkan/vulkan.hpp>
+
+namespace sampler
+{
+
+    // The sampler parameters this renderer varies; everything else keeps
+    // the vk::SamplerCreateInfo default.
+    struct sampler_state
+    {
+        vk::Filter filter = vk::Filter::eLinear;
+        vk::SamplerMipmapMode mipmap_mode = vk::SamplerMipmapMode::eLinear;
+        vk::SamplerAddressMode address_mode = vk::SamplerAddressMode::eRepeat;
+        float max_lod = 0.0f;
+
+        bool operator==( sampler_state const &other ) const
+        {
+            return filter == other.filter &&
+                mipmap_mode == other.mipmap_mode &&
+                address_mode == other.address_mode &&
+                max_lod == other.max_lod;
+        }
+        bool operator!=( sampler_state const &other ) const
+        {
+            return !( *this == other );
+        }
+    };
+
+    struct sampler_state_hash
+    {
+        std::size_t operator()( sampler_state const &s ) const
+        {
+            std::uint32_t lod;
+            std::memcpy( &lod, &s.max_lod, sizeof( lod ) );
+            std::uint64_t h = 14695981039346656037ull;
+            for( std::uint32_t v : {static_cast< std::uint32_t >( s.filter ),
+                                    static_cast< std::uint32_t >(
+                                        s.mipmap_mode ),
+                                    static_cast< std::uint32_t >(
+                                        s.address_mode ),
+                                    lod} )
+            {
+                h = ( h ^ v ) * 1099511628211ull;
+            }
+            return static_cast< std::size_t >( h );
+        }
+    };
+
+    // One vk::Sampler per distinct state, created on first use and shared
+    // by everything sampling with that state. Thread-safe.
+    class sampler_cache
+    {
+    private:
+        vk::Device device = nullptr;
+        std::mutex mutex{};
+        std::unordered_map<
+            sampler_state,
+            vk::UniqueSampler,
+            sampler_state_hash >
+            samplers{};
+
+    public:
+        void set_device( vk::Device _device )
+        {
+            device = _device;
+        }
+        vk::Sampler get( sampler_state const &state )
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+            auto it = samplers.find( state );
+            if( it == samplers.end() )
+            {
+                vk::SamplerCreateInfo sampler_info;
+                sampler_info.magFilter = state.filter;
+                sampler_info.minFilter = state.filter;
+                sampler_info.mipmapMode = state.mipmap_mode;
+                sampler_info.addressModeU = state.address_mode;
+                sampler_info.addressModeV = state.address_mode;
+                sampler_info.addressModeW = state.address_mode;
+                sampler_info.maxLod = state.max_lod;
+                it = samplers
+                         .emplace(
+                             state, device.createSamplerUnique( sampler_info ) )
+                         .first;
+            }
+            return *it->second;
+        }
+        std::size_t size( void )
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+            return samplers.size();
+        }
+    };
+
+} // namespace sampler
@@ -0,0 +1,330 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#if defined( __SSE__ ) || defined( _M_X64 ) || \
+    ( defined( _M_IX86_FP ) && _M_IX86_FP >= 1 )
+#define SCENE_GRAPH_SSE 1
+#include <xmmintrin.h>
+#endif
+
+namespace scene
+{
+
+    using node_id = std::uint32_t;
+    constexpr node_id INVALID_NODE = std::numeric_limits< node_id >::max();
+
+    // Nodes first to last - 1.
+    struct node_range
+    {
+        node_id first = 0u, last = 0u;
+    };
+
+    // Node transforms stored structure-of-arrays (position, rotation
+    // quaternion, scale), so local matrices are built four nodes per SIMD
+    // batch. A parent must exist before its children, which keeps nodes in
+    // parent-before-child order and lets one forward pass resolve the
+    // hierarchy. Only nodes changed since the last update(), and their
+    // descendants, are recomputed and written out.
+    class scene_graph
+    {
+    public:
+        static constexpr std::size_t MATRIX_SIZE = 16u * sizeof( float );
+
+    private:
+        static constexpr std::size_t BATCH = 4u;
+
+        std::vector< node_id > parents{};
+        // Padded to a multiple of BATCH with identity transforms.
+        std::vector< float > px{}, py{}, pz{};
+        std::vector< float > qx{}, qy{}, qz{}, qw{};
+        std::vector< float > sx{}, sy{}, sz{};
+        std::vector< std::uint8_t > dirty{};
+        // Column-major 4x4 matrices, one per node.
+        std::vector< float > local{}, world{};
+
+    public:
+        node_id add_node( node_id parent = INVALID_NODE )
+        {
+            auto const id = static_cast< node_id >( parents.size() );
+            if( parent != INVALID_NODE && parent >= id )
+            {
+                throw std::runtime_error(
+                    "scene_graph::add_node: unknown parent!" );
+            }
+            parents.push_back( parent );
+            if( parents.size() > px.size() )
+            {
+                auto const padded = px.size() + BATCH;
+                for( auto v : {&px, &py, &pz, &qx, &qy, &qz, &sx, &sy, &sz} )
+                    v->resize( padded, 0.0f );
+                qw.resize( padded, 1.0f );
+                std::fill( sx.end() - BATCH, sx.end(), 1.0f );
+                std::fill( sy.end() - BATCH, sy.end(), 1.0f );
+                std::fill( sz.end() - BATCH, sz.end(), 1.0f );
+                dirty.resize( padded, 0u );
+                local.resize( padded * 16u, 0.0f );
+                world.resize( padded * 16u, 0.0f );
+            }
+            dirty[ id ] = 1u;
+            return id;
+        }
+        std::size_t size( void ) const
+        {
+            return parents.size();
+        }
+
+        void set_position( node_id id, float x, float y, float z )
+        {
+            check( id );
+            px[ id ] = x;
+            py[ id ] = y;
+            pz[ id ] = z;
+            dirty[ id ] = 1u;
+        }
+        // Unit quaternion (x, y, z, w).
+        void set_rotation( node_id id, float x, float y, float z, float w )
+        {
+            check( id );
+            qx[ id ] = x;
+            qy[ id ] = y;
+            qz[ id ] = z;
+            qw[ id ] = w;
+            dirty[ id ] = 1u;
+        }
+        void set_scale( node_id id, float x, float y, float z )
+        {
+            check( id );
+            sx[ id ] = x;
+            sy[ id ] = y;
+            sz[ id ] = z;
+            dirty[ id ] = 1u;
+        }
+
+        // World matrix as of the last update().
+        float const *get_world( node_id id ) const
+        {
+            check( id );
+            return &world[ id * 16u ];
+        }
+
+        // Recomputes the world matrices of changed nodes and their
+        // descendants and writes each one (MATRIX_SIZE bytes) to
+        // destination + id * stride, e.g. a persistently mapped instance
+        // buffer. destination may be null. Returns the number of nodes
+        // updated.
+        std::size_t update(
+            void *destination = nullptr, std::size_t stride = MATRIX_SIZE )
+        {
+            update_local( 0u, prepare() );
+            return update_world( destination, stride );
+        }
+
+        // update() in three phases, so the local matrices can be split
+        // across threads: prepare() marks the descendants of changed
+        // nodes and returns the number of batches; update_local() may run
+        // concurrently on disjoint batch ranges; update_world() finishes
+        // and, given ranges, appends the runs of nodes it updated.
+        std::size_t prepare( void )
+        {
+            auto const count = parents.size();
+            for( std::size_t i = 0u; i < count; ++i )
+            {
+                auto const parent = parents[ i ];
+                if( parent != INVALID_NODE && dirty[ parent ] ) dirty[ i ] = 1u;
+            }
+            return batch_count();
+        }
+        void update_local( std::size_t first_batch, std::size_t last_batch )
+        {
+            last_batch = std::min( last_batch, batch_count() );
+            for( auto b = first_batch; b < last_batch; ++b )
+            {
+                auto const i = b * BATCH;
+                if( dirty[ i ] | dirty[ i + 1u ] | dirty[ i + 2u ] |
+                    dirty[ i + 3u ] )
+                {
+                    compute_local_batch( i );
+                }
+            }
+        }
+        std::size_t update_world(
+            void *destination = nullptr,
+            std::size_t stride = MATRIX_SIZE,
+            std::vector< node_range > *ranges = nullptr )
+        {
+            auto const count = parents.size();
+            auto const out = static_cast< std::uint8_t * >( destination );
+            std::size_t updated = 0u;
+            for( std::size_t i = 0u; i < count; ++i )
+            {
+                if( !dirty[ i ] ) continue;
+                auto const parent = parents[ i ];
+                if( parent == INVALID_NODE )
+                {
+                    std::memcpy(
+                        &world[ i * 16u ], &local[ i * 16u ], MATRIX_SIZE );
+                }
+                else
+                {
+                    multiply(
+                        &world[ parent * 16u ],
+                        &local[ i * 16u ],
+                        &world[ i * 16u ] );
+                }
+                if( out )
+                {
+                    std::memcpy(
+                        out + i * stride, &world[ i * 16u ], MATRIX_SIZE );
+                }
+                dirty[ i ] = 0u;
+                ++updated;
+                if( !ranges ) continue;
+                auto const id = static_cast< node_id >( i );
+                if( !ranges->empty() && ranges->back().last == id )
+                    ranges->back().last = id + 1u;
+                else
+                    ranges->push_back( {id, id + 1u} );
+            }
+            return updated;
+        }
+        std::size_t batch_count( void ) const
+        {
+            return ( parents.size() + BATCH - 1u ) / BATCH;
+        }
+
+    private:
+        void check( node_id id ) const
+        {
+            if( id >= parents.size() )
+            {
+                throw std::out_of_range( "scene_graph: invalid node" );
+            }
+        }
+
+        // local = T * R * S for nodes i..i+3.
+        void compute_local_batch( std::size_t i )
+        {
+#if defined( SCENE_GRAPH_SSE )
+            auto const x = _mm_loadu_ps( &qx[ i ] ),
+                       y = _mm_loadu_ps( &qy[ i ] ),
+                       z = _mm_loadu_ps( &qz[ i ] ),
+                       w = _mm_loadu_ps( &qw[ i ] );
+            auto const one = _mm_set1_ps( 1.0f ), two = _mm_set1_ps( 2.0f );
+            auto const xx = _mm_mul_ps( x, x ), yy = _mm_mul_ps( y, y ),
+                       zz = _mm_mul_ps( z, z ), xy = _mm_mul_ps( x, y ),
+                       xz = _mm_mul_ps( x, z ), yz = _mm_mul_ps( y, z ),
+                       wx = _mm_mul_ps( w, x ), wy = _mm_mul_ps( w, y ),
+                       wz = _mm_mul_ps( w, z );
+            auto const scale_x = _mm_loadu_ps( &sx[ i ] ),
+                       scale_y = _mm_loadu_ps( &sy[ i ] ),
+                       scale_z = _mm_loadu_ps( &sz[ i ] );
+            auto const zero = _mm_setzero_ps();
+
+            // Columns of the four matrices, one node per lane.
+            __m128 c0x = _mm_mul_ps(
+                _mm_sub_ps( one, _mm_mul_ps( two, _mm_add_ps( yy, zz ) ) ),
+                scale_x );
+            __m128 c0y = _mm_mul_ps(
+                _mm_mul_ps( two, _mm_add_ps( xy, wz ) ), scale_x );
+            __m128 c0z = _mm_mul_ps(
+                _mm_mul_ps( two, _mm_sub_ps( xz, wy ) ), scale_x );
+            __m128 c0w = zero;
+            __m128 c1x = _mm_mul_ps(
+                _mm_mul_ps( two, _mm_sub_ps( xy, wz ) ), scale_y );
+            __m128 c1y = _mm_mul_ps(
+                _mm_sub_ps( one, _mm_mul_ps( two, _mm_add_ps( xx, zz ) ) ),
+                scale_y );
+            __m128 c1z = _mm_mul_ps(
+                _mm_mul_ps( two, _mm_add_ps( yz, wx ) ), scale_y );
+            __m128 c1w = zero;
+            __m128 c2x = _mm_mul_ps(
+                _mm_mul_ps( two, _mm_add_ps( xz, wy ) ), scale_z );
+            __m128 c2y = _mm_mul_ps(
+                _mm_mul_ps( two, _mm_sub_ps( yz, wx ) ), scale_z );
+            __m128 c2z = _mm_mul_ps(
+                _mm_sub_ps( one, _mm_mul_ps( two, _mm_add_ps( xx, yy ) ) ),
+                scale_z );
+            __m128 c2w = zero;
+            __m128 c3x = _mm_loadu_ps( &px[ i ] );
+            __m128 c3y = _mm_loadu_ps( &py[ i ] );
+            __m128 c3z = _mm_loadu_ps( &pz[ i ] );
+            __m128 c3w = one;
+
+            // Transposed, each register holds one column of one node.
+            _MM_TRANSPOSE4_PS( c0x, c0y, c0z, c0w );
+            _MM_TRANSPOSE4_PS( c1x, c1y, c1z, c1w );
+            _MM_TRANSPOSE4_PS( c2x, c2y, c2z, c2w );
+            _MM_TRANSPOSE4_PS( c3x, c3y, c3z, c3w );
+            __m128 const columns[ 4 ][ 4 ] = {{c0x, c1x, c2x, c3x},
+                                              {c0y, c1y, c2y, c3y},
+                                              {c0z, c1z, c2z, c3z},
+                                              {c0w, c1w, c2w, c3w}};
+            for( std::size_t n = 0u; n < BATCH; ++n )
+            {
+                auto const m = &local[ ( i + n ) * 16u ];
+                for( std::size_t c = 0u; c < 4u; ++c )
+                    _mm_storeu_ps( m + c * 4u, columns[ n ][ c ] );
+            }
+#else
+            for( std::size_t n = i; n < i + BATCH; ++n )
+            {
+                auto const x = qx[ n ], y = qy[ n ], z = qz[ n ], w = qw[ n ];
+                auto const m = &local[ n * 16u ];
+                m[ 0 ] = ( 1.0f - 2.0f * ( y * y + z * z ) ) * sx[ n ];
+                m[ 1 ] = 2.0f * ( x * y + w * z ) * sx[ n ];
+                m[ 2 ] = 2.0f * ( x * z - w * y ) * sx[ n ];
+                m[ 3 ] = 0.0f;
+                m[ 4 ] = 2.0f * ( x * y - w * z ) * sy[ n ];
+                m[ 5 ] = ( 1.0f - 2.0f * ( x * x + z * z ) ) * sy[ n ];
+                m[ 6 ] = 2.0f * ( y * z + w * x ) * sy[ n ];
+                m[ 7 ] = 0.0f;
+                m[ 8 ] = 2.0f * ( x * z + w * y ) * sz[ n ];
+                m[ 9 ] = 2.0f * ( y * z - w * x ) * sz[ n ];
+                m[ 10 ] = ( 1.0f - 2.0f * ( x * x + y * y ) ) * sz[ n ];
+                m[ 11 ] = 0.0f;
+                m[ 12 ] = px[ n ];
+                m[ 13 ] = py[ n ];
+                m[ 14 ] = pz[ n ];
+                m[ 15 ] = 1.0f;
+            }
+#endif
+        }
+
+        // out = a * b, column-major.
+        static void multiply( float const *a, float const *b, float *out )
+        {
+#if defined( SCENE_GRAPH_SSE )
+            auto const a0 = _mm_loadu_ps( a ), a1 = _mm_loadu_ps( a + 4 ),
+                       a2 = _mm_loadu_ps( a + 8 ), a3 = _mm_loadu_ps( a + 12 );
+            for( std::size_t c = 0u; c < 4u; ++c )
+            {
+                auto const col = b + c * 4u;
+                auto r = _mm_mul_ps( a0, _mm_set1_ps( col[ 0 ] ) );
+                r = _mm_add_ps( r, _mm_mul_ps( a1, _mm_set1_ps( col[ 1 ] ) ) );
+                r = _mm_add_ps( r, _mm_mul_ps( a2, _mm_set1_ps( col[ 2 ] ) ) );
+                r = _mm_add_ps( r, _mm_mul_ps( a3, _mm_set1_ps( col[ 3 ] ) ) );
+                _mm_storeu_ps( out + c * 4u, r );
+            }
+#else
+            for( std::size_t c = 0u; c < 4u; ++c )
+            {
+                for( std::size_t r = 0u; r < 4u; ++r )
+                {
+                    out[ c * 4u + r ] = a[ r ] * b[ c * 4u ] +
+                        a[ 4u + r ] * b[ c * 4u + 1u ] +
+                        a[ 8u + r ] * b[ c * 4u + 2u ] +
+                        a[ 12u + r ] * b[ c * 4u + 3u ];
+                }
+            }
+#endif
+        }
+    };
+
+} // namespace scene
@@ -1,10 +1,22 @@
 #version 450
 #extension GL_ARB_separate_shader_objects : enable
 
+// 0: vertex color, 1: grayscale, 2: inverted (see color_mode in main.cpp).
+layout(constant_id = 0) const uint COLOR_MODE = 0u;
+
+layout(binding = 1) uniform sampler2D texSampler;
+
 layout(location = 0) in vec3 fragColor;
+layout(location = 1) in vec2 fragTexCoord;
 
 layout(location = 0) out vec4 outColor;
 
 void main() {
-    outColor = vec4(fragColor, 1.0);
+    vec3 color = fragColor * texture(texSampler, fragTexCoord).rgb;
+    if (COLOR_MODE == 1u) {
+        color = vec3(dot(color, vec3(0.2126, 0.7152, 0.0722)));
+    } else if (COLOR_MODE == 2u) {
+        color = vec3(1.0) - color;
+    }
+    outColor = vec4(color, 1.0);
 }
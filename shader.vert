@@ -9,14 +9,20 @@ layout(binding = 0) uniform UniformBufferObject {
 
 layout(location = 0) in vec3 inPosition;
 layout(location = 1) in vec3 inColor;
+// Per-instance world matrix, locations 2 to 5.
+layout(location = 2) in mat4 inModel;
 
 layout(location = 0) out vec3 fragColor;
+// The cube spans -0.5 to 0.5, so xy maps each face onto the texture.
+layout(location = 1) out vec2 fragTexCoord;
 
 out gl_PerVertex {
     vec4 gl_Position;
 };
 
 void main() {
-    gl_Position = ubo.proj * ubo.view * ubo.model * vec4(inPosition, 1.0);
+    gl_Position = ubo.proj * ubo.view * ubo.model * inModel *
+        vec4(inPosition, 1.0);
     fragColor = inColor;
+    fragTexCoord = inPosition.xy + 0.5;
 }
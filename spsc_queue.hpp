@@ -0,0 +1,60 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+namespace spsc
+{
+
+    // Bounded lock-free queue for exactly one producer thread and one
+    // consumer thread. Each side only writes its own index, so neither
+    // ever blocks; try_push() fails when the queue is full and try_pop()
+    // when it is empty.
+    template < typename T, std::size_t Capacity >
+    class queue
+    {
+        static_assert(
+            Capacity > 0u && ( Capacity & ( Capacity - 1u ) ) == 0u,
+            "spsc::queue: capacity must be a power of two" );
+        static_assert(
+            std::is_default_constructible< T >::value,
+            "spsc::queue: element type must be default constructible" );
+
+    private:
+        static constexpr std::size_t CACHE_LINE = 64u;
+
+        std::array< T, Capacity > slots{};
+        // Free-running counters; the slot is the counter modulo Capacity.
+        alignas( CACHE_LINE ) std::atomic< std::size_t > head{0u};
+        alignas( CACHE_LINE ) std::atomic< std::size_t > tail{0u};
+
+    public:
+        // Producer side.
+        bool try_push( T value )
+        {
+            auto const t = tail.load( std::memory_order_relaxed );
+            if( t - head.load( std::memory_order_acquire ) == Capacity )
+                return false;
+            slots[ t & ( Capacity - 1u ) ] = std::move( value );
+            tail.store( t + 1u, std::memory_order_release );
+            return true;
+        }
+        // Consumer side.
+        bool try_pop( T &value )
+        {
+            auto const h = head.load( std::memory_order_relaxed );
+            if( h == tail.load( std::memory_order_acquire ) ) return false;
+            value = std::move( slots[ h & ( Capacity - 1u ) ] );
+            head.store( h + 1u, std::memory_order_release );
+            return true;
+        }
+        static constexpr std::size_t capacity( void )
+        {
+            return Capacity;
+        }
+    };
+
+} // namespace spsc
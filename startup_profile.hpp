@@ -0,0 +1,104 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace startup
+{
+
+    // Wall-clock phases of startup, timed from the profile's construction
+    // (as early in main() as possible) up to the first presented frame.
+    // Phases may run concurrently on several threads; report() lists them
+    // in the order they started, with their offsets, so overlap shows.
+    class profile
+    {
+    private:
+        using clock = std::chrono::steady_clock;
+        struct phase
+        {
+            std::string name{};
+            clock::duration start{}, length{};
+        };
+
+        clock::time_point origin = clock::now();
+        mutable std::mutex mutex{};
+        std::vector< phase > phases{};
+        clock::duration first_frame{};
+        bool first_frame_done = false;
+
+    public:
+        profile( void ) = default;
+        profile( profile const & ) = delete;
+        profile &operator=( profile const & ) = delete;
+
+        // Runs f as the phase name and returns what it returns.
+        template < typename F >
+        auto measure( std::string name, F const &f ) -> decltype( f() )
+        {
+            struct recorder
+            {
+                profile &self;
+                std::string name;
+                clock::time_point start;
+                ~recorder( void )
+                {
+                    self.record( std::move( name ), start, clock::now() );
+                }
+            } const r{*this, std::move( name ), clock::now()};
+            return f();
+        }
+        // Only the first call counts; returns whether it was that one.
+        bool mark_first_frame( void )
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+            if( first_frame_done ) return false;
+            first_frame = clock::now() - origin;
+            first_frame_done = true;
+            return true;
+        }
+        double get_time_to_first_frame_ms( void ) const
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+            return to_ms( first_frame );
+        }
+
+        void report( std::ostream &out ) const
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+            for( auto const &p : phases )
+            {
+                out << "startup: " << p.name << " " << to_ms( p.length )
+                    << " ms (at " << to_ms( p.start ) << " ms)" << std::endl;
+            }
+            if( first_frame_done )
+            {
+                out << "startup: first frame at " << to_ms( first_frame )
+                    << " ms" << std::endl;
+            }
+        }
+
+    private:
+        void record(
+            std::string name, clock::time_point start, clock::time_point end )
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+            phase p;
+            p.name = std::move( name );
+            p.start = start - origin;
+            p.length = end - start;
+            auto it = phases.begin();
+            while( it != phases.end() && it->start <= p.start ) ++it;
+            phases.insert( it, std::move( p ) );
+        }
+        static double to_ms( clock::duration d )
+        {
+            return std::chrono::duration< double, std::milli >( d ).count();
+        }
+    };
+
+} // namespace startup
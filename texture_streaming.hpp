@@ -0,0 +1,497 @@
+#pragma once
+
+#include "format_cache.hpp"
+#include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace texture
+{
+
+    // One tightly packed image: RGBA8 pixels or compressed blocks,
+    // depending on the format of the texture it belongs to.
+    struct image_data
+    {
+        std::uint32_t width = 0u, height = 0u;
+        std::vector< std::uint8_t > bytes{};
+    };
+
+    inline std::uint32_t mip_count( std::uint32_t width, std::uint32_t height )
+    {
+        std::uint32_t levels = 1u;
+        for( auto size = std::max( width, height ); size > 1u; size >>= 1u )
+            ++levels;
+        return levels;
+    }
+
+    // Binary PPM (P6, 8 bits per channel); alpha is set to opaque.
+    inline image_data load_ppm( std::string const &filename )
+    {
+        std::ifstream file( filename, std::ios::binary );
+        if( !file.is_open() )
+        {
+            throw std::runtime_error( "failed to open file " + filename );
+        }
+        auto next_field = [&file, &filename]() {
+            file >> std::ws;
+            while( file.peek() == '#' )
+            {
+                file.ignore(
+                    std::numeric_limits< std::streamsize >::max(), '\n' );
+                file >> std::ws;
+            }
+            std::string field;
+            file >> field;
+            if( !file ) throw std::runtime_error( "truncated PPM " + filename );
+            return field;
+        };
+        if( next_field() != "P6" )
+        {
+            throw std::runtime_error( "not a binary PPM: " + filename );
+        }
+        image_data image;
+        image.width =
+            static_cast< std::uint32_t >( std::stoul( next_field() ) );
+        image.height =
+            static_cast< std::uint32_t >( std::stoul( next_field() ) );
+        if( image.width == 0u || image.height == 0u ||
+            std::stoul( next_field() ) != 255u )
+        {
+            throw std::runtime_error( "unsupported PPM " + filename );
+        }
+        file.get();
+        std::vector< char > rgb(
+            std::size_t( image.width ) * image.height * 3u );
+        if( !file.read(
+                rgb.data(), static_cast< std::streamsize >( rgb.size() ) ) )
+        {
+            throw std::runtime_error( "truncated PPM " + filename );
+        }
+        image.bytes.resize( std::size_t( image.width ) * image.height * 4u );
+        for( std::size_t i = 0u, j = 0u; i < rgb.size(); i += 3u, j += 4u )
+        {
+            for( std::size_t c = 0u; c < 3u; ++c )
+            {
+                image.bytes[ j + c ] =
+                    static_cast< std::uint8_t >( rgb[ i + c ] );
+            }
+            image.bytes[ j + 3u ] = 0xffu;
+        }
+        return image;
+    }
+
+    // Next level of a mip chain with a 2x2 box filter.
+    inline image_data downsample( image_data const &src )
+    {
+        image_data dst;
+        dst.width = std::max( src.width >> 1u, 1u );
+        dst.height = std::max( src.height >> 1u, 1u );
+        dst.bytes.resize( std::size_t( dst.width ) * dst.height * 4u );
+        auto texel = [&src](
+                         std::uint32_t x, std::uint32_t y, std::uint32_t c ) {
+            x = std::min( x, src.width - 1u );
+            y = std::min( y, src.height - 1u );
+            return unsigned(
+                src.bytes[ ( std::size_t( y ) * src.width + x ) * 4u + c ] );
+        };
+        for( std::uint32_t y = 0u; y < dst.height; ++y )
+        {
+            for( std::uint32_t x = 0u; x < dst.width; ++x )
+            {
+                for( std::uint32_t c = 0u; c < 4u; ++c )
+                {
+                    auto const sum = texel( 2u * x, 2u * y, c ) +
+                        texel( 2u * x + 1u, 2u * y, c ) +
+                        texel( 2u * x, 2u * y + 1u, c ) +
+                        texel( 2u * x + 1u, 2u * y + 1u, c );
+                    dst.bytes[ ( std::size_t( y ) * dst.width + x ) * 4u + c ] =
+                        static_cast< std::uint8_t >( ( sum + 2u ) / 4u );
+                }
+            }
+        }
+        return dst;
+    }
+
+    // A whole mip chain, largest level first, as stored in a file.
+    struct texture_data
+    {
+        vk::Format format = vk::Format::eR8G8B8A8Unorm;
+        std::vector< image_data > mips{};
+    };
+
+    inline bool is_ktx2( std::string const &filename )
+    {
+        static char const IDENTIFIER[] = "\xabKTX 20\xbb\r\n\x1a\n";
+        std::ifstream file( filename, std::ios::binary );
+        std::array< char, sizeof( IDENTIFIER ) - 1u > identifier{};
+        return file.read( identifier.data(), identifier.size() ) &&
+            std::equal( identifier.begin(), identifier.end(), IDENTIFIER );
+    }
+
+    // KTX2 container holding a plain 2D texture in a format
+    // format::get_block_info() knows, e.g. BC, ETC2 or ASTC. Levels are
+    // taken from the file as they are; supercompressed (Basis, zstd)
+    // files are rejected.
+    inline texture_data load_ktx2( std::string const &filename )
+    {
+        std::ifstream file( filename, std::ios::ate | std::ios::binary );
+        if( !file.is_open() )
+        {
+            throw std::runtime_error( "failed to open file " + filename );
+        }
+        std::vector< std::uint8_t > bytes(
+            static_cast< std::size_t >( file.tellg() ) );
+        file.seekg( 0 );
+        file.read(
+            reinterpret_cast< char * >( bytes.data() ),
+            static_cast< std::streamsize >( bytes.size() ) );
+        auto const read = [&bytes, &filename](
+                              std::size_t offset, std::size_t size ) {
+            if( offset + size > bytes.size() )
+                throw std::runtime_error( "truncated KTX2 " + filename );
+            std::uint64_t value = 0u;
+            for( std::size_t i = size; i-- > 0u; )
+                value = ( value << 8u ) | bytes[ offset + i ];
+            return value;
+        };
+        auto const u32 = [&read]( std::size_t offset ) {
+            return static_cast< std::uint32_t >( read( offset, 4u ) );
+        };
+
+        texture_data texture;
+        texture.format = static_cast< vk::Format >( u32( 12u ) );
+        auto const width = u32( 20u ), height = u32( 24u );
+        auto const depth = u32( 28u ), layers = u32( 32u ),
+                   faces = u32( 36u );
+        auto const levels = std::max( u32( 40u ), 1u );
+        auto const supercompression = u32( 44u );
+        if( format::get_block_info( texture.format ).bytes == 0u ||
+            width == 0u || height == 0u || depth > 1u || layers > 1u ||
+            faces != 1u || supercompression != 0u ||
+            levels > mip_count( width, height ) )
+        {
+            throw std::runtime_error( "unsupported KTX2 " + filename );
+        }
+        // The level index follows the 80 byte header, 24 bytes per level.
+        for( std::uint32_t level = 0u; level < levels; ++level )
+        {
+            auto const offset = read( 80u + level * 24u, 8u );
+            auto const length = read( 80u + level * 24u + 8u, 8u );
+            image_data image;
+            image.width = std::max( width >> level, 1u );
+            image.height = std::max( height >> level, 1u );
+            if( length != format::image_size(
+                              texture.format, image.width, image.height ) ||
+                offset + length > bytes.size() )
+            {
+                throw std::runtime_error( "corrupt KTX2 " + filename );
+            }
+            image.bytes.assign(
+                bytes.begin() + static_cast< std::ptrdiff_t >( offset ),
+                bytes.begin() +
+                    static_cast< std::ptrdiff_t >( offset + length ) );
+            texture.mips.push_back( std::move( image ) );
+        }
+        return texture;
+    }
+
+    using texture_id = std::uint32_t;
+    static constexpr std::uint32_t NOT_RESIDENT =
+        std::numeric_limits< std::uint32_t >::max();
+
+    // Residency change the GPU side has to carry out: replace the image of
+    // texture with one holding levels base_level.. of mips. mips stays
+    // valid as long as the streamer.
+    struct residency_change
+    {
+        texture_id texture = 0u;
+        std::uint32_t base_level = 0u;
+        vk::Format format = vk::Format::eR8G8B8A8Unorm;
+        std::vector< image_data > const *mips = nullptr;
+    };
+
+    // Decides which mip levels of which textures live on the GPU. Files are
+    // decoded, and the CPU mip chains of uncompressed ones built, on a
+    // loader thread so adding a large texture set never stalls a frame.
+    // Once loaded, a texture comes in at a small level first and is refined
+    // by one level per plan() while the byte budget allows; lowering the
+    // budget drops top levels again, largest textures first.
+    class streamer
+    {
+    private:
+        struct entry
+        {
+            std::string path{};
+            image_data source{};
+            // Only written by the loader until loaded is set.
+            vk::Format format = vk::Format::eR8G8B8A8Unorm;
+            std::vector< image_data > mips{};
+            bool loaded = false;
+            bool failed = false;
+            std::uint32_t resident = NOT_RESIDENT;
+        };
+
+        std::mutex mutex{};
+        std::condition_variable wake{};
+        std::deque< entry > entries{};
+        std::deque< texture_id > to_load{};
+        std::size_t budget = 0u, used = 0u;
+        std::function< bool( vk::Format ) > supported{};
+        std::uint32_t first_size = 0u;
+        bool stopping = false;
+        std::thread loader{};
+
+    public:
+        // Files in formats _supported rejects fail to load. first_size caps
+        // the larger dimension of the first level made resident.
+        explicit streamer(
+            std::size_t budget_bytes,
+            std::function< bool( vk::Format ) > _supported = {},
+            std::uint32_t _first_size = 64u )
+            : budget( budget_bytes )
+            , supported( std::move( _supported ) )
+            , first_size( std::max( _first_size, 1u ) )
+        {
+            loader = std::thread( [this]() { load_loop(); } );
+        }
+        streamer( streamer const & ) = delete;
+        streamer &operator=( streamer const & ) = delete;
+        ~streamer( void )
+        {
+            {
+                std::lock_guard< std::mutex > lock( mutex );
+                stopping = true;
+            }
+            wake.notify_all();
+            loader.join();
+        }
+
+        // Queues a KTX2 or PPM file for loading.
+        texture_id add( std::string path )
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+            auto const id = static_cast< texture_id >( entries.size() );
+            entries.emplace_back();
+            entries.back().path = std::move( path );
+            to_load.push_back( id );
+            wake.notify_one();
+            return id;
+        }
+        // Queues RGBA8 pixels already in memory.
+        texture_id add( image_data image )
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+            auto const id = static_cast< texture_id >( entries.size() );
+            entries.emplace_back();
+            entries.back().source = std::move( image );
+            to_load.push_back( id );
+            wake.notify_one();
+            return id;
+        }
+
+        void set_budget( std::size_t budget_bytes )
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+            budget = budget_bytes;
+        }
+        std::size_t get_budget( void )
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+            return budget;
+        }
+        std::size_t get_used( void )
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+            return used;
+        }
+        std::uint32_t get_resident_level( texture_id id )
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+            return entries.at( id ).resident;
+        }
+        bool is_loaded( texture_id id )
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+            return entries.at( id ).loaded;
+        }
+
+        // Returns up to max_changes residency changes and books them as
+        // done; called once per frame by the thread owning the GPU images.
+        std::vector< residency_change > plan( std::size_t max_changes )
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+            std::vector< residency_change > changes;
+            // Over budget: drop the top level of the largest textures.
+            while( used > budget && changes.size() < max_changes )
+            {
+                entry *largest = nullptr;
+                std::size_t largest_bytes = 0u;
+                texture_id largest_id = 0u;
+                for( texture_id id = 0u; id < entries.size(); ++id )
+                {
+                    auto &e = entries[ id ];
+                    if( e.resident == NOT_RESIDENT ||
+                        e.resident + 1u >= e.mips.size() )
+                        continue;
+                    auto const bytes = resident_bytes( e );
+                    if( bytes > largest_bytes )
+                    {
+                        largest = &e;
+                        largest_bytes = bytes;
+                        largest_id = id;
+                    }
+                }
+                if( !largest ) break;
+                move_to(
+                    changes, largest_id, *largest, largest->resident + 1u );
+            }
+            // Within budget: refine the coarsest textures first.
+            while( changes.size() < max_changes )
+            {
+                entry *coarsest = nullptr;
+                texture_id coarsest_id = 0u;
+                std::uint32_t target = 0u;
+                for( texture_id id = 0u; id < entries.size(); ++id )
+                {
+                    auto &e = entries[ id ];
+                    if( !e.loaded || e.resident == 0u ||
+                        planned( changes, id ) )
+                        continue;
+                    auto const level = e.resident == NOT_RESIDENT
+                        ? first_level( e )
+                        : e.resident - 1u;
+                    auto const bytes = mips_bytes( e, level );
+                    if( used - resident_bytes( e ) + bytes > budget &&
+                        e.resident != NOT_RESIDENT )
+                        continue;
+                    if( !coarsest || pixels_of( e, level ) <
+                            pixels_of( *coarsest, target ) )
+                    {
+                        coarsest = &e;
+                        coarsest_id = id;
+                        target = level;
+                    }
+                }
+                if( !coarsest ) break;
+                move_to( changes, coarsest_id, *coarsest, target );
+            }
+            return changes;
+        }
+
+    private:
+        void load_loop( void )
+        {
+            std::unique_lock< std::mutex > lock( mutex );
+            for( ;; )
+            {
+                wake.wait( lock, [this]() {
+                    return stopping || !to_load.empty();
+                } );
+                if( stopping ) return;
+                auto const id = to_load.front();
+                to_load.pop_front();
+                auto &e = entries[ id ];
+                auto const path = e.path;
+                auto image = std::move( e.source );
+                lock.unlock();
+                texture_data data;
+                bool failed = false;
+                try
+                {
+                    if( !path.empty() && is_ktx2( path ) )
+                        data = load_ktx2( path );
+                    else
+                    {
+                        if( !path.empty() ) image = load_ppm( path );
+                        data.mips.push_back( std::move( image ) );
+                    }
+                    if( supported && !supported( data.format ) )
+                    {
+                        throw std::runtime_error(
+                            "unsupported texture format " + path );
+                    }
+                    // Compressed chains are only as deep as the file's.
+                    auto const levels = mip_count(
+                        data.mips[ 0 ].width, data.mips[ 0 ].height );
+                    while( !format::is_compressed( data.format ) &&
+                           data.mips.size() < levels )
+                        data.mips.push_back( downsample( data.mips.back() ) );
+                }
+                catch( std::exception const &error )
+                {
+                    std::cerr << error.what() << std::endl;
+                    failed = true;
+                }
+                lock.lock();
+                e.format = data.format;
+                e.mips = std::move( data.mips );
+                e.failed = failed;
+                e.loaded = !failed;
+            }
+        }
+        std::uint32_t first_level( entry const &e ) const
+        {
+            std::uint32_t level = 0u;
+            while( level + 1u < e.mips.size() &&
+                   std::max( e.mips[ level ].width, e.mips[ level ].height ) >
+                       first_size )
+                ++level;
+            return level;
+        }
+        static std::size_t mips_bytes( entry const &e, std::uint32_t level )
+        {
+            std::size_t bytes = 0u;
+            for( auto l = level; l < e.mips.size(); ++l )
+                bytes += e.mips[ l ].bytes.size();
+            return bytes;
+        }
+        static std::size_t resident_bytes( entry const &e )
+        {
+            return e.resident == NOT_RESIDENT ? 0u
+                                              : mips_bytes( e, e.resident );
+        }
+        static std::size_t pixels_of( entry const &e, std::uint32_t level )
+        {
+            return std::size_t( e.mips[ level ].width ) *
+                e.mips[ level ].height;
+        }
+        static bool planned(
+            std::vector< residency_change > const &changes, texture_id id )
+        {
+            return std::any_of(
+                changes.begin(),
+                changes.end(),
+                [id]( residency_change const &c ) { return c.texture == id; } );
+        }
+        void move_to(
+            std::vector< residency_change > &changes,
+            texture_id id,
+            entry &e,
+            std::uint32_t level )
+        {
+            used = used - resident_bytes( e ) + mips_bytes( e, level );
+            e.resident = level;
+            // Several steps for one texture collapse into a single upload.
+            auto it = std::find_if(
+                changes.begin(),
+                changes.end(),
+                [id]( residency_change const &c ) { return c.texture == id; } );
+            if( it == changes.end() )
+                it = changes.insert( changes.end(), residency_change{} );
+            *it = {id, level, e.format, &e.mips};
+        }
+    };
+
+} // namespace texture
@@ -1,7 +1,14 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <glm/glm.hpp>
+#include <tuple>
+#include <type_traits>
 #include <vulkan/vulkan.hpp>
 
 namespace vulkan
@@ -44,60 +51,305 @@ namespace vulkan
         template < glm::precision P > struct get_vulkan_format< glm::tvec3< glm::uint, P > > { static constexpr vk::Format format = vk::Format::eR32G32B32Uint; };
         template < glm::precision P > struct get_vulkan_format< glm::tvec4< glm::uint, P > > { static constexpr vk::Format format = vk::Format::eR32G32B32A32Uint; };
         // clang-format on
-        template < typename T, std::size_t NUM >
-        inline void get_attribute_description_impl(
-            std::array< vk::VertexInputAttributeDescription, NUM > &ret,
-            std::uint32_t binding,
-            std::size_t index )
-        {
-        }
-        template <
-            typename T,
-            std::size_t NUM,
-            typename Member,
-            typename... Args >
-        inline void get_attribute_description_impl(
-            std::array< vk::VertexInputAttributeDescription, NUM > &ret,
-            std::uint32_t binding,
-            std::size_t index,
-            Member member,
-            Args... args )
-        {
-            using Type =
-                std::decay_t< decltype( std::declval< T >().*member ) >;
-            auto &ri = ret[ index ];
-            ri.binding = binding;
-            ri.location = index; // ȂƎv
-            ri.format = get_vulkan_format< Type >::format;
-            ri.offset = static_cast< std::uint32_t >(
-                reinterpret_cast< std::uintptr_t >(
-                    &( reinterpret_cast< T * >( NULL )->*member ) ) -
-                reinterpret_cast< std::uintptr_t >(
-                    reinterpret_cast< void * >( NULL ) ) );
-            get_attribute_description_impl< T >(
-                ret, binding, index + 1u, std::forward< Args >( args )... );
+    }
+
+    // Packed vertex component types. Each one carries the vk::Format it is
+    // read with, so it can be used as a member of a vertex struct directly.
+    inline std::uint16_t float_to_half( float value )
+    {
+        std::uint32_t f;
+        std::memcpy( &f, &value, sizeof( f ) );
+        std::uint32_t const sign = ( f >> 16 ) & 0x8000u;
+        std::uint32_t const float_exponent = ( f >> 23 ) & 0xffu;
+        std::uint32_t mantissa = f & 0x7fffffu;
+        if( float_exponent == 0xffu )
+        {
+            return static_cast< std::uint16_t >(
+                sign | 0x7c00u | ( mantissa ? 0x200u : 0u ) );
         }
+        std::int32_t const exponent =
+            static_cast< std::int32_t >( float_exponent ) - 127 + 15;
+        if( exponent >= 0x1f )
+        {
+            return static_cast< std::uint16_t >( sign | 0x7c00u );
+        }
+        if( exponent <= 0 )
+        {
+            if( exponent < -10 ) return static_cast< std::uint16_t >( sign );
+            mantissa |= 0x800000u;
+            auto const shift = static_cast< std::uint32_t >( 14 - exponent );
+            auto half_mantissa = mantissa >> shift;
+            auto const rest = mantissa & ( ( 1u << shift ) - 1u );
+            auto const halfway = 1u << ( shift - 1u );
+            if( rest > halfway ||
+                ( rest == halfway && ( half_mantissa & 1u ) ) )
+            {
+                ++half_mantissa;
+            }
+            return static_cast< std::uint16_t >( sign | half_mantissa );
+        }
+        std::uint32_t half = sign |
+            ( static_cast< std::uint32_t >( exponent ) << 10 ) |
+            ( mantissa >> 13 );
+        auto const rest = mantissa & 0x1fffu;
+        if( rest > 0x1000u || ( rest == 0x1000u && ( half & 1u ) ) ) ++half;
+        return static_cast< std::uint16_t >( half );
     }
 
-    template < typename T, typename... Args >
-    inline std::array< vk::VertexInputAttributeDescription, sizeof...( Args ) >
-    get_attribute_description( std::uint32_t binding, Args... args )
+    namespace detail
     {
-        std::array< vk::VertexInputAttributeDescription, sizeof...( Args ) >
-            ret;
-        detail::get_attribute_description_impl< T >(
-            ret, binding, 0u, std::forward< Args >( args )... );
-        return std::move( ret );
+        inline float clamp_normalized( float value, float low )
+        {
+            return std::min( std::max( value, low ), 1.0f );
+        }
+        inline std::int16_t to_snorm16( float value )
+        {
+            return static_cast< std::int16_t >(
+                std::lround( clamp_normalized( value, -1.0f ) * 32767.0f ) );
+        }
+        inline std::uint8_t to_unorm8( float value )
+        {
+            return static_cast< std::uint8_t >(
+                std::lround( clamp_normalized( value, 0.0f ) * 255.0f ) );
+        }
+        inline std::uint32_t to_snorm_bits( float value, std::uint32_t bits )
+        {
+            auto const max =
+                static_cast< float >( ( 1u << ( bits - 1u ) ) - 1u );
+            auto const v = static_cast< std::int32_t >(
+                std::lround( clamp_normalized( value, -1.0f ) * max ) );
+            return static_cast< std::uint32_t >( v ) & ( ( 1u << bits ) - 1u );
+        }
     }
 
-    template < typename T, typename... Args >
-    inline auto
-    get_vertex_input_description( std::uint32_t binding, Args... args )
+    struct half2
     {
-        return std::make_tuple(
-            get_binding_description< T >( binding ),
-            get_attribute_description< T >(
-                binding, std::forward< Args >( args )... ) );
+        std::array< std::uint16_t, 2 > value;
+        static constexpr vk::Format format = vk::Format::eR16G16Sfloat;
+
+        half2() = default;
+        half2( float x, float y )
+            : value{{float_to_half( x ), float_to_half( y )}}
+        {
+        }
+        half2( glm::vec2 const &v )
+            : half2( v.x, v.y )
+        {
+        }
+    };
+
+    struct half4
+    {
+        std::array< std::uint16_t, 4 > value;
+        static constexpr vk::Format format = vk::Format::eR16G16B16A16Sfloat;
+
+        half4() = default;
+        half4( float x, float y, float z, float w = 1.0f )
+            : value{{float_to_half( x ),
+                     float_to_half( y ),
+                     float_to_half( z ),
+                     float_to_half( w )}}
+        {
+        }
+        half4( glm::vec3 const &v )
+            : half4( v.x, v.y, v.z )
+        {
+        }
+        half4( glm::vec4 const &v )
+            : half4( v.x, v.y, v.z, v.w )
+        {
+        }
+    };
+
+    struct snorm16x2
+    {
+        std::array< std::int16_t, 2 > value;
+        static constexpr vk::Format format = vk::Format::eR16G16Snorm;
+
+        snorm16x2() = default;
+        snorm16x2( float x, float y )
+            : value{{detail::to_snorm16( x ), detail::to_snorm16( y )}}
+        {
+        }
+        snorm16x2( glm::vec2 const &v )
+            : snorm16x2( v.x, v.y )
+        {
+        }
+    };
+
+    // Three-component 16-bit formats are rarely supported for vertex fetch,
+    // so positions are padded to four components; the shader sees vec3.
+    struct snorm16x4
+    {
+        std::array< std::int16_t, 4 > value;
+        static constexpr vk::Format format = vk::Format::eR16G16B16A16Snorm;
+
+        snorm16x4() = default;
+        snorm16x4( float x, float y, float z, float w = 1.0f )
+            : value{{detail::to_snorm16( x ),
+                     detail::to_snorm16( y ),
+                     detail::to_snorm16( z ),
+                     detail::to_snorm16( w )}}
+        {
+        }
+        snorm16x4( glm::vec3 const &v )
+            : snorm16x4( v.x, v.y, v.z )
+        {
+        }
+        snorm16x4( glm::vec4 const &v )
+            : snorm16x4( v.x, v.y, v.z, v.w )
+        {
+        }
+    };
+
+    struct unorm8x4
+    {
+        std::array< std::uint8_t, 4 > value;
+        static constexpr vk::Format format = vk::Format::eR8G8B8A8Unorm;
+
+        unorm8x4() = default;
+        unorm8x4( float r, float g, float b, float a = 1.0f )
+            : value{{detail::to_unorm8( r ),
+                     detail::to_unorm8( g ),
+                     detail::to_unorm8( b ),
+                     detail::to_unorm8( a )}}
+        {
+        }
+        unorm8x4( glm::vec3 const &v )
+            : unorm8x4( v.r, v.g, v.b )
+        {
+        }
+        unorm8x4( glm::vec4 const &v )
+            : unorm8x4( v.r, v.g, v.b, v.a )
+        {
+        }
+    };
+
+    // Normals/tangents in 32 bits: 10-bit snorm xyz, 2-bit snorm w (sign).
+    struct snorm_a2b10g10r10
+    {
+        std::uint32_t value;
+        static constexpr vk::Format format =
+            vk::Format::eA2B10G10R10SnormPack32;
+
+        snorm_a2b10g10r10() = default;
+        snorm_a2b10g10r10( float x, float y, float z, float w = 0.0f )
+            : value(
+                  detail::to_snorm_bits( x, 10u ) |
+                  ( detail::to_snorm_bits( y, 10u ) << 10 ) |
+                  ( detail::to_snorm_bits( z, 10u ) << 20 ) |
+                  ( detail::to_snorm_bits( w, 2u ) << 30 ) )
+        {
+        }
+        snorm_a2b10g10r10( glm::vec3 const &v )
+            : snorm_a2b10g10r10( v.x, v.y, v.z )
+        {
+        }
+        snorm_a2b10g10r10( glm::vec4 const &v )
+            : snorm_a2b10g10r10( v.x, v.y, v.z, v.w )
+        {
+        }
+    };
+
+    namespace detail
+    {
+        // clang-format off
+        template <> struct get_vulkan_format< half2 > { static constexpr vk::Format format = half2::format; };
+        template <> struct get_vulkan_format< half4 > { static constexpr vk::Format format = half4::format; };
+        template <> struct get_vulkan_format< snorm16x2 > { static constexpr vk::Format format = snorm16x2::format; };
+        template <> struct get_vulkan_format< snorm16x4 > { static constexpr vk::Format format = snorm16x4::format; };
+        template <> struct get_vulkan_format< unorm8x4 > { static constexpr vk::Format format = unorm8x4::format; };
+        template <> struct get_vulkan_format< snorm_a2b10g10r10 > { static constexpr vk::Format format = snorm_a2b10g10r10::format; };
+        // clang-format on
+
+        constexpr bool any_equal( std::uint32_t )
+        {
+            return false;
+        }
+        template < typename... Rest >
+        constexpr bool
+        any_equal( std::uint32_t value, std::uint32_t first, Rest... rest )
+        {
+            return value == first || any_equal( value, rest... );
+        }
+        constexpr bool unique_locations( void )
+        {
+            return true;
+        }
+        template < typename... Rest >
+        constexpr bool
+        unique_locations( std::uint32_t location, Rest... rest )
+        {
+            return !any_equal( location, rest... ) &&
+                unique_locations( rest... );
+        }
     }
 
+    // One vertex attribute: shader location, component type and byte offset
+    // within the vertex, all known at compile time. Usually spelled with
+    // VULKAN_VERTEX_ATTRIBUTE so the offset comes from offsetof.
+    template < std::uint32_t Location, typename Type, std::uint32_t Offset >
+    struct vertex_attribute
+    {
+        using type = Type;
+        static constexpr std::uint32_t location = Location;
+        static constexpr std::uint32_t offset = Offset;
+        static constexpr vk::Format format =
+            detail::get_vulkan_format< Type >::format;
+
+        static vk::VertexInputAttributeDescription
+        description( std::uint32_t binding )
+        {
+            vk::VertexInputAttributeDescription desc;
+            desc.binding = binding;
+            desc.location = location;
+            desc.format = format;
+            desc.offset = offset;
+            return desc;
+        }
+    };
+
+#define VULKAN_VERTEX_ATTRIBUTE( location, vertex, member )                  \
+    ::vulkan::vertex_attribute<                                              \
+        location,                                                            \
+        std::decay_t< decltype( std::declval< vertex >().member ) >,         \
+        static_cast< std::uint32_t >( offsetof( vertex, member ) ) >
+
+    template < typename T, typename... Attributes >
+    struct vertex_layout
+    {
+        static_assert(
+            detail::unique_locations( Attributes::location... ),
+            "vertex_layout: duplicate attribute location" );
+        static_assert(
+            std::is_standard_layout< T >::value,
+            "vertex_layout: vertex type must be standard layout" );
+
+        static constexpr std::uint32_t stride =
+            static_cast< std::uint32_t >( sizeof( T ) );
+        static constexpr std::size_t attribute_count = sizeof...( Attributes );
+
+        static vk::VertexInputBindingDescription binding_description(
+            std::uint32_t binding = 0u,
+            vk::VertexInputRate input_rate = vk::VertexInputRate::eVertex )
+        {
+            auto desc = get_binding_description< T >( binding );
+            desc.inputRate = input_rate;
+            return desc;
+        }
+        static std::array<
+            vk::VertexInputAttributeDescription,
+            sizeof...( Attributes ) >
+        attribute_descriptions( std::uint32_t binding = 0u )
+        {
+            return {{Attributes::description( binding )...}};
+        }
+        static auto get_vertex_input_description( std::uint32_t binding = 0u )
+        {
+            return std::make_tuple(
+                binding_description( binding ),
+                attribute_descriptions( binding ) );
+        }
+    };
+
 } // namespace vulkan